@@ -0,0 +1,120 @@
+#ifndef BATCH_HPP
+#define BATCH_HPP
+
+#include "common.hpp"
+#include "rb.hpp"
+#include "thread_pool.hpp"
+#include "world.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <vector>
+
+// Many independent runs of one scene in a single process, for sweeping
+// restitution and friction. Each run copies the scene, sets every body's
+// eta and nu to its own values, and is stepped to the end on one thread.
+// Runs are handed out to the pool's threads as they finish, each stepping
+// its runs in a scratch World of its own, so memory grows with the number
+// of threads rather than the number of runs. Copies of a body share its
+// shape's collision samples, so the scene's shapes exist once however many
+// runs there are.
+//
+// The outcome of every run goes into arrays indexed by run: metrics[r],
+// and the bodies' final states in states[r*scene.size() ...]. A run only
+// depends on the scene and its parameters, so results are the same for any
+// number of threads.
+
+struct RunParams {
+    scalar eta, nu;
+};
+
+// per-run results, aggregated over its steps
+struct RunMetrics {
+    int settledStep;       // first step with no awake body, -1 if never
+    float kineticEnergy;   // at the end
+    float meanContacts, maxContacts;
+    float maxHeight;       // of any body's center, at the end
+    float spread;          // largest distance a body moved in the ground plane
+    float ms;              // wall time of the run
+};
+
+class BatchRunner {
+public:
+    std::vector<RigidBody, Eigen::aligned_allocator<RigidBody> > scene;
+    std::vector<RunParams> params;
+    std::vector<RunMetrics> metrics;
+    std::vector<RigidBody, Eigen::aligned_allocator<RigidBody> > states;
+    int steps;
+    scalar dt;
+    int integrator;
+    BatchRunner(): steps(600), dt(1/60.), integrator(EULER) {}
+    // a grid of etas x nus runs
+    void sweep(scalar eta0, scalar eta1, int etas, scalar nu0, scalar nu1, int nus);
+    void run(ThreadPool &pool);
+protected:
+    void runOne(World &world, int r);
+};
+
+void BatchRunner::sweep(scalar eta0, scalar eta1, int etas, scalar nu0, scalar nu1, int nus) {
+    params.clear();
+    for (int i = 0; i < etas; i++)
+        for (int j = 0; j < nus; j++) {
+            RunParams p;
+            p.eta = etas > 1 ? eta0 + (eta1 - eta0)*i/(etas - 1) : eta0;
+            p.nu = nus > 1 ? nu0 + (nu1 - nu0)*j/(nus - 1) : nu0;
+            params.push_back(p);
+        }
+}
+
+void BatchRunner::run(ThreadPool &pool) {
+    int runs = params.size(), n = scene.size();
+    metrics.resize(runs);
+    states.resize((size_t)runs*n);
+    std::atomic<int> next(0);
+    pool.run([&](int) {
+        World world;
+        world.integrator = integrator;
+        for (int r; (r = next.fetch_add(1)) < runs; )
+            runOne(world, r);
+    });
+}
+
+void BatchRunner::runOne(World &world, int r) {
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    int n = scene.size();
+    world.clear();
+    for (int i = 0; i < n; i++) {
+        RigidBody rb = scene[i];
+        rb.eta = params[r].eta;
+        rb.nu = params[r].nu;
+        world.add(rb);
+    }
+    RunMetrics &m = metrics[r];
+    m.settledStep = -1;
+    m.meanContacts = m.maxContacts = 0;
+    for (int s = 0; s < steps; s++) {
+        world.update(dt);
+        const WorldStats &stats = world.stats();
+        m.meanContacts += stats.contacts;
+        m.maxContacts = std::max(m.maxContacts, (float)stats.contacts);
+        if (m.settledStep < 0 && stats.awakeBodies == 0)
+            m.settledStep = s;
+    }
+    m.meanContacts /= std::max(steps, 1);
+    m.kineticEnergy = 0;
+    m.maxHeight = -1e30;
+    m.spread = 0;
+    for (int i = 0; i < n; i++) {
+        const RigidBody &b = world.body(i);
+        m.kineticEnergy += 0.5*b.mass*b.linear_velocity.squaredNorm()
+            + 0.5*b.angular_velocity.dot(b.rotation_matrix * b.inertia_matrix
+                                         * b.rotation_matrix.transpose() * b.angular_velocity);
+        m.maxHeight = std::max(m.maxHeight, (float)b.position[1]);
+        pvec3 moved = b.position - scene[i].position;
+        m.spread = std::max(m.spread, (float)sqrt(moved[0]*moved[0] + moved[2]*moved[2]));
+        states[(size_t)r*n + i] = b;
+    }
+    m.ms = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+#endif
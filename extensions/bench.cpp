@@ -0,0 +1,1320 @@
+// Headless stepping benchmark. Builds a scene without opening a window,
+// steps it, and reports per-phase wall time plus hardware counters (when
+// perf_event_open is permitted) as CSV or JSON.
+//
+//     make bench
+//     ./bench [-m mode] [-n bodies] [-s steps] [-o out.csv | -o out.json]
+//
+// modes:
+//     step         per-phase timings and counters for a pile (default)
+//     integrators  largest stable dt and cost per step of each integrator
+//     precision    throughput and far-from-origin drift of this build's
+//                  precision; `make bench-precision` compares all three
+//     spheres      sphere-sphere narrowphase pairs per second, scalar
+//                  against the batched SIMD kernel
+//     ground       box-ground contact generation from collision samples,
+//                  scalar against SIMD, for -n boxes
+//     sdf          signed distance queries per second, Shape::collisionTest
+//                  against the batched kernels, for -n points and -n shapes
+//     broadphase   parallel broadphase time for -n bodies, from one thread
+//                  up to every hardware thread
+//     solver       narrowphase and colored contact solver time for a pile
+//                  at 1 to every hardware thread, and whether the result
+//                  matches 1 thread
+//     sweep        a grid of eta and nu runs of an -n body pile for -s steps
+//                  each, stepped in one process by the batch runner
+//     locality     per-phase time and cache misses of a pile stored in
+//                  scattered order, then in Morton order, e.g.
+//                  ./bench -m locality -n 100000 -s 20
+//     domains      a pile split into slabs over 1 to 8 processes, with each
+//                  transport: time per step, ghosts and migrations
+//     state        shared memory state export: -s frames of -n bodies
+//                  published flat out while another process reads them,
+//                  e.g. ./bench -m state -n 10000 -s 20000
+//     stream       bytes per body per frame of the remote viewer stream for
+//                  a pile, through a local socket, and its quantization error
+//     filter       pairs rejected by collision groups and the narrowphase time
+//                  saved, for a pile whose lower half is debris that
+//                  ignores other debris
+//     static       step time of a pile alone, on static level geometry of
+//                  -n tiles, and of the level geometry alone
+//     spawn        creating -n bodies with add() one at a time against
+//                  reserve() and one spawn(), and spawning 10 at a time
+//                  into a world with nothing reserved, then a pile that
+//                  spawns and removes 1% of its bodies every step
+//     compound     two compounds of 16 to 4096 children touching at a corner,
+//                  tested through their trees and child pair by child pair,
+//                  then a pile of -n L-shaped compounds
+//     capsule      the closed-form capsule test against the same capsule as a
+//                  chain of 2 to 16 spheres, then piles of -n capsules and of
+//                  -n chains
+//     serve        steps a pile in real time for -s steps, streaming it to
+//                  viewers at -a unix:/path or -a tcp:host:port
+
+#include "batch.hpp"
+#include "common.hpp"
+#include "domain.hpp"
+#include "perf_counters.hpp"
+#include "profiler.hpp"
+#include "state_reader.hpp"
+#include "world.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+// a loose pile of alternating spheres and boxes dropped onto the ground,
+// centered at (offset, 0, offset). `scattered` places the bodies in random
+// order, as if they had moved around since they were added.
+void buildPile(World &world, int n, double offset=0, bool scattered=false) {
+    int side = ceil(sqrt((float)n/4));
+    vector<int> slot(n);
+    for (int i = 0; i < n; ++i)
+        slot[i] = i;
+    if (scattered) {
+        srand(1);
+        for (int i = n-1; i > 0; --i)
+            swap(slot[i], slot[rand()%(i+1)]);
+    }
+    for (int i = 0; i < n; ++i)
+    {
+        int layer = slot[i]/(side*side), k = slot[i]%(side*side);
+        RigidBody rb;
+        rb.setTransform(pvec3(offset + (k%side - side/2)*0.6, 0.3 + layer*0.6,
+                              offset + (k/side - side/2)*0.6), quat(1,0,0,0));
+        rb.color = vec3(0,1,0);
+        if (i%2 == 0)
+            rb.init(0,1.0,0.2,0.3,0.25);
+        else
+            rb.init(1,1.0,0.2,0.3,0.25,vec3(0.2,0.2,0.2));
+        world.add(rb);
+    }
+}
+
+bool endsWith(const string &s, const string &suffix) {
+    return s.size() >= suffix.size()
+        && s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+void writeResults(FILE *f, bool json, PerfCounters *counters, int bodies, int steps) {
+    map<string, Profiler::CounterTotals> &totals = profiler.counterTotals;
+    if (json)
+        fprintf(f, "{\"bodies\":%d,\"steps\":%d,\"phases\":[\n", bodies, steps);
+    else {
+        fprintf(f, "phase,calls,ms_per_step");
+        for (int c = 0; c < PerfCounters::NUM_COUNTERS; c++)
+            fprintf(f, ",%s", PerfCounters::name(c));
+        fprintf(f, ",ipc\n");
+    }
+    bool first = true;
+    for (map<string, Profiler::CounterTotals>::iterator it = totals.begin(); it != totals.end(); ++it) {
+        const Profiler::CounterTotals &t = it->second;
+        double ms = t.nanoseconds*1e-6/steps;
+        double ipc = t.value[PerfCounters::CYCLES]
+            ? (double)t.value[PerfCounters::INSTRUCTIONS]/t.value[PerfCounters::CYCLES] : 0;
+        if (json) {
+            fprintf(f, "%s  {\"phase\":\"%s\",\"calls\":%lld,\"ms_per_step\":%.6f",
+                    first ? "" : ",\n", it->first.c_str(), t.calls, ms);
+            for (int c = 0; c < PerfCounters::NUM_COUNTERS; c++)
+                if (counters->available(c))
+                    fprintf(f, ",\"%s\":%llu", PerfCounters::name(c), t.value[c]);
+            fprintf(f, ",\"ipc\":%.3f}", ipc);
+        } else {
+            fprintf(f, "%s,%lld,%.6f", it->first.c_str(), t.calls, ms);
+            for (int c = 0; c < PerfCounters::NUM_COUNTERS; c++) {
+                if (counters->available(c))
+                    fprintf(f, ",%llu", t.value[c]);
+                else
+                    fprintf(f, ",");
+            }
+            fprintf(f, ",%.3f\n", ipc);
+        }
+        first = false;
+    }
+    if (json)
+        fprintf(f, "\n]}\n");
+}
+
+// The Base demo's tumbling box, spun mostly about its intermediate axis.
+RigidBody tumblingBox() {
+    RigidBody rb;
+    rb.setTransform(vec3(0,0,0),quat(1,0,0,0));
+    rb.init(1,1.0,0.2,0.3,0,vec3(0.2,0.4,0.05));
+    rb.angular_velocity = vec3(5.0,0.1,0.1);
+    return rb;
+}
+
+// Free-flight rotation conserves energy and angular momentum. A scheme is
+// counted as stable at a given dt when it never gains more than 5% energy
+// over `duration` seconds (losing energy is damping, not instability) and
+// its final angular velocity is within 10% of an RK4 run at a much smaller
+// dt. Energy alone would pass EULER at every dt: it has no gyroscopic
+// term, so its angular velocity never turns and its energy never changes.
+void benchIntegrators(FILE *f, bool json, int bodies, int steps) {
+    const float dts[] = {1/960., 1/480., 1/240., 1/120., 1/60., 1/30., 1/15., 1/8.};
+    const int numDts = sizeof(dts)/sizeof(dts[0]);
+    const float duration = 5, tolerance = 0.05, errorTolerance = 0.1;
+    RigidBody ref = tumblingBox();
+    for (int s = 0; s < duration*3840; s++)
+        ref.update(1/3840., RK4);
+    if (json)
+        fprintf(f, "{\"runs\":[\n");
+    else
+        fprintf(f, "integrator,dt,energy_gain,energy_loss,momentum_drift,omega_error,stable,ns_per_body_step\n");
+    bool first = true;
+    for (int in = 0; in < NUM_INTEGRATORS; in++) {
+        // cost per step, independent of dt
+        vector<RigidBody, Eigen::aligned_allocator<RigidBody> > rbs(bodies, tumblingBox());
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        for (int s = 0; s < steps; s++)
+            for (int b = 0; b < bodies; b++)
+                rbs[b].update(1/60., in);
+        double ns = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count()/steps/bodies;
+
+        float largest = 0, largestError = 0;
+        for (int d = 0; d < numDts; d++) {
+            RigidBody rb = tumblingBox();
+            vec3 L0 = rb.inertia_world()*rb.angular_velocity;
+            scalar E0 = rb.angular_velocity.dot(L0)/2;
+            scalar gain = 0, loss = 0, momentumDrift = 0;
+            int n = lround(duration/dts[d]);
+            for (int s = 0; s < n; s++) {
+                rb.update(dts[d], in);
+                vec3 L = rb.inertia_world()*rb.angular_velocity;
+                scalar dE = (rb.angular_velocity.dot(L)/2 - E0)/E0;
+                gain = max(gain, dE);
+                loss = max(loss, -dE);
+                momentumDrift = max(momentumDrift, (L - L0).norm()/L0.norm());
+                if (!(gain < 1e3))
+                    break; // blown up
+            }
+            scalar error = (rb.angular_velocity - ref.angular_velocity).norm()/ref.angular_velocity.norm();
+            bool stable = gain < tolerance && error < errorTolerance;
+            if (stable) {
+                largest = dts[d];
+                largestError = error;
+            }
+            if (json)
+                fprintf(f, "%s  {\"integrator\":\"%s\",\"dt\":%g,\"energy_gain\":%g,"
+                        "\"energy_loss\":%g,\"momentum_drift\":%g,\"omega_error\":%g,"
+                        "\"stable\":%s,\"ns_per_body_step\":%.1f}",
+                        first ? "" : ",\n", integratorNames[in], dts[d], gain, loss,
+                        momentumDrift, error, stable ? "true" : "false", ns);
+            else
+                fprintf(f, "%s,%g,%g,%g,%g,%g,%d,%.1f\n", integratorNames[in], dts[d],
+                        gain, loss, momentumDrift, error, stable, ns);
+            first = false;
+        }
+        if (largest > 0)
+            fprintf(stderr, "%-14s largest stable dt %-10g (omega error %5.3f) %7.1f ns/body/step\n",
+                    integratorNames[in], largest, largestError, ns);
+        else
+            fprintf(stderr, "%-14s largest stable dt %-30s %7.1f ns/body/step\n",
+                    integratorNames[in], "none", ns);
+    }
+    if (json)
+        fprintf(f, "\n]}\n");
+}
+
+// Throughput and drift of this build's precision (see common.hpp). The same
+// pile is stepped at the origin and shifted far away; rounding of the
+// shifted positions makes its trajectory drift from the one at the origin.
+void benchPrecision(FILE *f, bool json, int bodies, int steps) {
+    const char *config = sizeof(scalar) == sizeof(double) ? "double"
+        : sizeof(pscalar) == sizeof(double) ? "mixed" : "float";
+    const double offsets[] = {0, 1e2, 1e3, 1e4, 1e5};
+    const int numOffsets = sizeof(offsets)/sizeof(offsets[0]);
+    World reference;
+    if (json)
+        fprintf(f, "{\"config\":\"%s\",\"runs\":[\n", config);
+    else
+        fprintf(f, "config,offset,body_steps_per_s,max_drift\n");
+    for (int o = 0; o < numOffsets; o++) {
+        World world;
+        buildPile(o == 0 ? reference : world, bodies, offsets[o]);
+        World &w = (o == 0) ? reference : world;
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        for (int s = 0; s < steps; s++)
+            w.update(1/60.);
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        double drift = 0;
+        pvec3 shift(offsets[o], 0, offsets[o]);
+        for (int b = 0; b < bodies; b++)
+            drift = max(drift, (double)(w.body(b).position - shift - reference.body(b).position).norm());
+        if (json)
+            fprintf(f, "%s  {\"offset\":%g,\"body_steps_per_s\":%.0f,\"max_drift\":%g}",
+                    o ? ",\n" : "", offsets[o], bodies*steps/seconds, drift);
+        else
+            fprintf(f, "%s,%g,%.0f,%g\n", config, offsets[o], bodies*steps/seconds, drift);
+    }
+    if (json)
+        fprintf(f, "\n]}\n");
+}
+
+// Random candidate pairs with offsets in [-1,1]^3 and radii in [0.1,0.5],
+// roughly one in seven of them overlapping, tested `steps` times by each kernel.
+void benchSpheres(FILE *f, bool json, int pairs, int steps) {
+    SpherePairBatch batch;
+    srand(1);
+    for (int i = 0; i < pairs; i++) {
+        vec3 d = vec3::Random();
+        batch.add(i, i, d, 0.1 + 0.4*rand()/RAND_MAX, 0.1 + 0.4*rand()/RAND_MAX);
+    }
+    SphereContacts contacts;
+    const char *names[2] = {"scalar", "simd"};
+    double rate[2];
+    int hits[2];
+    for (int k = 0; k < 2; k++) {
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        for (int s = 0; s < steps; s++) {
+            if (k == 0)
+                sphereSphereScalar(batch, contacts);
+            else
+                sphereSphereBatch(batch, contacts);
+        }
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        rate[k] = (double)pairs*steps/seconds;
+        hits[k] = contacts.size();
+    }
+    if (json)
+        fprintf(f, "{\"width\":%d,\"pairs\":%d,\"runs\":[\n", floatv::width, pairs);
+    else
+        fprintf(f, "kernel,width,pairs,contacts,pairs_per_s\n");
+    for (int k = 0; k < 2; k++) {
+        int width = k ? floatv::width : 1;
+        if (json)
+            fprintf(f, "%s  {\"kernel\":\"%s\",\"width\":%d,\"contacts\":%d,\"pairs_per_s\":%.0f}",
+                    k ? ",\n" : "", names[k], width, hits[k], rate[k]);
+        else
+            fprintf(f, "%s,%d,%d,%d,%.0f\n", names[k], width, pairs, hits[k], rate[k]);
+    }
+    if (json)
+        fprintf(f, "\n]}\n");
+    fprintf(stderr, "%d lanes, %.2fx speedup\n", floatv::width, rate[1]/rate[0]);
+}
+
+// Boxes at random orientations, placed so that their lowest point is between
+// 0.02 below and 0.01 above the ground, as in a settled pile.
+void benchGround(FILE *f, bool json, int boxes, int steps) {
+    Shape shape = Shape::makeBox(vec3(0.3,0.2,0.25));
+    vector<mat3, Eigen::aligned_allocator<mat3> > rotations(boxes);
+    vector<scalar> heights(boxes);
+    srand(1);
+    for (int i = 0; i < boxes; i++) {
+        rotations[i] = quat(Eigen::Matrix<scalar,4,1>::Random()).normalized().toRotationMatrix();
+        scalar extent = (rotations[i].transpose()*vec3(0,1,0)).cwiseAbs().dot(shape.halfSize);
+        heights[i] = extent - 0.02 + 0.03*rand()/RAND_MAX;
+    }
+    const char *names[2] = {"scalar", "simd"};
+    double rate[2];
+    long long total[2];
+    for (int k = 0; k < 2; k++) {
+        vec3 arms[maxHalfSpaceContacts];
+        scalar depths[maxHalfSpaceContacts];
+        total[k] = 0;
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        for (int s = 0; s < steps; s++)
+            for (int i = 0; i < boxes; i++)
+                total[k] += k ? halfSpaceContacts(shape, rotations[i], vec3(0,1,0), heights[i], arms, depths)
+                    : halfSpaceContactsScalar(shape, rotations[i], vec3(0,1,0), heights[i], arms, depths);
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        rate[k] = (double)boxes*steps/seconds;
+    }
+    if (json)
+        fprintf(f, "{\"width\":%d,\"boxes\":%d,\"samples\":%d,\"runs\":[\n",
+                floatv::width, boxes, (int)shape.samples->points.size());
+    else
+        fprintf(f, "kernel,width,boxes,samples,contacts_per_box,boxes_per_s,ms_per_step\n");
+    for (int k = 0; k < 2; k++) {
+        int width = k ? floatv::width : 1;
+        double contacts = (double)total[k]/steps/boxes, ms = 1e3*boxes/rate[k];
+        if (json)
+            fprintf(f, "%s  {\"kernel\":\"%s\",\"width\":%d,\"contacts_per_box\":%.3f,"
+                    "\"boxes_per_s\":%.0f,\"ms_per_step\":%.3f}",
+                    k ? ",\n" : "", names[k], width, contacts, rate[k], ms);
+        else
+            fprintf(f, "%s,%d,%d,%d,%.3f,%.0f,%.3f\n", names[k], width, boxes,
+                    (int)shape.samples->points.size(), contacts, rate[k], ms);
+    }
+    if (json)
+        fprintf(f, "\n]}\n");
+    fprintf(stderr, "%d lanes, %.2fx speedup\n", floatv::width, rate[1]/rate[0]);
+}
+
+// Distance queries at random points in [-1,1]^3: n points against one box,
+// and one point at a time against n spheres, boxes, capsules and cylinders
+// at random poses. Each
+// is run through Shape::collisionTest and through the batched kernel, and
+// the largest disagreement in distance is reported alongside the rates.
+void benchSdf(FILE *f, bool json, int n, int steps) {
+    int padded = simdPadded(n);
+    vector<float> x(padded, 0), y(padded, 0), z(padded, 0);
+    vector<float> d(padded), nx(padded), ny(padded), nz(padded);
+    vector<Shape> shapes;
+    vector<vec3, Eigen::aligned_allocator<vec3> > centers;
+    vector<mat3, Eigen::aligned_allocator<mat3> > rotations;
+    ShapeSet set;
+    srand(1);
+    for (int i = 0; i < n; i++) {
+        vec3 p = vec3::Random();
+        x[i] = p[0]; y[i] = p[1]; z[i] = p[2];
+        shapes.push_back(i%4 == 0 ? Shape::makeSphere(0.25) : i%4 == 1 ? Shape::makeBox(vec3(0.3,0.2,0.25))
+                         : i%4 == 2 ? Shape::makeCapsule(0.2, 0.3) : Shape::makeCylinder(0.25, 0.2));
+        centers.push_back(vec3::Random());
+        rotations.push_back(quat(Eigen::Matrix<scalar,4,1>::Random()).normalized().toRotationMatrix());
+        set.add(shapes[i], centers[i], rotations[i]);
+    }
+    Shape box = Shape::makeBox(vec3(0.3,0.2,0.25));
+    vec3 q(0.1,0.2,-0.1);
+    const char *names[4] = {"points_scalar", "points_simd", "shapes_scalar", "shapes_simd"};
+    double rate[4], error[4] = {0, 0, 0, 0};
+    for (int k = 0; k < 4; k++) {
+        volatile float sink = 0;
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        for (int s = 0; s < steps; s++) {
+            if (k == 1)
+                shapeDistances(box, n, &x[0], &y[0], &z[0], &d[0], &nx[0], &ny[0], &nz[0]);
+            else if (k == 3)
+                set.distances(q, &d[0], &nx[0], &ny[0], &nz[0]);
+            else
+                for (int i = 0; i < n; i++) {
+                    scalar di;
+                    vec3 ni;
+                    if (k == 0)
+                        box.collisionTest(vec3(x[i], y[i], z[i]), di, ni);
+                    else
+                        shapes[i].collisionTest(rotations[i].transpose()*(q - centers[i]), di, ni);
+                    d[i] = di;
+                }
+            sink = sink + d[0];
+        }
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        rate[k] = (double)n*steps/seconds;
+        if (k == 1 || k == 3)
+            for (int i = 0; i < n; i++) {
+                scalar di;
+                vec3 ni;
+                if (k == 1)
+                    box.collisionTest(vec3(x[i], y[i], z[i]), di, ni);
+                else
+                    shapes[i].collisionTest(rotations[i].transpose()*(q - centers[i]), di, ni);
+                error[k] = max(error[k], (double)fabs(di - d[i]));
+            }
+    }
+    if (json)
+        fprintf(f, "{\"width\":%d,\"n\":%d,\"runs\":[\n", floatv::width, n);
+    else
+        fprintf(f, "query,width,n,queries_per_s,max_error\n");
+    for (int k = 0; k < 4; k++) {
+        int width = k%2 ? floatv::width : 1;
+        if (json)
+            fprintf(f, "%s  {\"query\":\"%s\",\"width\":%d,\"queries_per_s\":%.0f,\"max_error\":%g}",
+                    k ? ",\n" : "", names[k], width, rate[k], error[k]);
+        else
+            fprintf(f, "%s,%d,%d,%.0f,%g\n", names[k], width, n, rate[k], error[k]);
+    }
+    if (json)
+        fprintf(f, "\n]}\n");
+    fprintf(stderr, "%d lanes, %.2fx speedup for points, %.2fx for shapes\n",
+            floatv::width, rate[1]/rate[0], rate[3]/rate[2]);
+}
+
+// Broadphase updates of a pile at 1, 2, 4, ... threads and at every hardware
+// thread, with the speedup over one thread. The pairs found must not depend
+// on the thread count.
+void benchBroadphase(FILE *f, bool json, int bodies, int steps) {
+    World world;
+    buildPile(world, bodies);
+    vector<int> counts;
+    for (int t = 1; t < ThreadPool::hardwareThreads(); t *= 2)
+        counts.push_back(t);
+    counts.push_back(ThreadPool::hardwareThreads());
+    if (json)
+        fprintf(f, "{\"bodies\":%d,\"runs\":[\n", bodies);
+    else
+        fprintf(f, "threads,bodies,pairs,ms_per_update,speedup\n");
+    double base = 0;
+    for (int c = 0; c < counts.size(); c++) {
+        ThreadPool pool(counts[c]);
+        Broadphase broadphase;
+        broadphase.update(world.rbs.data(), bodies, pool); // warm up the buffers
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        for (int s = 0; s < steps; s++)
+            broadphase.update(world.rbs.data(), bodies, pool);
+        double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count()/steps;
+        if (c == 0)
+            base = ms;
+        if (json)
+            fprintf(f, "%s  {\"threads\":%d,\"pairs\":%d,\"ms_per_update\":%.3f,\"speedup\":%.2f}",
+                    c ? ",\n" : "", counts[c], broadphase.pairCount(), ms, base/ms);
+        else
+            fprintf(f, "%d,%d,%d,%.3f,%.2f\n", counts[c], bodies, broadphase.pairCount(), ms, base/ms);
+    }
+    if (json)
+        fprintf(f, "\n]}\n");
+}
+
+// The same pile stepped at 1, 2, 4, ... threads and at every hardware
+// thread, timing the parallel narrowphase and solver. Final positions are
+// compared bit for bit against the 1-thread run.
+void benchSolver(FILE *f, bool json, int bodies, int steps) {
+    vector<int> counts;
+    for (int t = 1; t < ThreadPool::hardwareThreads(); t *= 2)
+        counts.push_back(t);
+    counts.push_back(ThreadPool::hardwareThreads());
+    if (json)
+        fprintf(f, "{\"bodies\":%d,\"steps\":%d,\"runs\":[\n", bodies, steps);
+    else
+        fprintf(f, "threads,bodies,contacts,colors,narrowphase_ms_per_step,narrowphase_speedup,"
+                "solve_ms_per_step,solve_speedup,identical\n");
+    double base = 0, narrowBase = 0;
+    vector<pvec3> reference;
+    for (int c = 0; c < counts.size(); c++) {
+        World world;
+        world.pool.resize(counts[c]);
+        buildPile(world, bodies);
+        double ms = 0, narrowMs = 0;
+        long long contacts = 0, colors = 0;
+        for (int s = 0; s < steps; s++) {
+            world.update(1/60.);
+            ms += world.stats().solverMs;
+            narrowMs += world.stats().narrowphaseMs;
+            contacts += world.stats().contacts;
+            colors = max(colors, (long long)world.stats().solverColors);
+        }
+        ms /= steps;
+        narrowMs /= steps;
+        bool identical = true;
+        for (int b = 0; b < bodies; b++) {
+            if (c == 0)
+                reference.push_back(world.body(b).position);
+            else
+                identical = identical && world.body(b).position == reference[b];
+        }
+        if (c == 0) {
+            base = ms;
+            narrowBase = narrowMs;
+        }
+        if (json)
+            fprintf(f, "%s  {\"threads\":%d,\"contacts_per_step\":%lld,\"colors\":%lld,"
+                    "\"narrowphase_ms_per_step\":%.3f,\"narrowphase_speedup\":%.2f,"
+                    "\"solve_ms_per_step\":%.3f,\"solve_speedup\":%.2f,\"identical\":%s}",
+                    c ? ",\n" : "", counts[c], contacts/steps, colors, narrowMs, narrowBase/narrowMs,
+                    ms, base/ms, identical ? "true" : "false");
+        else
+            fprintf(f, "%d,%d,%lld,%lld,%.3f,%.2f,%.3f,%.2f,%d\n", counts[c], bodies, contacts/steps, colors,
+                    narrowMs, narrowBase/narrowMs, ms, base/ms, identical);
+    }
+    if (json)
+        fprintf(f, "\n]}\n");
+}
+
+// A 16 x 16 grid of restitution and friction values, each a run of the same
+// small pile, with one row of metrics per run.
+void benchSweep(FILE *f, bool json, int bodies, int steps) {
+    BatchRunner runner;
+    World scene;
+    buildPile(scene, bodies);
+    runner.scene = scene.rbs;
+    runner.steps = steps;
+    runner.sweep(0, 0.9, 16, 0, 0.6, 16);
+    ThreadPool pool(ThreadPool::hardwareThreads());
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    runner.run(pool);
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    if (json)
+        fprintf(f, "{\"bodies\":%d,\"steps\":%d,\"runs\":[\n", bodies, steps);
+    else
+        fprintf(f, "eta,nu,settled_step,kinetic_energy,mean_contacts,max_contacts,max_height,spread,ms\n");
+    for (int r = 0; r < runner.params.size(); r++) {
+        const RunParams &p = runner.params[r];
+        const RunMetrics &m = runner.metrics[r];
+        if (json)
+            fprintf(f, "%s  {\"eta\":%g,\"nu\":%g,\"settled_step\":%d,\"kinetic_energy\":%g,"
+                    "\"mean_contacts\":%.2f,\"max_contacts\":%g,\"max_height\":%g,\"spread\":%g,\"ms\":%.3f}",
+                    r ? ",\n" : "", p.eta, p.nu, m.settledStep, m.kineticEnergy, m.meanContacts,
+                    m.maxContacts, m.maxHeight, m.spread, m.ms);
+        else
+            fprintf(f, "%g,%g,%d,%g,%.2f,%g,%g,%g,%.3f\n", p.eta, p.nu, m.settledStep, m.kineticEnergy,
+                    m.meanContacts, m.maxContacts, m.maxHeight, m.spread, m.ms);
+    }
+    if (json)
+        fprintf(f, "\n]}\n");
+    fprintf(stderr, "%d runs of %d bodies on %d threads in %.2f s, %.1f runs/s\n",
+            (int)runner.params.size(), bodies, pool.size(), seconds, runner.params.size()/seconds);
+}
+
+// The same scattered pile stepped twice: once left in insertion order, and
+// once reordered along the Morton curve before the first step and
+// periodically after. Cache misses are totals per step.
+void benchLocality(FILE *f, bool json, int bodies, int steps) {
+    const char *names[2] = {"scattered", "morton"};
+    const int shown[2] = {PerfCounters::L1D_MISSES, PerfCounters::LLC_MISSES};
+    PerfCounters counters;
+    if (!counters.open())
+        cerr << "hardware counters unavailable, reporting time only" << endl;
+    if (json)
+        fprintf(f, "{\"bodies\":%d,\"steps\":%d,\"runs\":[\n", bodies, steps);
+    else
+        fprintf(f, "order,phase,ms_per_step,l1d_misses,llc_misses\n");
+    bool first = true;
+    for (int k = 0; k < 2; k++) {
+        World world;
+        buildPile(world, bodies, 0, true);
+        world.reorderPeriod = k ? 60 : 0;
+        profiler.attachCounters(&counters);
+        for (int s = 0; s < steps; s++) {
+            world.update(1/60.);
+            profiler.frame();
+        }
+        profiler.attachCounters(NULL);
+        map<string, Profiler::CounterTotals> &totals = profiler.counterTotals;
+        for (map<string, Profiler::CounterTotals>::iterator it = totals.begin(); it != totals.end(); ++it) {
+            const Profiler::CounterTotals &t = it->second;
+            double ms = t.nanoseconds*1e-6/steps;
+            if (json) {
+                fprintf(f, "%s  {\"order\":\"%s\",\"phase\":\"%s\",\"ms_per_step\":%.6f",
+                        first ? "" : ",\n", names[k], it->first.c_str(), ms);
+                for (int c = 0; c < 2; c++)
+                    if (counters.available(shown[c]))
+                        fprintf(f, ",\"%s\":%llu", PerfCounters::name(shown[c]), t.value[shown[c]]/steps);
+                fprintf(f, "}");
+            } else {
+                fprintf(f, "%s,%s,%.6f", names[k], it->first.c_str(), ms);
+                for (int c = 0; c < 2; c++) {
+                    if (counters.available(shown[c]))
+                        fprintf(f, ",%llu", t.value[shown[c]]/steps);
+                    else
+                        fprintf(f, ",");
+                }
+                fprintf(f, "\n");
+            }
+            first = false;
+        }
+    }
+    if (json)
+        fprintf(f, "\n]}\n");
+}
+
+// One pile stepped by 1, 2, 4 and 8 processes over each transport. A step
+// takes as long as its slowest process, so that is the time reported;
+// speedup is against one process on the same transport.
+void benchDomains(FILE *f, bool json, int bodies, int steps) {
+    World scene;
+    buildPile(scene, bodies);
+    const int counts[4] = {1, 2, 4, 8};
+    const char *names[2] = {"socket", "shm"};
+    if (json)
+        fprintf(f, "{\"bodies\":%d,\"steps\":%d,\"runs\":[\n", bodies, steps);
+    else
+        fprintf(f, "transport,processes,ms_per_step,speedup,min_owned,max_owned,max_ghosts,migrations,conserved\n");
+    bool first = true;
+    for (int k = 0; k < 2; k++) {
+        double base = 0;
+        for (int c = 0; c < 4; c++) {
+            int p = counts[c];
+            SocketTransport sockets(p);
+            ShmTransport shm(p);
+            Transport &transport = k ? (Transport&)shm : (Transport&)sockets;
+            vector<DomainStats> stats(p);
+            if (!runDomains(scene.rbs, p, transport, steps, 1/60., &stats[0])) {
+                cerr << names[k] << " run on " << p << " processes failed" << endl;
+                continue;
+            }
+            double ms = 0;
+            long long migrations = 0;
+            int total = 0, minOwned = bodies, maxOwned = 0, maxGhosts = 0;
+            for (int r = 0; r < p; r++) {
+                ms = max(ms, stats[r].ms/steps);
+                migrations += stats[r].migrations;
+                total += stats[r].owned;
+                minOwned = min(minOwned, stats[r].owned);
+                maxOwned = max(maxOwned, stats[r].owned);
+                maxGhosts = max(maxGhosts, stats[r].maxGhosts);
+            }
+            if (p == 1)
+                base = ms;
+            const char *conserved = total == bodies ? "true" : "false";
+            if (json)
+                fprintf(f, "%s  {\"transport\":\"%s\",\"processes\":%d,\"ms_per_step\":%.4f,\"speedup\":%.2f,"
+                        "\"min_owned\":%d,\"max_owned\":%d,\"max_ghosts\":%d,\"migrations\":%lld,\"conserved\":%s}",
+                        first ? "" : ",\n", names[k], p, ms, base/ms, minOwned, maxOwned, maxGhosts,
+                        migrations, conserved);
+            else
+                fprintf(f, "%s,%d,%.4f,%.2f,%d,%d,%d,%lld,%s\n", names[k], p, ms, base/ms, minOwned, maxOwned,
+                        maxGhosts, migrations, conserved);
+            first = false;
+        }
+    }
+    if (json)
+        fprintf(f, "\n]}\n");
+}
+
+// A StateExporter publishing frames as fast as it can while a forked
+// StateReader copies out every new frame it sees. Frame k sets every body's
+// x to k, so a frame mixing bodies from two publishes is caught as torn.
+// Once the writer stops, the reader times copies of the final frame alone,
+// which is its rate when it is not racing a writer for the cores.
+void benchState(FILE *f, bool json, int bodies, int frames) {
+    World world;
+    buildPile(world, bodies);
+    vector<int> index(bodies);
+    for (int i = 0; i < bodies; i++)
+        index[i] = i;
+    StateExporter exporter;
+    char name[64];
+    snprintf(name, sizeof(name), "/rb-bench-%d", (int)getpid());
+    if (!exporter.open(name, bodies)) {
+        cerr << "cannot create shared memory " << name << endl;
+        return;
+    }
+    struct ReaderResults {
+        long long frames, torn, retries, idleReads;
+        double seconds, idleSeconds;
+    };
+    ReaderResults *results = (ReaderResults*)mmap(NULL, sizeof(ReaderResults), PROT_READ | PROT_WRITE,
+                                                  MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    memset(results, 0, sizeof(*results));
+    pid_t reader = fork();
+    if (reader == 0) {
+        StateReader in;
+        SharedStateFrame frame;
+        ReaderResults r;
+        memset(&r, 0, sizeof(r));
+        if (!in.open(name))
+            _exit(1);
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        unsigned long long last = 0;
+        for (;;) {
+            if (in.sequence() == last) {
+                sched_yield();
+                continue;
+            }
+            if (!in.read(frame))
+                continue;
+            last = frame.sequence;
+            if (frame.step < 0)
+                break;
+            r.frames++;
+            for (int i = 0; i < frame.bodies.size(); i++)
+                if (frame.bodies[i].position[0] != frame.step) {
+                    r.torn++;
+                    break;
+                }
+        }
+        r.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        r.retries = in.retries;
+        start = chrono::steady_clock::now();
+        do {
+            in.read(frame);
+            r.idleReads++;
+            r.idleSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        } while (r.idleSeconds < 0.5);
+        *results = r;
+        _exit(0);
+    }
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    for (int k = 0; k <= frames; k++) {
+        long long step = k < frames ? k : -1; // the last frame tells the reader to stop
+        for (int i = 0; i < bodies; i++)
+            world.rbs[i].position[0] = step;
+        exporter.publish(step, 0, world.rbs.data(), &index[0], bodies);
+    }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    int status = 1;
+    waitpid(reader, &status, 0);
+    exporter.close();
+    ReaderResults r = *results;
+    munmap(results, sizeof(ReaderResults));
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        cerr << "reader failed" << endl;
+        return;
+    }
+    double frameBytes = sizeof(SharedStateHeader) + bodies*sizeof(SharedBodyState);
+    double writeUs = seconds*1e6/frames, writeGBs = frames*frameBytes/seconds*1e-9;
+    double readUs = r.idleSeconds*1e6/r.idleReads, readGBs = r.idleReads*frameBytes/r.idleSeconds*1e-9;
+    if (json)
+        fprintf(f, "{\"bodies\":%d,\"frames\":%d,\"frame_bytes\":%.0f,\"publish_us\":%.3f,"
+                "\"write_gb_s\":%.3f,\"read_us\":%.3f,\"read_gb_s\":%.3f,\"frames_read\":%lld,"
+                "\"torn\":%lld,\"retries\":%lld}\n", bodies, frames, frameBytes, writeUs, writeGBs,
+                readUs, readGBs, r.frames, r.torn, r.retries);
+    else
+        fprintf(f, "bodies,frames,frame_bytes,publish_us,write_gb_s,read_us,read_gb_s,frames_read,torn,retries\n"
+                "%d,%d,%.0f,%.3f,%.3f,%.3f,%.3f,%lld,%lld,%lld\n", bodies, frames, frameBytes, writeUs, writeGBs,
+                readUs, readGBs, r.frames, r.torn, r.retries);
+}
+
+// A pile stepped with a StreamServer attached and a StreamClient reading it
+// over a Unix socket in the same process. Sizes are per message as encoded;
+// errors compare the client's last frame with the bodies.
+void benchStream(FILE *f, bool json, int bodies, int steps) {
+    World world;
+    buildPile(world, bodies);
+    StreamServer server;
+    char address[64];
+    snprintf(address, sizeof(address), "unix:/tmp/rb-bench-%d.sock", (int)getpid());
+    StreamClient client;
+    StreamDecoder decoder;
+    if (!server.listen(address) || !client.connect(address)) {
+        cerr << "cannot open " << address << endl;
+        return;
+    }
+    world.streamer = &server;
+    for (int s = 0; s < steps; s++) {
+        world.update(1/60.);
+        client.poll(decoder);
+    }
+    // let the socket drain
+    for (int k = 0; k < 1000 && decoder.frame < server.encoder.frame; k++) {
+        server.flush();
+        client.poll(decoder);
+    }
+    double positionError = 0, rotationError = 0;
+    for (int i = 0; i < decoder.poses.size() && decoder.frame == server.encoder.frame; i++) {
+        const RigidBody &b = world.body(i);
+        positionError = max(positionError, (double)(decoder.position(i) - b.position).norm());
+        quat q = decoder.rotation(i);
+        double dot = min(1., fabs((double)q.dot(b.rotation)));
+        rotationError = max(rotationError, 2*acos(dot));
+    }
+    const StreamEncoder &e = server.encoder;
+    double keyPerBody = e.keyframes ? (double)e.keyframeBytes/e.keyframes/bodies : 0;
+    double deltaPerBody = e.deltas ? (double)e.deltaBytes/e.deltas/bodies : 0;
+    double raw = 7*sizeof(float); // position and quaternion as floats
+    bool complete = decoder.frame == e.frame;
+    if (json)
+        fprintf(f, "{\"bodies\":%d,\"frames\":%lld,\"keyframes\":%lld,\"keyframe_bytes_per_body\":%.3f,"
+                "\"delta_bytes_per_body\":%.3f,\"bytes_per_body_frame\":%.3f,\"raw_bytes_per_body\":%.0f,"
+                "\"ratio\":%.1f,\"max_position_error\":%g,\"max_rotation_error\":%g,\"received\":%s}\n",
+                bodies, e.frame + 1, e.keyframes, keyPerBody, deltaPerBody, server.bytesPerBodyFrame(), raw,
+                raw/server.bytesPerBodyFrame(), positionError, rotationError, complete ? "true" : "false");
+    else
+        fprintf(f, "bodies,frames,keyframes,keyframe_bytes_per_body,delta_bytes_per_body,bytes_per_body_frame,"
+                "raw_bytes_per_body,ratio,max_position_error,max_rotation_error,received\n"
+                "%d,%lld,%lld,%.3f,%.3f,%.3f,%.0f,%.1f,%g,%g,%s\n",
+                bodies, e.frame + 1, e.keyframes, keyPerBody, deltaPerBody, server.bytesPerBodyFrame(), raw,
+                raw/server.bytesPerBodyFrame(), positionError, rotationError, complete ? "true" : "false");
+}
+
+// The same pile stepped with every pair colliding and with the bodies of
+// its lower half made debris, in a group of their own left out of their
+// mask.
+void benchFilter(FILE *f, bool json, int bodies, int steps) {
+    const char *names[2] = {"none", "debris"};
+    if (json)
+        fprintf(f, "{\"bodies\":%d,\"steps\":%d,\"runs\":[\n", bodies, steps);
+    else
+        fprintf(f, "filter,pairs,filtered,filter_rate,broadphase_ms,narrowphase_ms,step_ms\n");
+    for (int k = 0; k < 2; k++) {
+        World world;
+        buildPile(world, bodies);
+        for (int h = 0; k && h < bodies/2; h++) {
+            world.body(h).group = 2;
+            world.body(h).mask = ~2u;
+        }
+        double pairs = 0, filtered = 0, broadphase = 0, narrowphase = 0, total = 0;
+        for (int s = 0; s < steps; s++) {
+            world.update(1/60.);
+            const WorldStats &st = world.stats();
+            pairs += st.broadphasePairs;
+            filtered += st.filteredPairs;
+            broadphase += st.broadphaseMs;
+            narrowphase += st.narrowphaseMs;
+            total += st.stepMs;
+        }
+        double rate = pairs + filtered > 0 ? filtered/(pairs + filtered) : 0;
+        if (json)
+            fprintf(f, "%s  {\"filter\":\"%s\",\"pairs\":%.1f,\"filtered\":%.1f,\"filter_rate\":%.4f,"
+                    "\"broadphase_ms\":%.4f,\"narrowphase_ms\":%.4f,\"step_ms\":%.4f}", k ? ",\n" : "", names[k],
+                    pairs/steps, filtered/steps, rate, broadphase/steps, narrowphase/steps, total/steps);
+        else
+            fprintf(f, "%s,%.1f,%.1f,%.4f,%.4f,%.4f,%.4f\n", names[k], pairs/steps, filtered/steps, rate,
+                    broadphase/steps, narrowphase/steps, total/steps);
+    }
+    if (json)
+        fprintf(f, "\n]}\n");
+}
+
+// A floor of static tiles, `tiles` of them in a square around the origin,
+// each as thick as the pile's bodies and sunk to be level with the ground.
+void buildLevel(World &world, int tiles) {
+    int side = ceil(sqrt((float)tiles));
+    for (int i = 0; i < tiles; ++i)
+    {
+        RigidBody rb;
+        rb.init(1,1.0,0.2,0.3,0,vec3(0.5,0.2,0.5));
+        rb.setTransform(pvec3((i%side - side/2)*1.0, -0.2, (i/side - side/2)*1.0), quat(1,0,0,0));
+        rb.type = STATIC;
+        world.add(rb);
+    }
+}
+
+// A 200 body pile stepped alone, on a level of static tiles, and the level
+// with nothing on it, which should cost next to nothing.
+void benchStatic(FILE *f, bool json, int tiles, int steps) {
+    const char *names[3] = {"pile", "pile+level", "level"};
+    if (json)
+        fprintf(f, "{\"tiles\":%d,\"steps\":%d,\"runs\":[\n", tiles, steps);
+    else
+        fprintf(f, "scene,bodies,pairs,broadphase_ms,integrate_ms,step_ms\n");
+    for (int k = 0; k < 3; k++) {
+        World world;
+        if (k < 2)
+            buildPile(world, 200);
+        if (k > 0)
+            buildLevel(world, tiles);
+        double pairs = 0, broadphase = 0, integrate = 0, total = 0;
+        for (int s = 0; s < steps; s++) {
+            world.update(1/60.);
+            const WorldStats &st = world.stats();
+            pairs += st.broadphasePairs;
+            broadphase += st.broadphaseMs;
+            integrate += st.integrateMs;
+            total += st.stepMs;
+        }
+        if (json)
+            fprintf(f, "%s  {\"scene\":\"%s\",\"bodies\":%d,\"pairs\":%.1f,\"broadphase_ms\":%.4f,"
+                    "\"integrate_ms\":%.4f,\"step_ms\":%.4f}", k ? ",\n" : "", names[k], (int)world.rbs.size(),
+                    pairs/steps, broadphase/steps, integrate/steps, total/steps);
+        else
+            fprintf(f, "%s,%d,%.1f,%.4f,%.4f,%.4f\n", names[k], (int)world.rbs.size(), pairs/steps,
+                    broadphase/steps, integrate/steps, total/steps);
+    }
+    if (json)
+        fprintf(f, "\n]}\n");
+}
+
+// Body creation: n debris bodies added one at a time, each with its own
+// shape, then spawned in one call from descriptions sharing one shape. Then
+// churn: every step of a pile of n, the oldest 1% is removed and as many
+// new bodies spawned above it, checking that the survivors' handles still
+// find them.
+void benchSpawn(FILE *f, bool json, int n, int steps) {
+    if (json)
+        fprintf(f, "{\"bodies\":%d,\"steps\":%d,\"runs\":[\n", n, steps);
+    else
+        fprintf(f, "phase,bodies,ms,us_per_body,step_ms\n");
+    double ms[3];
+    for (int k = 0; k < 3; k++) {
+        World world;
+        chrono::steady_clock::time_point t = chrono::steady_clock::now();
+        if (k == 0)
+            for (int i = 0; i < n; ++i) {
+                RigidBody rb;
+                rb.init(0,1.0,0.2,0.3,0.1);
+                rb.setTransform(pvec3(i%100*0.3, 1 + i/100*0.3, 0), quat(1,0,0,0));
+                world.add(rb);
+            }
+        else {
+            vector<BodyDesc> descs(n);
+            Shape sphere = Shape::makeSphere(0.1);
+            for (int i = 0; i < n; ++i) {
+                descs[i].shape = sphere;
+                descs[i].eta = 0.2;
+                descs[i].nu = 0.3;
+                descs[i].position = pvec3(i%100*0.3, 1 + i/100*0.3, 0);
+            }
+            if (k == 1) {
+                world.reserve(n);
+                world.spawn(descs.data(), n);
+            } else
+                // ten at a time into a world with no room set aside
+                for (int i = 0; i < n; i += 10)
+                    world.spawn(descs.data() + i, min(10, n - i));
+        }
+        ms[k] = chrono::duration<double, milli>(chrono::steady_clock::now() - t).count();
+    }
+
+    World world;
+    world.reserve(n);
+    vector<int> live(n);
+    vector<BodyDesc> descs(n);
+    Shape sphere = Shape::makeSphere(0.1);
+    int side = ceil(sqrt((float)n/4));
+    for (int i = 0; i < n; ++i) {
+        descs[i].shape = sphere;
+        descs[i].eta = 0.2;
+        descs[i].nu = 0.3;
+        descs[i].mass = 1 + i; // tells the bodies apart
+        descs[i].position = pvec3((i%side - side/2)*0.3, 0.3 + i/side/side*0.3, (i/side%side - side/2)*0.3);
+    }
+    world.spawn(descs.data(), n, live.data());
+    int churn = max(n/100, 1), oldest = 0, wrong = 0;
+    long long next = n;
+    double churnMs = 0, stepMs = 0;
+    for (int s = 0; s < steps; s++) {
+        chrono::steady_clock::time_point t = chrono::steady_clock::now();
+        for (int c = 0; c < churn; c++) {
+            int slot = (oldest + c) % n;
+            world.remove(live[slot]);
+            descs[c].mass = 1 + next++;
+            descs[c].position = pvec3((c%side - side/2)*0.3, 3, (c/side - side/2)*0.3);
+        }
+        vector<int> fresh(churn);
+        world.spawn(descs.data(), churn, fresh.data());
+        for (int c = 0; c < churn; c++)
+            live[(oldest + c) % n] = fresh[c];
+        oldest = (oldest + churn) % n;
+        churnMs += chrono::duration<double, milli>(chrono::steady_clock::now() - t).count();
+        world.update(1/60.);
+        stepMs += world.stats().stepMs;
+    }
+    // live[] is a ring of handles in spawn order, so masses rise from oldest
+    for (int i = 1; i < n; ++i)
+        if (!world.contains(live[(oldest + i) % n])
+            || world.body(live[(oldest + i) % n]).mass <= world.body(live[(oldest + i - 1) % n]).mass)
+            wrong++;
+
+    const char *names[4] = {"add", "spawn", "grow", "churn"};
+    double total[4] = {ms[0], ms[1], ms[2], churnMs};
+    double per[4] = {ms[0]*1e3/n, ms[1]*1e3/n, ms[2]*1e3/n, churnMs*1e3/((double)churn*steps)};
+    for (int k = 0; k < 4; k++) {
+        int count = k < 3 ? n : churn*steps;
+        double step = k < 3 ? 0 : stepMs/steps;
+        if (json)
+            fprintf(f, "%s  {\"phase\":\"%s\",\"bodies\":%d,\"ms\":%.3f,\"us_per_body\":%.3f,\"step_ms\":%.4f}",
+                    k ? ",\n" : "", names[k], count, total[k], per[k], step);
+        else
+            fprintf(f, "%s,%d,%.3f,%.3f,%.4f\n", names[k], count, total[k], per[k], step);
+    }
+    if (json)
+        fprintf(f, "\n], \"stale_handles\":%d}\n", wrong);
+    else
+        fprintf(f, "# %d stale handles\n", wrong);
+}
+
+// a square slab of children in the xz plane, spheres and boxes alternating
+Shape makeSlab(int children) {
+    int side = ceil(sqrt((float)children));
+    vector<CompoundChild> parts;
+    Shape sphere = Shape::makeSphere(0.1), box = Shape::makeBox(vec3(0.09,0.09,0.09));
+    for (int i = 0; i < children; ++i)
+        parts.push_back(CompoundChild(i%2 ? box : sphere, vec3(i%side*0.2, 0, i/side*0.2)));
+    return Shape::makeCompound(parts);
+}
+
+// every pair of children, for comparison with compoundContact
+bool bruteCompoundContact(RigidBody *a, RigidBody *b, vec3 delta, Contact &c) {
+    const CompoundTree &ta = *a->shape.compound, &tb = *b->shape.compound;
+    vec3 ra(0,0,0), normal(0,0,0);
+    scalar weight = 0;
+    for (int i = 0; i < ta.children.size(); ++i) {
+        const Shape &partA = ta.children[i].shape;
+        mat3 rotA = a->rotation_matrix*ta.children[i].rotation;
+        vec3 armA = a->rotation_matrix*ta.children[i].position;
+        for (int j = 0; j < tb.children.size(); ++j) {
+            const Shape &partB = tb.children[j].shape;
+            mat3 rotB = b->rotation_matrix*tb.children[j].rotation;
+            Contact k;
+            if (!primitiveContactTable[partA.type][partB.type](
+                    ShapePose(partA, rotA), ShapePose(partB, rotB),
+                    delta + b->rotation_matrix*tb.children[j].position - armA, k))
+                continue;
+            ra += k.depth*(armA + k.ra);
+            normal += k.depth*k.normal;
+            weight += k.depth;
+        }
+    }
+    if (weight <= 0)
+        return false;
+    c.normal = normal.normalized();
+    c.ra = ra/weight;
+    return true;
+}
+
+// Two slab compounds overlapping only at a corner, so the trees should keep
+// the cost near that of the few children there while testing every pair
+// grows with the square of the children. Then a pile of L-shaped compounds,
+// a bar with a post at one end and a ball at the other.
+void benchCompound(FILE *f, bool json, int bodies, int steps) {
+    if (json)
+        fprintf(f, "{\"steps\":%d,\"runs\":[\n", steps);
+    else
+        fprintf(f, "scene,children,bodies,tree_us,brute_us,agree,step_ms,contacts\n");
+    for (int children = 16; children <= 4096; children *= 4) {
+        Shape slab = makeSlab(children);
+        RigidBody a, b;
+        a.shape = b.shape = slab;
+        // b's corner child just overlaps a's opposite corner
+        vec3 lo, hi;
+        slab.bounds(lo, hi);
+        a.setTransform(pvec3(0,0,0), quat(1,0,0,0));
+        b.setTransform(pvec3(hi[0] - lo[0] - 0.25, 0.15, hi[2] - lo[2] - 0.25), quat(1,0,0,0));
+        vec3 delta = (b.position - a.position).cast<scalar>();
+        Contact tree, brute;
+        int treeReps = 20000, bruteReps = max(1, 4000000/(children*children));
+        chrono::steady_clock::time_point t = chrono::steady_clock::now();
+        bool found = false;
+        for (int r = 0; r < treeReps; ++r)
+            found = Narrowphase<CompoundShape,CompoundShape>::test(&a, &b, delta, tree);
+        double treeUs = chrono::duration<double, micro>(chrono::steady_clock::now() - t).count()/treeReps;
+        t = chrono::steady_clock::now();
+        bool bruteFound = false;
+        for (int r = 0; r < bruteReps; ++r)
+            bruteFound = bruteCompoundContact(&a, &b, delta, brute);
+        double bruteUs = chrono::duration<double, micro>(chrono::steady_clock::now() - t).count()/bruteReps;
+        bool agree = found == bruteFound && (!found || ((tree.normal - brute.normal).norm() < 1e-4
+                                                        && (tree.ra - brute.ra).norm() < 1e-4));
+        if (json)
+            fprintf(f, "%s  {\"scene\":\"slabs\",\"children\":%d,\"bodies\":2,\"tree_us\":%.3f,"
+                    "\"brute_us\":%.3f,\"agree\":%s}", children > 16 ? ",\n" : "", children, treeUs,
+                    bruteUs, agree ? "true" : "false");
+        else
+            fprintf(f, "slabs,%d,2,%.3f,%.3f,%s,,\n", children, treeUs, bruteUs, agree ? "true" : "false");
+    }
+
+    vector<CompoundChild> parts;
+    parts.push_back(CompoundChild(Shape::makeBox(vec3(0.3,0.06,0.06)), vec3(0,0,0)));
+    parts.push_back(CompoundChild(Shape::makeBox(vec3(0.06,0.2,0.06)), vec3(-0.24,0.26,0)));
+    parts.push_back(CompoundChild(Shape::makeSphere(0.1), vec3(0.3,0.1,0)));
+    Shape L = Shape::makeCompound(parts);
+    vector<BodyDesc> descs(bodies);
+    int side = ceil(sqrt((float)bodies/4));
+    for (int i = 0; i < bodies; ++i) {
+        int layer = i/(side*side), k = i%(side*side);
+        descs[i].shape = L;
+        descs[i].eta = 0.2;
+        descs[i].nu = 0.3;
+        descs[i].color = vec3(0,1,0);
+        descs[i].position = pvec3((k%side - side/2)*0.8, 0.4 + layer*0.6, (k/side - side/2)*0.8);
+        descs[i].rotation = quat(Eigen::AngleAxis<scalar>(i*0.7, vec3(0,1,0)));
+    }
+    World world;
+    world.spawn(descs.data(), bodies);
+    double total = 0, contacts = 0;
+    for (int s = 0; s < steps; s++) {
+        world.update(1/60.);
+        total += world.stats().stepMs;
+        contacts += world.stats().contacts;
+    }
+    if (json)
+        fprintf(f, ",\n  {\"scene\":\"L pile\",\"children\":3,\"bodies\":%d,\"step_ms\":%.4f,\"contacts\":%.1f}\n]}\n",
+                bodies, total/steps, contacts/steps);
+    else
+        fprintf(f, "L pile,3,%d,,,,%.4f,%.1f\n", bodies, total/steps, contacts/steps);
+}
+
+// a capsule's radius and axis covered by `spheres` spheres along y
+Shape makeSphereChain(scalar radius, scalar halfLength, int spheres) {
+    vector<CompoundChild> parts;
+    Shape sphere = Shape::makeSphere(radius);
+    for (int i = 0; i < spheres; ++i)
+        parts.push_back(CompoundChild(sphere, vec3(0, -halfLength + 2*halfLength*i/(spheres - 1), 0)));
+    return Shape::makeCompound(parts);
+}
+
+// Capsules against the chains of spheres they would otherwise be built
+// from: first one pair crossed at an angle through the closed-form test and
+// as two chains of 2 to 16 spheres, then piles of -n capsules and of -n
+// chains of 4 and 8 spheres.
+void benchCapsule(FILE *f, bool json, int bodies, int steps) {
+    const scalar radius = 0.1, halfLength = 0.25;
+    Shape capsule = Shape::makeCapsule(radius, halfLength);
+    if (json)
+        fprintf(f, "{\"steps\":%d,\"runs\":[\n", steps);
+    else
+        fprintf(f, "scene,spheres,bodies,test_ns,step_ms,narrowphase_ms,pairs,contacts\n");
+    const int reps = 200000;
+    for (int spheres = 0; spheres <= 16; spheres = spheres ? spheres*2 : 2) {
+        RigidBody a, b;
+        a.shape = b.shape = spheres ? makeSphereChain(radius, halfLength, spheres) : capsule;
+        a.setTransform(pvec3(0,0,0), quat(Eigen::AngleAxis<scalar>(1.2, vec3(0,0,1))));
+        b.setTransform(pvec3(0.05,0.18,0.02), quat(Eigen::AngleAxis<scalar>(0.9, vec3(1,0,0))));
+        vec3 delta = (b.position - a.position).cast<scalar>();
+        Contact c;
+        int hits = 0;
+        chrono::steady_clock::time_point t = chrono::steady_clock::now();
+        for (int r = 0; r < reps; ++r)
+            hits += spheres ? Narrowphase<CompoundShape,CompoundShape>::test(&a, &b, delta, c)
+                            : Narrowphase<CapsuleShape,CapsuleShape>::test(&a, &b, delta, c);
+        double ns = chrono::duration<double, nano>(chrono::steady_clock::now() - t).count()/reps;
+        if (json)
+            fprintf(f, "%s  {\"scene\":\"%s pair\",\"spheres\":%d,\"bodies\":2,\"test_ns\":%.1f,\"contact\":%s}",
+                    spheres ? ",\n" : "", spheres ? "chain" : "capsule", spheres, ns, hits ? "true" : "false");
+        else
+            fprintf(f, "%s pair,%d,2,%.1f,,,,\n", spheres ? "chain" : "capsule", spheres, ns);
+    }
+
+    int side = ceil(sqrt((float)bodies/4));
+    for (int spheres = 0; spheres <= 8; spheres = spheres ? spheres*2 : 4) {
+        Shape shape = spheres ? makeSphereChain(radius, halfLength, spheres) : capsule;
+        vector<BodyDesc> descs(bodies);
+        for (int i = 0; i < bodies; ++i) {
+            int layer = i/(side*side), k = i%(side*side);
+            descs[i].shape = shape;
+            descs[i].eta = 0.2;
+            descs[i].nu = 0.3;
+            descs[i].color = vec3(0,0.5,1);
+            descs[i].position = pvec3((k%side - side/2)*0.4, 0.3 + layer*0.25, (k/side - side/2)*0.4);
+            descs[i].rotation = quat(Eigen::AngleAxis<scalar>(i*0.7, vec3(0,1,0))
+                                     *Eigen::AngleAxis<scalar>(M_PI/2, vec3(0,0,1)));
+        }
+        World world;
+        world.spawn(descs.data(), bodies);
+        double total = 0, narrow = 0, pairs = 0, contacts = 0;
+        for (int s = 0; s < steps; s++) {
+            world.update(1/60.);
+            total += world.stats().stepMs;
+            narrow += world.stats().narrowphaseMs;
+            pairs += world.stats().broadphasePairs;
+            contacts += world.stats().contacts;
+        }
+        if (json)
+            fprintf(f, ",\n  {\"scene\":\"%s pile\",\"spheres\":%d,\"bodies\":%d,\"step_ms\":%.4f,"
+                    "\"narrowphase_ms\":%.4f,\"pairs\":%.1f,\"contacts\":%.1f}", spheres ? "chain" : "capsule",
+                    spheres, bodies, total/steps, narrow/steps, pairs/steps, contacts/steps);
+        else
+            fprintf(f, "%s pile,%d,%d,,%.4f,%.4f,%.1f,%.1f\n", spheres ? "chain" : "capsule", spheres, bodies,
+                    total/steps, narrow/steps, pairs/steps, contacts/steps);
+    }
+    if (json)
+        fprintf(f, "\n]}\n");
+}
+
+// Headless simulation for remote viewers: a pile stepped at dt per frame of
+// wall time, with the bandwidth printed every second.
+void serve(string address, int bodies, int steps) {
+    World world;
+    buildPile(world, bodies);
+    StreamServer server;
+    if (!server.listen(address)) {
+        cerr << "cannot listen on " << address << endl;
+        return;
+    }
+    world.streamer = &server;
+    const float dt = 1/60.;
+    chrono::steady_clock::time_point next = chrono::steady_clock::now();
+    for (int s = 0; s < steps; s++) {
+        world.update(dt);
+        if (s % 60 == 59)
+            fprintf(stderr, "step %d  clients %d  %.3f bytes/body/frame  %.1f KB sent\n", s + 1,
+                    server.clientCount(), server.bytesPerBodyFrame(), server.bytesSent/1024.);
+        next += chrono::microseconds((long long)(dt*1e6));
+        this_thread::sleep_until(next);
+    }
+}
+
+int main(int argc, char **argv) {
+    int bodies = 200, steps = 300;
+    float dt = 1/60.;
+    string mode = "step", out, address = "unix:/tmp/rb.sock";
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-m") && i+1 < argc)
+            mode = argv[++i];
+        else if (!strcmp(argv[i], "-n") && i+1 < argc)
+            bodies = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-s") && i+1 < argc)
+            steps = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-o") && i+1 < argc)
+            out = argv[++i];
+        else if (!strcmp(argv[i], "-a") && i+1 < argc)
+            address = argv[++i];
+        else {
+            cerr << "usage: " << argv[0] << " [-m step|integrators|precision|spheres|ground|sdf|broadphase|solver|sweep|locality|domains|state|stream|serve|filter|static|spawn|compound|capsule] [-n bodies] [-s steps] [-o out.csv|out.json] [-a address]" << endl;
+            return 1;
+        }
+    }
+
+    FILE *f = stdout;
+    if (!out.empty() && !(f = fopen(out.c_str(), "w"))) {
+        cerr << "cannot write " << out << endl;
+        return 1;
+    }
+    bool json = endsWith(out, ".json");
+    if (mode == "integrators") {
+        benchIntegrators(f, json, bodies, steps);
+        return 0;
+    }
+    if (mode == "precision") {
+        benchPrecision(f, json, bodies, steps);
+        return 0;
+    }
+    if (mode == "spheres") {
+        benchSpheres(f, json, bodies, steps);
+        return 0;
+    }
+    if (mode == "ground") {
+        benchGround(f, json, bodies, steps);
+        return 0;
+    }
+    if (mode == "sdf") {
+        benchSdf(f, json, bodies, steps);
+        return 0;
+    }
+    if (mode == "broadphase") {
+        benchBroadphase(f, json, bodies, steps);
+        return 0;
+    }
+    if (mode == "solver") {
+        benchSolver(f, json, bodies, steps);
+        return 0;
+    }
+    if (mode == "sweep") {
+        benchSweep(f, json, bodies, steps);
+        return 0;
+    }
+    if (mode == "locality") {
+        benchLocality(f, json, bodies, steps);
+        return 0;
+    }
+    if (mode == "domains") {
+        benchDomains(f, json, bodies, steps);
+        return 0;
+    }
+    if (mode == "state") {
+        benchState(f, json, bodies, steps);
+        return 0;
+    }
+    if (mode == "stream") {
+        benchStream(f, json, bodies, steps);
+        return 0;
+    }
+    if (mode == "filter") {
+        benchFilter(f, json, bodies, steps);
+        return 0;
+    }
+    if (mode == "static") {
+        benchStatic(f, json, bodies, steps);
+        return 0;
+    }
+    if (mode == "spawn") {
+        benchSpawn(f, json, bodies, steps);
+        return 0;
+    }
+    if (mode == "compound") {
+        benchCompound(f, json, bodies, steps);
+        return 0;
+    }
+    if (mode == "capsule") {
+        benchCapsule(f, json, bodies, steps);
+        return 0;
+    }
+    if (mode == "serve") {
+        serve(address, bodies, steps);
+        return 0;
+    }
+
+    World world;
+    buildPile(world, bodies);
+
+    PerfCounters counters;
+    if (!counters.open())
+        cerr << "hardware counters unavailable, reporting time only" << endl;
+    profiler.attachCounters(&counters);
+    for (int s = 0; s < steps; s++) {
+        world.update(dt);
+        profiler.frame();
+    }
+    profiler.attachCounters(NULL);
+
+    writeResults(f, json, &counters, bodies, steps);
+    if (f != stdout)
+        fclose(f);
+}
@@ -0,0 +1,343 @@
+#ifndef BROADPHASE_HPP
+#define BROADPHASE_HPP
+
+#include "collision_filter.hpp"
+#include "common.hpp"
+#include "morton.hpp"
+#include "radix_sort.hpp"
+#include "rb.hpp"
+#include "thread_pool.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <vector>
+
+// Parallel broadphase over a linear BVH (Karras, "Maximizing parallelism in
+// the construction of BVHs, octrees, and k-d trees", 2012). Every stage is
+// a parallel loop:
+//
+//   1. bounding boxes of the bodies' bounding spheres, and their union
+//   2. Morton codes of the box centers, sorted by RadixSorter
+//   3. the tree: internal node i is found from the sorted codes alone, so
+//      all nodes are built at once
+//   4. node boxes, bottom up; the second child to finish does the parent
+//   5. one traversal per leaf, for the leaves after it in sorted order
+//
+// Pairs whose bounding spheres overlap are then checked against the
+// bodies' collision groups and masks and, if there is one, the
+// CollisionFilter's ignored pairs; those rejected are only counted. Pairs
+// of two bodies that are not dynamic are skipped without counting.
+//
+// A tree can also be queried by another: World keeps its static bodies in
+// a tree of their own, built only when they change, and each step finds
+// the pairs between its dynamic bodies and that tree.
+//
+// Pairs go into one buffer per thread, so nothing is shared while they are
+// found. Each thread handles a contiguous range of leaves in order, so the
+// buffers taken in thread order hold the same pairs in the same order for
+// any number of threads.
+
+class Broadphase {
+public:
+    // body index pairs whose bounding spheres overlap, from the last update
+    std::vector< std::vector< std::pair<int,int> > > threadPairs;
+    Broadphase(): count(0), handles(NULL), filter(NULL), visitsSize(0) {}
+    // the tree over bodies[subset[k]] for k < n, or bodies[0..n) if subset
+    // is NULL
+    void build(const RigidBody *bodies, const int *subset, int n, ThreadPool &pool);
+    // overlapping pairs among the leaves, then between the dynamic leaves
+    // and those of `other`, a tree over other bodies of the same array.
+    // handles[i] is body i's handle, for filter; both may be NULL.
+    void findPairs(ThreadPool &pool, const int *handles = NULL, const CollisionFilter *filter = NULL,
+                   const Broadphase *other = NULL);
+    // for when body `from` of a subset tree has moved to index `to`, which
+    // is lower; the tree keeps its shape
+    void relabel(int from, int to);
+    // both of the above, for all n bodies
+    void update(const RigidBody *bodies, int n, ThreadPool &pool,
+                const int *handles = NULL, const CollisionFilter *filter = NULL);
+    int leafCount() const { return count; }
+    int pairCount() const;
+    // overlapping pairs the filtering rejected in the last update
+    int rejectedCount() const;
+protected:
+    int count;
+    RadixSorter sorter;
+    std::vector<unsigned int> codes;
+    std::vector<int> order;                 // body index of each sorted leaf
+    std::vector<pvec3> center;              // per sorted leaf
+    std::vector<scalar> radius;
+    std::vector<unsigned> group, mask;      // per sorted leaf
+    std::vector<unsigned char> dynamic;
+    std::vector<int> bodyLeaf;              // per body index, for relabel
+    std::vector<int> threadRejected;
+    const int *handles;
+    const CollisionFilter *filter;
+    // internal nodes, then leaves; left, right and last (the last leaf
+    // below) are only set for internal nodes
+    struct Node {
+        pvec3 lo, hi;
+        int left, right, last, parent;
+    };
+    std::vector<Node> nodes;
+    std::unique_ptr<std::atomic<int>[]> visits;
+    int visitsSize;
+    int prefix(int i, int j) const;
+    void buildNode(int i);
+    void refit(int leaf);
+    bool accept(const Broadphase &tree, int leaf, int k, int &rejected) const;
+    void query(int leaf, std::vector< std::pair<int,int> > &out, int &rejected) const;
+    void queryOther(int leaf, const Broadphase &other, std::vector< std::pair<int,int> > &out,
+                    int &rejected) const;
+    // internal node i is node i; leaf k is node count-1+k
+    int leafNode(int k) const { return count - 1 + k; }
+};
+
+int Broadphase::pairCount() const {
+    int total = 0;
+    for (int t = 0; t < threadPairs.size(); t++)
+        total += threadPairs[t].size();
+    return total;
+}
+
+int Broadphase::rejectedCount() const {
+    int total = 0;
+    for (int t = 0; t < threadRejected.size(); t++)
+        total += threadRejected[t];
+    return total;
+}
+
+// Length of the common prefix of sorted keys i and j, -1 out of range.
+// Equal codes are told apart by their position, as if it were appended.
+int Broadphase::prefix(int i, int j) const {
+    if (j < 0 || j >= count)
+        return -1;
+    if (codes[i] == codes[j])
+        return 32 + __builtin_clz((unsigned int)(i ^ j));
+    return __builtin_clz(codes[i] ^ codes[j]);
+}
+
+// Internal node i covers the leaf range that starts or ends at i and shares
+// the longest possible prefix, and is split where that prefix grows.
+void Broadphase::buildNode(int i) {
+    int d = prefix(i, i+1) > prefix(i, i-1) ? 1 : -1;
+    int minPrefix = prefix(i, i-d);
+    int maxLength = 2;
+    while (prefix(i, i + maxLength*d) > minPrefix)
+        maxLength *= 2;
+    int length = 0;
+    for (int t = maxLength/2; t >= 1; t /= 2)
+        if (prefix(i, i + (length + t)*d) > minPrefix)
+            length += t;
+    int j = i + length*d;
+    int nodePrefix = prefix(i, j);
+    int split = 0;
+    for (int t = length; t > 1; ) {
+        t = (t + 1)/2;
+        if (prefix(i, i + (split + t)*d) > nodePrefix)
+            split += t;
+    }
+    int gamma = i + split*d + std::min(d, 0);
+    Node &node = nodes[i];
+    node.left = std::min(i, j) == gamma ? leafNode(gamma) : gamma;
+    node.right = std::max(i, j) == gamma+1 ? leafNode(gamma+1) : gamma+1;
+    node.last = std::max(i, j);
+    nodes[node.left].parent = i;
+    nodes[node.right].parent = i;
+}
+
+// Walks up from a leaf. The first child to arrive at a node stops; the
+// second knows both boxes are done, so it fills the node in and goes on.
+void Broadphase::refit(int leaf) {
+    int i = nodes[leafNode(leaf)].parent;
+    while (visits[i].fetch_add(1, std::memory_order_acq_rel) == 1) {
+        Node &node = nodes[i];
+        node.lo = nodes[node.left].lo.cwiseMin(nodes[node.right].lo);
+        node.hi = nodes[node.left].hi.cwiseMax(nodes[node.right].hi);
+        if (i == 0)
+            break;
+        i = node.parent;
+    }
+}
+
+// whether leaf `k` of `tree` is a pair with our `leaf`: their bounding
+// spheres overlap, one is dynamic and the filter lets them through
+bool Broadphase::accept(const Broadphase &tree, int leaf, int k, int &rejected) const {
+    if (!dynamic[leaf] && !tree.dynamic[k])
+        return false;
+    scalar r = radius[leaf] + tree.radius[k];
+    if ((center[leaf] - tree.center[k]).squaredNorm() > r*r)
+        return false;
+    if (groupsCollide(group[leaf], mask[leaf], tree.group[k], tree.mask[k])
+        && !(filter && filter->ignored(handles[order[leaf]], handles[tree.order[k]])))
+        return true;
+    rejected++;
+    return false;
+}
+
+// the leaves after `leaf` whose bounding spheres overlap it
+void Broadphase::query(int leaf, std::vector< std::pair<int,int> > &out, int &rejected) const {
+    // at most 62 levels: 30 bits of code, then 32 of position
+    int stack[128], top = 0;
+    const pvec3 qlo = nodes[leafNode(leaf)].lo, qhi = nodes[leafNode(leaf)].hi;
+    stack[top++] = 0;
+    while (top > 0) {
+        const Node &node = nodes[stack[--top]];
+        int children[2] = {node.left, node.right};
+        for (int c = 0; c < 2; c++) {
+            int child = children[c];
+            const Node &b = nodes[child];
+            if (qlo[0] > b.hi[0] || qlo[1] > b.hi[1] || qlo[2] > b.hi[2]
+                || b.lo[0] > qhi[0] || b.lo[1] > qhi[1] || b.lo[2] > qhi[2])
+                continue;
+            if (child >= count - 1) {
+                int k = child - (count - 1);
+                if (k <= leaf)
+                    continue;
+                if (accept(*this, leaf, k, rejected))
+                    out.push_back(std::make_pair(order[leaf], order[k]));
+            } else if (b.last > leaf)
+                stack[top++] = child;
+        }
+    }
+}
+
+// every leaf of `other` whose bounding sphere overlaps our `leaf`
+void Broadphase::queryOther(int leaf, const Broadphase &other, std::vector< std::pair<int,int> > &out,
+                            int &rejected) const {
+    int stack[128], top = 0;
+    const pvec3 qlo = nodes[leafNode(leaf)].lo, qhi = nodes[leafNode(leaf)].hi;
+    stack[top++] = 0; // the root, which is the only leaf of a one-body tree
+    while (top > 0) {
+        int i = stack[--top];
+        const Node &b = other.nodes[i];
+        if (qlo[0] > b.hi[0] || qlo[1] > b.hi[1] || qlo[2] > b.hi[2]
+            || b.lo[0] > qhi[0] || b.lo[1] > qhi[1] || b.lo[2] > qhi[2])
+            continue;
+        if (i >= other.count - 1) {
+            int k = i - (other.count - 1);
+            if (accept(other, leaf, k, rejected))
+                out.push_back(std::make_pair(order[leaf], other.order[k]));
+        } else {
+            stack[top++] = b.left;
+            stack[top++] = b.right;
+        }
+    }
+}
+
+void Broadphase::relabel(int from, int to) {
+    int k = bodyLeaf[from];
+    order[k] = to;
+    bodyLeaf[to] = k;
+    bodyLeaf[from] = -1;
+}
+
+void Broadphase::update(const RigidBody *bodies, int n, ThreadPool &pool,
+                        const int *handles, const CollisionFilter *filter) {
+    build(bodies, NULL, n, pool);
+    findPairs(pool, handles, filter);
+}
+
+void Broadphase::build(const RigidBody *bodies, const int *subset, int n, ThreadPool &pool) {
+    int threads = pool.size();
+    count = n;
+    if (n < 1)
+        return;
+    codes.resize(n);
+    order.resize(n);
+    center.resize(n);
+    radius.resize(n);
+    group.resize(n);
+    mask.resize(n);
+    dynamic.resize(n);
+    nodes.resize(2*n - 1);
+    if (visitsSize < n - 1 || !visits) {
+        visits.reset(new std::atomic<int>[std::max(n - 1, 1)]);
+        visitsSize = n - 1;
+    }
+
+    // scene bounds of the centers, reduced per thread
+    const RigidBody &first = bodies[subset ? subset[0] : 0];
+    std::vector<pvec3> threadLo(threads, first.position), threadHi(threads, first.position);
+    pool.parallelFor(n, [&](int begin, int end, int t) {
+        for (int i = begin; i < end; i++) {
+            const RigidBody &b = bodies[subset ? subset[i] : i];
+            threadLo[t] = threadLo[t].cwiseMin(b.position);
+            threadHi[t] = threadHi[t].cwiseMax(b.position);
+        }
+    });
+    pvec3 sceneLo = threadLo[0], sceneHi = threadHi[0];
+    for (int t = 1; t < threads; t++) {
+        sceneLo = sceneLo.cwiseMin(threadLo[t]);
+        sceneHi = sceneHi.cwiseMax(threadHi[t]);
+    }
+    pvec3 inv;
+    for (int k = 0; k < 3; ++k)
+        inv[k] = sceneHi[k] > sceneLo[k] ? 1/(sceneHi[k] - sceneLo[k]) : 0;
+
+    pool.parallelFor(n, [&](int begin, int end, int) {
+        for (int i = begin; i < end; i++) {
+            order[i] = subset ? subset[i] : i;
+            codes[i] = mortonCode(bodies[order[i]].position, sceneLo, inv);
+        }
+    });
+    sorter.sort(codes, order, 30, pool);
+    if (subset) {
+        bodyLeaf.assign(*std::max_element(subset, subset + n) + 1, -1);
+        for (int k = 0; k < n; k++)
+            bodyLeaf[order[k]] = k;
+    }
+
+    pool.parallelFor(n, [&](int begin, int end, int) {
+        for (int k = begin; k < end; k++) {
+            const RigidBody &b = bodies[order[k]];
+            center[k] = b.position;
+            radius[k] = b.shape.boundingRadius();
+            group[k] = b.group;
+            mask[k] = b.mask;
+            dynamic[k] = b.isDynamic();
+            pvec3 r = pvec3::Constant(radius[k]);
+            nodes[leafNode(k)].lo = center[k] - r;
+            nodes[leafNode(k)].hi = center[k] + r;
+        }
+    });
+    pool.parallelFor(n - 1, [&](int begin, int end, int) {
+        for (int i = begin; i < end; i++) {
+            buildNode(i);
+            visits[i].store(0, std::memory_order_relaxed);
+        }
+    });
+    if (n > 1)
+        pool.parallelFor(n, [&](int begin, int end, int) {
+            for (int k = begin; k < end; k++)
+                refit(k);
+        });
+}
+
+void Broadphase::findPairs(ThreadPool &pool, const int *handles, const CollisionFilter *filter,
+                           const Broadphase *other) {
+    int threads = pool.size();
+    this->handles = handles;
+    this->filter = handles && filter && !filter->empty() ? filter : NULL;
+    threadRejected.assign(threads, 0);
+    threadPairs.resize(threads);
+    for (int t = 0; t < threads; t++)
+        threadPairs[t].clear();
+    if (other && other->count < 1)
+        other = NULL;
+    if (count < 2 && !(count == 1 && other))
+        return;
+    pool.parallelFor(count, [&](int begin, int end, int t) {
+        int rejected = 0;
+        for (int k = begin; k < end; k++) {
+            if (count > 1)
+                query(k, threadPairs[t], rejected);
+            if (other && dynamic[k])
+                queryOther(k, *other, threadPairs[t], rejected);
+        }
+        threadRejected[t] += rejected;
+    });
+}
+
+#endif
@@ -3,18 +3,7 @@
 
 #include "gui.hpp"
 
-#if __APPLE__
-#include <OpenGL/gl.h>
-#include <OpenGL/glu.h>
-#else
-#include <GL/gl.h>
-#include <GL/glu.h>
-#endif
-
-#include <Eigen/Dense>
-
-typedef Eigen::Vector3f vec3;
-typedef Eigen::Matrix3f mat3;
+#include "common.hpp"
 
 class Camera {
 public:
@@ -0,0 +1,502 @@
+#ifndef COLLIDE_HPP
+#define COLLIDE_HPP
+
+#include "common.hpp"
+#include "log.hpp"
+#include "rb.hpp"
+#include "sdf.hpp"
+#include "shape.hpp"
+
+#include <algorithm>
+
+// Body-body collision. Each pair of shape types has a Narrowphase<A, B>
+// specialization that only finds the contact geometry; all of them share
+// resolveContact for the impulse, which the contact solver applies.
+
+struct SphereShape { static const int type = SPHERE; };
+struct BoxShape { static const int type = BOX; };
+struct CapsuleShape { static const int type = CAPSULE; };
+struct CylinderShape { static const int type = CYLINDER; };
+struct CompoundShape { static const int type = COMPOUND; };
+
+// One contact between bodies a and b: the arms from each center to the
+// contact point, the normal pointing from a towards b, and the overlap.
+struct Contact {
+    vec3 ra, rb, normal;
+    scalar depth;
+};
+
+// Impulse response along c.normal, with the restitution of the less bouncy
+// body. `friction` adds the tangential impulse of the larger friction
+// coefficient; `pushOut` also separates the bodies by 20% of the depth per
+// step. Static and kinematic bodies take no impulse, as if infinitely
+// heavy. Returns 1 for a resting or separating contact, 2 if an impulse was
+// applied.
+inline int resolveContact(RigidBody *a, RigidBody *b, const Contact &c, scalar dt,
+                          bool friction, bool pushOut) {
+    scalar e = std::min(a->eta, b->eta);
+    scalar relative = (b->linear_velocity + b->angular_velocity.cross(c.rb)
+                       - (a->linear_velocity + a->angular_velocity.cross(c.ra))).dot(c.normal);
+    scalar target = std::max(-e*relative, (scalar)0);
+    if (pushOut)
+        target += 0.2*c.depth/dt;
+    if (relative >= target)
+        return 1;
+    // the angular terms vanish for a sphere, whose arm is along the normal
+    scalar num = (target - relative)/dt;
+    bool moveA = a->isDynamic(), moveB = b->isDynamic();
+    scalar denom = a->inverseMass() + b->inverseMass();
+    if (moveA)
+        denom += c.normal.dot((a->inverse_inertia_matrix * c.ra.cross(c.normal)).cross(c.ra));
+    if (moveB)
+        denom += c.normal.dot((b->inverse_inertia_matrix * c.rb.cross(c.normal)).cross(c.rb));
+    if (denom <= 0)
+        return 1;
+    vec3 imp_N = num/denom * c.normal;
+    if (moveA)
+        a->applyImpulse(-imp_N, c.ra);
+    if (moveB)
+        b->applyImpulse(imp_N, c.rb);
+    if (friction) {
+        scalar nu = std::max(a->nu, b->nu);
+        vec3 imp_fr = -nu * imp_N.norm() * (b->angular_velocity.cross(c.rb) - a->angular_velocity.cross(c.ra)).normalized();
+        if (moveA)
+            a->applyImpulse(imp_fr, c.ra);
+        if (moveB)
+            b->applyImpulse(-imp_fr, c.rb);
+    }
+    return 2;
+}
+
+// A shape and its orientation, all the contact tests read of a body. Bodies
+// convert to one; a compound's children are tested through ones made for
+// them, so no Shape is copied per child.
+struct ShapePose {
+    const Shape &shape;
+    const mat3 &rotation;
+    ShapePose(const RigidBody *body): shape(body->shape), rotation(body->rotation_matrix) {}
+    ShapePose(const Shape &shape, const mat3 &rotation): shape(shape), rotation(rotation) {}
+};
+
+// Contact geometry for shapes A and B. test() gets the offset b - a between
+// the centers and fills in c if the shapes overlap. A test must find at most
+// one contact per pair of bodies, combining several into one if need be:
+// ContactSolver::merge sorts contacts by their pair of bodies and relies on
+// that order being total, so the solver is deterministic across threads.
+template <class A, class B> struct Narrowphase;
+
+template <> struct Narrowphase<SphereShape, SphereShape> {
+    static const bool friction = true, pushOut = false;
+    static bool test(ShapePose a, ShapePose b, vec3 delta, Contact &c) {
+        scalar r = a.shape.radius + b.shape.radius;
+        if (delta.squaredNorm() > r*r)
+            return false;
+        fill(a, b, delta, delta.normalized(), c);
+        return true;
+    }
+    // for a normal found elsewhere, e.g. by the batched kernel
+    static void fill(ShapePose a, ShapePose b, vec3 delta, vec3 normal, Contact &c) {
+        c.normal = normal;
+        c.ra = a.shape.radius * normal;
+        c.rb = c.ra - delta;
+        c.depth = a.shape.radius + b.shape.radius - delta.norm();
+    }
+};
+
+template <> struct Narrowphase<SphereShape, BoxShape> {
+    static const bool friction = false, pushOut = false;
+    static bool test(ShapePose a, ShapePose b, vec3 delta, Contact &c) {
+        scalar d;
+        vec3 normal;
+        b.shape.collisionTest(b.rotation.transpose() * -delta, d, normal);
+        if (d >= a.shape.radius)
+            return false;
+        c.normal = -(b.rotation * normal);
+        LOG_TRACE("sphere normal = (%g, %g, %g)", c.normal[0], c.normal[1], c.normal[2]);
+        c.ra = a.shape.radius * c.normal;
+        c.rb = c.ra - delta;
+        c.depth = a.shape.radius - d;
+        return true;
+    }
+};
+
+template <> struct Narrowphase<BoxShape, SphereShape> {
+    static const bool friction = false, pushOut = false;
+    static bool test(ShapePose a, ShapePose b, vec3 delta, Contact &c) {
+        if (!Narrowphase<SphereShape, BoxShape>::test(b, a, -delta, c))
+            return false;
+        std::swap(c.ra, c.rb);
+        c.normal = -c.normal;
+        return true;
+    }
+};
+
+// Each box's collision samples are tested against the other's distance
+// field, and every sample found inside is a contact point with the other
+// box's surface normal. These are averaged into one contact, weighted by
+// depth so that samples grazing a face that happens to be flush with one of
+// the other box's faces do not tip the normal. Unlike spheres, a box sinking
+// into another soon finds a side face nearer than the one it came through,
+// so the response also pushes the boxes apart.
+template <> struct Narrowphase<BoxShape, BoxShape> {
+    static const bool friction = false, pushOut = true;
+    static bool test(ShapePose a, ShapePose b, vec3 delta, Contact &c) {
+        static thread_local SampleHits mine, theirs;
+        const mat3 &Ra = a.rotation, &Rb = b.rotation;
+        mine.clear();
+        theirs.clear();
+        samplesInside(a.shape, Rb.transpose()*Ra, -(Rb.transpose()*delta), b.shape, mine);
+        samplesInside(b.shape, Ra.transpose()*Rb, Ra.transpose()*delta, a.shape, theirs);
+        vec3 ra(0,0,0), normal(0,0,0);
+        scalar depth = 0, weight = 0;
+        for (int i = 0; i < mine.size(); ++i) {
+            scalar w = mine.depth[i];
+            ra += w * (Ra * a.shape.samples->points[mine.sample[i]]);
+            normal -= w * (Rb * vec3(mine.nx[i], mine.ny[i], mine.nz[i]));
+            depth = std::max(depth, w);
+            weight += w;
+        }
+        for (int i = 0; i < theirs.size(); ++i) {
+            scalar w = theirs.depth[i];
+            ra += w * (Rb * b.shape.samples->points[theirs.sample[i]] + delta);
+            normal += w * (Ra * vec3(theirs.nx[i], theirs.ny[i], theirs.nz[i]));
+            depth = std::max(depth, w);
+            weight += w;
+        }
+        if (mine.size() + theirs.size() == 0)
+            return false;
+        c.ra = vec3(0,0,0);
+        c.rb = -delta;
+        c.normal = vec3(0,0,0);
+        c.depth = 0;
+        // touching, but with nothing to push along
+        if (weight == 0 || normal.squaredNorm() == 0)
+            return true;
+        c.normal = normal.normalized();
+        c.ra = ra/weight;
+        c.rb = c.ra - delta;
+        c.depth = depth;
+        LOG_TRACE("box-box %d points, normal = (%g, %g, %g)", mine.size() + theirs.size(),
+                  c.normal[0], c.normal[1], c.normal[2]);
+        return true;
+    }
+};
+
+// B against A, turned around
+template <class A, class B> struct SwappedNarrowphase {
+    static const bool friction = Narrowphase<B, A>::friction, pushOut = Narrowphase<B, A>::pushOut;
+    static bool test(ShapePose a, ShapePose b, vec3 delta, Contact &c) {
+        if (!Narrowphase<B, A>::test(b, a, -delta, c))
+            return false;
+        std::swap(c.ra, c.rb);
+        c.normal = -c.normal;
+        return true;
+    }
+};
+
+// Capsules are found in closed form: a capsule is the set of points within
+// its radius of a segment, so against spheres and other capsules the
+// contact is that of two spheres about the closest points of the segments,
+// and against a box that of a sphere about the point of the segment
+// deepest in the box. Where a whole stretch of a segment is equally near,
+// as for a capsule lying flat on a box or on another capsule parallel to
+// it, the middle of that stretch is taken, so a resting capsule is not
+// tipped towards one end. Unlike the sphere tests these push the bodies
+// apart, as a capsule lying along a surface otherwise sinks into it, and
+// leave out friction, whose arm is not along the normal here.
+
+inline scalar clampTo(scalar x, scalar h) {
+    return std::min(std::max(x, -h), h);
+}
+
+// Closest points of the segments s*u, |s| <= hu, and d + t*v, |t| <= hv,
+// with u and v of unit length.
+inline void closestOnSegments(vec3 u, scalar hu, vec3 d, vec3 v, scalar hv, scalar &s, scalar &t) {
+    scalar b = u.dot(v), du = u.dot(d), dv = v.dot(d);
+    scalar denom = 1 - b*b;
+    if (denom > 1e-6)
+        s = clampTo((du - b*dv)/denom, hu);
+    else {
+        // parallel: the middle of where they overlap along u
+        scalar lo = std::max(-hu, du - hv), hi = std::min(hu, du + hv);
+        s = lo <= hi ? (lo + hi)/2 : clampTo(du, hu);
+    }
+    t = clampTo(s*b - dv, hv);
+    s = clampTo(t*b + du, hu);
+}
+
+// The parameter s of the point p + s*w, |s| <= h, that is deepest in the
+// box, or nearest it if none is inside, with p and w in the box's frame.
+// The distance is convex along the segment and has a closed-form minimum
+// between the points where the segment crosses the planes of the faces and
+// of the box's own axes: outside, where the squared distance to the
+// nearest face, edge or corner is least, and inside, where the two nearest
+// faces are equally near. The least of those candidates is the answer.
+inline scalar segmentBoxDeepest(const Shape &box, vec3 p, vec3 w, scalar h, scalar flatness) {
+    const vec3 &e = box.halfSize;
+    scalar cuts[11], candidates[32];
+    int n = 0, m = 0;
+    cuts[n++] = -h;
+    cuts[n++] = h;
+    for (int i = 0; i < 3; i++)
+        if (w[i] != 0)
+            for (int k = -1; k <= 1; k++) {
+                scalar s = (k*e[i] - p[i])/w[i];
+                if (s > -h && s < h)
+                    cuts[n++] = s;
+            }
+    std::sort(cuts, cuts + n);
+    for (int k = 0; k < n; k++)
+        candidates[m++] = cuts[k];
+    for (int k = 0; k + 1 < n; k++) {
+        scalar s0 = cuts[k], s1 = cuts[k+1];
+        if (s1 <= s0)
+            continue;
+        vec3 x = p + (s0 + s1)/2*w, side;
+        for (int i = 0; i < 3; i++)
+            side[i] = x[i] < 0 ? -1 : 1;
+        if ((x.cwiseAbs() - e).maxCoeff() > 0) {
+            scalar A = 0, B = 0;
+            for (int i = 0; i < 3; i++)
+                if (std::abs(x[i]) > e[i]) {
+                    A += w[i]*w[i];
+                    B += w[i]*(p[i] - side[i]*e[i]);
+                }
+            if (A > 0)
+                candidates[m++] = std::min(std::max(-B/A, s0), s1);
+        } else {
+            for (int i = 0; i < 3; i++)
+                for (int j = i + 1; j < 3; j++) {
+                    scalar slope = side[i]*w[i] - side[j]*w[j];
+                    if (slope == 0)
+                        continue;
+                    scalar s = ((side[j]*p[j] - e[j]) - (side[i]*p[i] - e[i]))/slope;
+                    if (s > s0 && s < s1)
+                        candidates[m++] = s;
+                }
+        }
+    }
+    scalar f[32], best = 1e30;
+    for (int k = 0; k < m; k++) {
+        vec3 normal;
+        box.collisionTest(p + candidates[k]*w, f[k], normal);
+        best = std::min(best, f[k]);
+    }
+    scalar lo = h, hi = -h;
+    for (int k = 0; k < m; k++)
+        if (f[k] <= best + flatness) {
+            lo = std::min(lo, candidates[k]);
+            hi = std::max(hi, candidates[k]);
+        }
+    return (lo + hi)/2;
+}
+
+// Contact between a sphere of radius ra about pa and one of radius rb about
+// pb, both relative to a's center.
+inline bool roundContact(vec3 pa, scalar ra, vec3 pb, scalar rb, vec3 delta, Contact &c) {
+    vec3 d = pb - pa;
+    scalar r = ra + rb, len = d.norm();
+    if (len > r)
+        return false;
+    c.normal = vec3(0,0,0);
+    c.ra = pa;
+    c.depth = r;
+    // concentric, with nothing to push along
+    if (len > 0) {
+        c.normal = d/len;
+        c.ra = pa + ra*c.normal;
+        c.depth = r - len;
+    }
+    c.rb = c.ra - delta;
+    return true;
+}
+
+template <> struct Narrowphase<SphereShape, CapsuleShape> {
+    static const bool friction = false, pushOut = true;
+    static bool test(ShapePose a, ShapePose b, vec3 delta, Contact &c) {
+        vec3 axis = b.rotation.col(1);
+        scalar t = clampTo(-delta.dot(axis), b.shape.halfSize[1]);
+        return roundContact(vec3(0,0,0), a.shape.radius, delta + t*axis, b.shape.radius, delta, c);
+    }
+};
+
+template <> struct Narrowphase<CapsuleShape, CapsuleShape> {
+    static const bool friction = false, pushOut = true;
+    static bool test(ShapePose a, ShapePose b, vec3 delta, Contact &c) {
+        vec3 u = a.rotation.col(1), v = b.rotation.col(1);
+        scalar s, t;
+        closestOnSegments(u, a.shape.halfSize[1], delta, v, b.shape.halfSize[1], s, t);
+        return roundContact(s*u, a.shape.radius, delta + t*v, b.shape.radius, delta, c);
+    }
+};
+
+template <> struct Narrowphase<CapsuleShape, BoxShape> {
+    static const bool friction = false, pushOut = true;
+    static bool test(ShapePose a, ShapePose b, vec3 delta, Contact &c) {
+        // the capsule's axis in the box's frame
+        const mat3 &Rb = b.rotation;
+        vec3 p = Rb.transpose() * -delta, w = Rb.transpose() * a.rotation.col(1);
+        scalar r = a.shape.radius;
+        scalar s = segmentBoxDeepest(b.shape, p, w, a.shape.halfSize[1], 0.01*r);
+        scalar d;
+        vec3 normal;
+        b.shape.collisionTest(p + s*w, d, normal);
+        if (d >= r)
+            return false;
+        c.normal = -(Rb * normal);
+        c.ra = s*a.rotation.col(1) + r*c.normal;
+        c.rb = c.ra - delta;
+        c.depth = r - d;
+        return true;
+    }
+};
+
+template <> struct Narrowphase<CapsuleShape, SphereShape>: SwappedNarrowphase<CapsuleShape, SphereShape> {};
+template <> struct Narrowphase<BoxShape, CapsuleShape>: SwappedNarrowphase<BoxShape, CapsuleShape> {};
+
+// Cylinders have no such closed form against boxes or other cylinders, so
+// they go through the same test as two boxes, on their collision samples
+// and distance fields, which works for any pair of shapes that have both.
+// A sphere meets a cylinder's distance field as it does a box's.
+template <> struct Narrowphase<SphereShape, CylinderShape>: Narrowphase<SphereShape, BoxShape> {};
+template <> struct Narrowphase<BoxShape, CylinderShape>: Narrowphase<BoxShape, BoxShape> {};
+template <> struct Narrowphase<CylinderShape, BoxShape>: Narrowphase<BoxShape, BoxShape> {};
+template <> struct Narrowphase<CapsuleShape, CylinderShape>: Narrowphase<BoxShape, BoxShape> {};
+template <> struct Narrowphase<CylinderShape, CapsuleShape>: Narrowphase<BoxShape, BoxShape> {};
+template <> struct Narrowphase<CylinderShape, CylinderShape>: Narrowphase<BoxShape, BoxShape> {};
+template <> struct Narrowphase<CylinderShape, SphereShape>: SwappedNarrowphase<CylinderShape, SphereShape> {};
+
+// Compounds are tested child by child with the tests above. Each child of
+// one body is found near the other through the other's tree, after the
+// first body's children are themselves narrowed down to those near the
+// other's bounds, so two large compounds touching at a corner cost only
+// the children at that corner. The contacts of all the overlapping
+// children are averaged into one, weighted by depth as for two boxes, as a
+// pair of bodies must have at most one contact (see Narrowphase).
+
+// child k of a compound, or the shape itself as its only child
+inline const Shape &partShape(const Shape &s, int k) {
+    return s.type == COMPOUND ? s.compound->children[k].shape : s;
+}
+
+typedef bool (*ContactTest)(ShapePose a, ShapePose b, vec3 delta, Contact &c);
+
+const ContactTest primitiveContactTable[COMPOUND][COMPOUND] = {
+    {Narrowphase<SphereShape, SphereShape>::test, Narrowphase<SphereShape, BoxShape>::test,
+     Narrowphase<SphereShape, CapsuleShape>::test, Narrowphase<SphereShape, CylinderShape>::test},
+    {Narrowphase<BoxShape, SphereShape>::test, Narrowphase<BoxShape, BoxShape>::test,
+     Narrowphase<BoxShape, CapsuleShape>::test, Narrowphase<BoxShape, CylinderShape>::test},
+    {Narrowphase<CapsuleShape, SphereShape>::test, Narrowphase<CapsuleShape, BoxShape>::test,
+     Narrowphase<CapsuleShape, CapsuleShape>::test, Narrowphase<CapsuleShape, CylinderShape>::test},
+    {Narrowphase<CylinderShape, SphereShape>::test, Narrowphase<CylinderShape, BoxShape>::test,
+     Narrowphase<CylinderShape, CapsuleShape>::test, Narrowphase<CylinderShape, CylinderShape>::test},
+};
+
+inline bool compoundContact(ShapePose a, ShapePose b, vec3 delta, Contact &c) {
+    static thread_local std::vector<int> mine, theirs;
+    const Shape &sa = a.shape, &sb = b.shape;
+    const mat3 &Ra = a.rotation, &Rb = b.rotation;
+    // x_b = toB x_a + offset takes a's body frame into b's
+    mat3 toB = Rb.transpose()*Ra;
+    vec3 offset = -(Rb.transpose()*delta);
+    vec3 lo, hi, partLo, partHi;
+    mine.clear();
+    if (sa.type == COMPOUND) {
+        sb.bounds(lo, hi);
+        moveBounds(lo, hi, toB.transpose(), Ra.transpose()*delta, partLo, partHi);
+        sa.compound->query(partLo, partHi, mine);
+    } else
+        mine.push_back(0);
+    vec3 ra(0,0,0), normal(0,0,0);
+    scalar depth = 0, weight = 0;
+    int hits = 0;
+    for (int m = 0; m < mine.size(); ++m) {
+        int i = mine[m];
+        const Shape &ca = partShape(sa, i);
+        vec3 pa(0,0,0);
+        mat3 rotA = mat3::Identity();
+        if (sa.type == COMPOUND) {
+            pa = sa.compound->children[i].position;
+            rotA = sa.compound->children[i].rotation;
+        }
+        theirs.clear();
+        if (sb.type == COMPOUND) {
+            ca.bounds(lo, hi);
+            moveBounds(lo, hi, toB*rotA, toB*pa + offset, partLo, partHi);
+            sb.compound->query(partLo, partHi, theirs);
+        } else
+            theirs.push_back(0);
+        if (theirs.empty())
+            continue;
+        mat3 partRotA = Ra*rotA;
+        ShapePose partA(ca, partRotA);
+        vec3 armA = Ra*pa;
+        for (int t = 0; t < theirs.size(); ++t) {
+            int j = theirs[t];
+            const Shape &cb = partShape(sb, j);
+            vec3 pb(0,0,0);
+            mat3 rotB = mat3::Identity();
+            if (sb.type == COMPOUND) {
+                pb = sb.compound->children[j].position;
+                rotB = sb.compound->children[j].rotation;
+            }
+            mat3 partRotB = Rb*rotB;
+            Contact k;
+            if (!primitiveContactTable[ca.type][cb.type](partA, ShapePose(cb, partRotB), delta + Rb*pb - armA, k))
+                continue;
+            if (hits++ == 0) {
+                c = k;
+                c.ra += armA;
+                c.rb = c.ra - delta;
+            }
+            scalar w = k.depth;
+            ra += w*(armA + k.ra);
+            normal += w*k.normal;
+            depth = std::max(depth, w);
+            weight += w;
+        }
+    }
+    if (hits == 0)
+        return false;
+    // one child contact is taken as it is, without rounding
+    if (hits == 1)
+        return true;
+    c.ra = vec3(0,0,0);
+    c.rb = -delta;
+    c.normal = vec3(0,0,0);
+    c.depth = 0;
+    // touching, or held from opposite sides, with nothing to push along
+    if (weight <= 0 || normal.squaredNorm() == 0)
+        return true;
+    c.normal = normal.normalized();
+    c.ra = ra/weight;
+    c.rb = c.ra - delta;
+    c.depth = depth;
+    return true;
+}
+
+// Like two boxes, compounds can sink into each other until another face is
+// nearer, so they are pushed apart too. The response is the same for every
+// pair of children, whatever their shapes: without friction and pushed
+// apart. So a compound of one child only answers exactly as that child
+// would where its own test does the same, e.g. box against box or capsule;
+// a sphere child loses the friction it gets against another sphere, and
+// gains the push that it does not get against a sphere, box or cylinder.
+struct CompoundNarrowphase {
+    static const bool friction = false, pushOut = true;
+    static bool test(ShapePose a, ShapePose b, vec3 delta, Contact &c) {
+        return compoundContact(a, b, delta, c);
+    }
+};
+
+template <> struct Narrowphase<SphereShape, CompoundShape>: CompoundNarrowphase {};
+template <> struct Narrowphase<BoxShape, CompoundShape>: CompoundNarrowphase {};
+template <> struct Narrowphase<CapsuleShape, CompoundShape>: CompoundNarrowphase {};
+template <> struct Narrowphase<CylinderShape, CompoundShape>: CompoundNarrowphase {};
+template <> struct Narrowphase<CompoundShape, SphereShape>: CompoundNarrowphase {};
+template <> struct Narrowphase<CompoundShape, BoxShape>: CompoundNarrowphase {};
+template <> struct Narrowphase<CompoundShape, CapsuleShape>: CompoundNarrowphase {};
+template <> struct Narrowphase<CompoundShape, CylinderShape>: CompoundNarrowphase {};
+template <> struct Narrowphase<CompoundShape, CompoundShape>: CompoundNarrowphase {};
+
+#endif
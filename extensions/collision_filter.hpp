@@ -0,0 +1,80 @@
+#ifndef COLLISION_FILTER_HPP
+#define COLLISION_FILTER_HPP
+
+#include <algorithm>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+// Which pairs of bodies may collide, checked by the broadphase before a
+// pair is handed on, so filtered pairs cost no narrowphase work.
+//
+// Every body has a group and a mask of 32 bits each (RigidBody::group and
+// ::mask). Two bodies collide only if each one's group is in the other's
+// mask; by default every body is in group 1 and its mask has all bits, so
+// everything collides. Debris that should not hit other debris, say, gets a
+// group of its own left out of its mask.
+//
+// Single pairs are excluded with ignore(), by handle, for the exceptions
+// that groups can't express, such as two bodies joined by a constraint.
+
+inline bool groupsCollide(unsigned groupA, unsigned maskA, unsigned groupB, unsigned maskB) {
+    return (groupA & maskB) && (groupB & maskA);
+}
+
+class CollisionFilter {
+public:
+    void ignore(int a, int b) {
+        if (pairs.insert(key(a, b)).second) {
+            partners[a].push_back(b);
+            if (b != a)
+                partners[b].push_back(a);
+        }
+    }
+    void unignore(int a, int b) {
+        if (pairs.erase(key(a, b))) {
+            drop(a, b);
+            if (b != a)
+                drop(b, a);
+        }
+    }
+    bool ignored(int a, int b) const { return !pairs.empty() && pairs.count(key(a, b)); }
+    bool empty() const { return pairs.empty(); }
+    // drops every pair with `a`, when its handle is freed; only a's own
+    // partners are visited
+    void forget(int a) {
+        std::unordered_map<int, std::vector<int> >::iterator it = partners.find(a);
+        if (it == partners.end())
+            return;
+        std::vector<int> others;
+        others.swap(it->second);
+        partners.erase(it);
+        for (int i = 0; i < others.size(); i++) {
+            pairs.erase(key(a, others[i]));
+            if (others[i] != a)
+                drop(others[i], a);
+        }
+    }
+    void clear() {
+        pairs.clear();
+        partners.clear();
+    }
+protected:
+    std::unordered_set<unsigned long long> pairs;
+    std::unordered_map<int, std::vector<int> > partners; // each handle's ignored pairs
+    static unsigned long long key(int a, int b) {
+        return (unsigned long long)(unsigned)std::min(a, b) << 32 | (unsigned)std::max(a, b);
+    }
+    // takes b off a's list
+    void drop(int a, int b) {
+        std::unordered_map<int, std::vector<int> >::iterator it = partners.find(a);
+        if (it == partners.end())
+            return;
+        std::vector<int> &list = it->second;
+        list.erase(std::find(list.begin(), list.end(), b));
+        if (list.empty())
+            partners.erase(it);
+    }
+};
+
+#endif
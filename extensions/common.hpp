@@ -11,8 +11,24 @@
 #include <GL/glu.h>
 #endif
 
-typedef Eigen::Vector2f vec2;
-typedef Eigen::Vector3f vec3;
-typedef Eigen::Quaternionf quat;
+// Engine precision. The default is float throughout. Build with
+// -DRB_REAL=double for a double precision engine, or with
+// -DRB_POSITION_REAL=double for mixed precision, where only body positions
+// are double and everything else, including the narrowphase and solver,
+// works in float on positions taken relative to the bodies involved.
+#ifndef RB_REAL
+#define RB_REAL float
+#endif
+#ifndef RB_POSITION_REAL
+#define RB_POSITION_REAL RB_REAL
+#endif
+
+typedef RB_REAL scalar;
+typedef RB_POSITION_REAL pscalar;
+typedef Eigen::Matrix<scalar,2,1> vec2;
+typedef Eigen::Matrix<scalar,3,1> vec3;
+typedef Eigen::Matrix<scalar,3,3> mat3;
+typedef Eigen::Quaternion<scalar> quat;
+typedef Eigen::Matrix<pscalar,3,1> pvec3;
 
 #endif
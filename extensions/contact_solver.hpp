@@ -0,0 +1,135 @@
+#ifndef CONTACT_SOLVER_HPP
+#define CONTACT_SOLVER_HPP
+
+#include "collide.hpp"
+#include "common.hpp"
+#include "rb.hpp"
+#include "thread_pool.hpp"
+
+#include <algorithm>
+#include <vector>
+
+// Applies the impulses of a step's body-body contacts in parallel, after
+// the narrowphase has found them all. The
+// contact graph (bodies as vertices, contacts as edges) is colored so that
+// no two contacts of one color share a body; each color is then a batch
+// whose impulses can be applied at once without two threads writing the
+// same body. The response is resolveContact (see collide.hpp).
+//
+// Coloring is greedy, in merge()'s order: each contact takes the lowest
+// color neither of its bodies has yet. Each body therefore receives
+// its impulses in the same order however many threads there are, and the
+// result does not depend on the thread count. Bodies in more than
+// maxContactColors contacts overflow into one last batch that is solved
+// serially.
+//
+// Static and kinematic bodies take no impulses, so contacts sharing one of
+// them do not conflict; only dynamic bodies count when coloring. A pile on
+// a static floor needs no more colors than the pile alone.
+
+const int maxContactColors = 64;
+
+// A contact found by the narrowphase, with the bodies as indices into the
+// array passed to solve() and the response options of its Narrowphase.
+struct ContactConstraint {
+    int a, b;
+    Contact contact;
+    bool friction, pushOut;
+    ContactConstraint() {}
+    ContactConstraint(int a, int b, const Contact &c, bool friction, bool pushOut):
+        a(a), b(b), contact(c), friction(friction), pushOut(pushOut) {}
+    // canonical order: by the lower body index, then the higher
+    bool operator<(const ContactConstraint &k) const {
+        int lo = std::min(a, b), klo = std::min(k.a, k.b);
+        return lo < klo || (lo == klo && std::max(a, b) < std::max(k.a, k.b));
+    }
+};
+
+class ContactSolver {
+public:
+    std::vector<ContactConstraint> constraints;
+    int minParallel; // batches smaller than this run on the calling thread
+    ContactSolver(): minParallel(256), colors(0) {}
+    void clear() { constraints.clear(); }
+    // replaces the constraints with those of all the buffers, in canonical
+    // order, so the result does not depend on which thread found what
+    void merge(const std::vector< std::vector<ContactConstraint> > &buffers);
+    // returns how many contacts applied an impulse
+    int solve(RigidBody *bodies, int n, scalar dt, ThreadPool &pool);
+    // batches in the last solve, including the overflow batch if used
+    int colorCount() const { return colors; }
+protected:
+    int colors;
+    std::vector<unsigned long long> used; // per body, colors already taken
+    std::vector<int> color, start, batch, threadHits;
+    void colorConstraints(const RigidBody *bodies, int n);
+};
+
+void ContactSolver::merge(const std::vector< std::vector<ContactConstraint> > &buffers) {
+    constraints.clear();
+    for (int t = 0; t < buffers.size(); t++)
+        constraints.insert(constraints.end(), buffers[t].begin(), buffers[t].end());
+    // every Narrowphase test gives a pair of bodies at most one contact, so
+    // this order is total
+    std::sort(constraints.begin(), constraints.end());
+}
+
+// Fills batch with the constraint indices grouped by color, in order within
+// each color, and start with where each color begins.
+void ContactSolver::colorConstraints(const RigidBody *bodies, int n) {
+    int m = constraints.size();
+    used.assign(n, 0);
+    color.resize(m);
+    start.assign(maxContactColors + 2, 0);
+    for (int i = 0; i < m; i++) {
+        const ContactConstraint &k = constraints[i];
+        bool da = bodies[k.a].isDynamic(), db = bodies[k.b].isDynamic();
+        unsigned long long free = ~((da ? used[k.a] : 0) | (db ? used[k.b] : 0));
+        int c = free ? __builtin_ctzll(free) : maxContactColors;
+        if (c < maxContactColors) {
+            if (da)
+                used[k.a] |= 1ull << c;
+            if (db)
+                used[k.b] |= 1ull << c;
+        }
+        color[i] = c;
+        start[c+1]++;
+    }
+    for (int c = 0; c <= maxContactColors; c++)
+        start[c+1] += start[c];
+    colors = 0;
+    for (int c = 0; c <= maxContactColors; c++)
+        if (start[c+1] > start[c])
+            colors++;
+    batch.resize(m);
+    std::vector<int> next(start.begin(), start.end() - 1);
+    for (int i = 0; i < m; i++)
+        batch[next[color[i]]++] = i;
+}
+
+int ContactSolver::solve(RigidBody *bodies, int n, scalar dt, ThreadPool &pool) {
+    colorConstraints(bodies, n);
+    threadHits.assign(pool.size(), 0);
+    for (int c = 0; c <= maxContactColors; c++) {
+        int begin = start[c], size = start[c+1] - begin;
+        std::function<void(int,int,int)> resolve = [&](int from, int to, int t) {
+            int hits = 0;
+            for (int i = from; i < to; i++) {
+                const ContactConstraint &k = constraints[batch[begin + i]];
+                hits += resolveContact(&bodies[k.a], &bodies[k.b], k.contact, dt,
+                                       k.friction, k.pushOut) == 2;
+            }
+            threadHits[t] += hits;
+        };
+        if (c == maxContactColors || size < minParallel)
+            resolve(0, size, 0);
+        else
+            pool.parallelFor(size, resolve);
+    }
+    int hits = 0;
+    for (int t = 0; t < threadHits.size(); t++)
+        hits += threadHits[t];
+    return hits;
+}
+
+#endif
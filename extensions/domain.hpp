@@ -0,0 +1,309 @@
+#ifndef DOMAIN_HPP
+#define DOMAIN_HPP
+
+#include "common.hpp"
+#include "rb.hpp"
+#include "transport.hpp"
+#include "world.hpp"
+
+#include <chrono>
+#include <cstring>
+#include <limits>
+#include <vector>
+
+#ifdef __unix__
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+// Spatial domain decomposition over processes. The scene is cut into slabs
+// along x, one per process, and each process steps a World holding the
+// bodies it owns plus ghost copies of its neighbours' bodies near the
+// shared boundaries. Every step, before stepping, each process sends each
+// neighbour one message over its Transport with
+//
+//   - migrants: owned bodies whose centers have crossed into the
+//     neighbour's slab, which the neighbour owns from now on, and
+//   - ghosts: owned bodies within ghostWidth of the boundary.
+//
+// A contact between an owned body and a ghost is found on both sides, and
+// each side keeps only the impulse on the body it owns; ghosts are thrown
+// away after the step. ghostWidth must cover the largest pair of bounding
+// radii, and no slab may be narrower than that, or bodies two slabs apart
+// could touch unseen; runDomains refuses such a split. A body must not
+// cross a whole slab in one step either: a migrant that arrives outside
+// the receiving slab fails the step.
+
+// A body's state as sent between processes. Both ends run the same build,
+// so the engine's own scalar types are copied as they are. Every shape but
+// the compound can be sent; compound shapes have no record yet, so a
+// domain with one fails rather than send it as something else.
+struct BodyRecord {
+    long long id;
+    int type, motion; // shape and body types
+    unsigned group, mask;
+    scalar radius, halfSize[3], mass, eta, nu, color[3];
+    pscalar position[3];
+    scalar rotation[4], linear[3], angular[3];
+};
+
+// what one process did over a run
+struct DomainStats {
+    int owned, maxGhosts;
+    long long migrations;
+    double ms;
+};
+
+class DomainWorld {
+public:
+    World world;
+    int rank, processes;
+    pscalar lo, hi;       // the owned slab, lo <= x < hi
+    scalar ghostWidth;
+    Transport *transport;
+    std::vector<RigidBody, Eigen::aligned_allocator<RigidBody> > owned;
+    std::vector<long long> ids; // of the owned bodies
+    long long migrations;
+    int ghosts;           // in the last step
+    DomainWorld(): rank(0), processes(1), lo(-std::numeric_limits<pscalar>::infinity()),
+                   hi(std::numeric_limits<pscalar>::infinity()), ghostWidth(1), transport(NULL),
+                   migrations(0), ghosts(0) {}
+    // false if an exchange failed, a neighbour's message was malformed, a
+    // migrant crossed a whole slab or an owned body is a compound
+    bool step(scalar dt);
+protected:
+    std::vector<Shape> shapes; // received shapes, shared by every body like them
+    std::vector<RigidBody, Eigen::aligned_allocator<RigidBody> > ghostBodies;
+    BodyRecord record(const RigidBody &rb, long long id) const;
+    RigidBody body(const BodyRecord &r);
+    void pack(std::vector<char> &out, const std::vector<int> &migrants, const std::vector<int> &near);
+};
+
+BodyRecord DomainWorld::record(const RigidBody &rb, long long id) const {
+    BodyRecord r;
+    memset(&r, 0, sizeof(r));
+    r.id = id;
+    r.type = rb.shape.type;
+    r.motion = rb.type;
+    r.group = rb.group;
+    r.mask = rb.mask;
+    r.radius = rb.shape.radius;
+    r.mass = rb.mass;
+    r.eta = rb.eta;
+    r.nu = rb.nu;
+    for (int k = 0; k < 3; k++) {
+        r.halfSize[k] = rb.shape.halfSize[k];
+        r.color[k] = rb.color[k];
+        r.position[k] = rb.position[k];
+        r.linear[k] = rb.linear_velocity[k];
+        r.angular[k] = rb.angular_velocity[k];
+    }
+    for (int k = 0; k < 4; k++)
+        r.rotation[k] = rb.rotation.coeffs()[k];
+    return r;
+}
+
+RigidBody DomainWorld::body(const BodyRecord &r) {
+    int s = 0;
+    while (s < shapes.size() && !(shapes[s].type == r.type && shapes[s].radius == r.radius
+                                  && shapes[s].halfSize == vec3(r.halfSize[0], r.halfSize[1], r.halfSize[2])))
+        s++;
+    if (s == shapes.size())
+        shapes.push_back(r.type == SPHERE ? Shape::makeSphere(r.radius)
+                         : r.type == CAPSULE ? Shape::makeCapsule(r.radius, r.halfSize[1])
+                         : r.type == CYLINDER ? Shape::makeCylinder(r.radius, r.halfSize[1])
+                         : Shape::makeBox(vec3(r.halfSize[0], r.halfSize[1], r.halfSize[2])));
+    RigidBody rb;
+    rb.shape = shapes[s];
+    rb.mass = r.mass;
+    rb.eta = r.eta;
+    rb.nu = r.nu;
+    rb.type = r.motion;
+    rb.group = r.group;
+    rb.mask = r.mask;
+    rb.inertia_matrix = rb.shape.moment()*rb.mass;
+    rb.inverse_inertia_body = rb.inertia_matrix.diagonal().cwiseInverse();
+    rb.color = vec3(r.color[0], r.color[1], r.color[2]);
+    quat q;
+    q.coeffs() << r.rotation[0], r.rotation[1], r.rotation[2], r.rotation[3];
+    rb.setTransform(pvec3(r.position[0], r.position[1], r.position[2]), q);
+    rb.linear_velocity = vec3(r.linear[0], r.linear[1], r.linear[2]);
+    rb.angular_velocity = vec3(r.angular[0], r.angular[1], r.angular[2]);
+    return rb;
+}
+
+// [migrant count][ghost count][records...]
+void DomainWorld::pack(std::vector<char> &out, const std::vector<int> &migrants, const std::vector<int> &near) {
+    int counts[2] = {(int)migrants.size(), (int)near.size()};
+    out.resize(sizeof(counts) + (counts[0] + counts[1])*sizeof(BodyRecord));
+    memcpy(&out[0], counts, sizeof(counts));
+    BodyRecord *r = (BodyRecord*)&out[sizeof(counts)];
+    for (int i = 0; i < migrants.size(); i++)
+        *r++ = record(owned[migrants[i]], ids[migrants[i]]);
+    for (int i = 0; i < near.size(); i++)
+        *r++ = record(owned[near[i]], ids[near[i]]);
+}
+
+bool DomainWorld::step(scalar dt) {
+    // sort owned bodies into those staying, leaving left and leaving right,
+    // and find the ones each neighbour needs as ghosts
+    std::vector<int> leave[2], near[2];
+    ghostBodies.clear();
+    for (int i = 0; i < owned.size(); i++) {
+        if (owned[i].shape.type == COMPOUND)
+            return false;
+        pscalar x = owned[i].position[0];
+        int side = x < lo && rank > 0 ? 0 : x >= hi && rank < processes - 1 ? 1 : -1;
+        if (side >= 0) {
+            leave[side].push_back(i);
+            // just across the boundary, so still close enough to touch ours
+            ghostBodies.push_back(owned[i]);
+            continue;
+        }
+        if (rank > 0 && x < lo + ghostWidth)
+            near[0].push_back(i);
+        if (rank < processes - 1 && x >= hi - ghostWidth)
+            near[1].push_back(i);
+    }
+    std::vector<char> out, in;
+    std::vector<BodyRecord> arrived;
+    for (int side = 0; side < 2; side++) {
+        int peer = side ? rank + 1 : rank - 1;
+        if (peer < 0 || peer >= processes)
+            continue;
+        pack(out, leave[side], near[side]);
+        if (!transport->exchange(peer, out, in))
+            return false;
+        // a frame that doesn't hold exactly the records it counts is
+        // refused rather than read past its end
+        int counts[2];
+        if (in.size() < sizeof(counts))
+            return false;
+        memcpy(counts, &in[0], sizeof(counts));
+        if (counts[0] < 0 || counts[1] < 0
+            || in.size() != sizeof(counts) + ((size_t)counts[0] + counts[1])*sizeof(BodyRecord))
+            return false;
+        const BodyRecord *r = (const BodyRecord*)&in[sizeof(counts)];
+        arrived.insert(arrived.end(), r, r + counts[0]);
+        for (int i = 0; i < counts[1]; i++)
+            ghostBodies.push_back(body(r[counts[0] + i]));
+        migrations += leave[side].size();
+    }
+    int left = 0;
+    for (int i = 0; i < owned.size(); i++) {
+        pscalar x = owned[i].position[0];
+        if ((x < lo && rank > 0) || (x >= hi && rank < processes - 1))
+            continue;
+        owned[left] = owned[i];
+        ids[left++] = ids[i];
+    }
+    owned.resize(left);
+    ids.resize(left);
+    for (int i = 0; i < arrived.size(); i++) {
+        if (!(arrived[i].position[0] >= lo && arrived[i].position[0] < hi))
+            return false;
+        owned.push_back(body(arrived[i]));
+        ids.push_back(arrived[i].id);
+    }
+
+    // owned bodies get handles 0..n-1, ghosts the rest
+    world.clear();
+    for (int i = 0; i < owned.size(); i++)
+        world.add(owned[i]);
+    for (int i = 0; i < ghostBodies.size(); i++)
+        world.add(ghostBodies[i]);
+    ghosts = ghostBodies.size();
+    world.update(dt);
+    for (int i = 0; i < owned.size(); i++)
+        owned[i] = world.body(i);
+    return true;
+}
+
+#ifdef __unix__
+
+// Steps `scene` for `steps` steps on `processes` forked processes, split
+// into equal slabs of the scene's extent along x, and waits for them.
+// stats[rank] is filled in for each process; false if any of them failed,
+// the transport could not be set up, the slabs would be narrower than the
+// ghost width or the scene has a compound body.
+bool runDomains(const std::vector<RigidBody, Eigen::aligned_allocator<RigidBody> > &scene,
+                int processes, Transport &transport, int steps, scalar dt, DomainStats *stats) {
+    if (!transport.valid())
+        return false;
+    for (int i = 0; i < scene.size(); i++)
+        if (scene[i].shape.type == COMPOUND)
+            return false;
+    pscalar x0 = std::numeric_limits<pscalar>::infinity(), x1 = -x0;
+    scalar reach = 0;
+    for (int i = 0; i < scene.size(); i++) {
+        x0 = std::min(x0, scene[i].position[0]);
+        x1 = std::max(x1, scene[i].position[0]);
+        reach = std::max(reach, scene[i].shape.boundingRadius());
+    }
+    // a little more than the widest pair, for what moves during a step
+    scalar ghostWidth = 2*reach + 0.1;
+    if (processes > 1 && (x1 - x0)/processes < ghostWidth)
+        return false;
+    DomainStats *shared = (DomainStats*)mmap(NULL, processes*sizeof(DomainStats), PROT_READ | PROT_WRITE,
+                                             MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shared == MAP_FAILED)
+        return false;
+    std::vector<pid_t> children;
+    for (int rank = 0; rank < processes; rank++) {
+        pid_t pid = fork();
+        if (pid < 0)
+            break;
+        if (pid > 0) {
+            children.push_back(pid);
+            continue;
+        }
+        transport.attach(rank);
+        DomainWorld domain;
+        domain.rank = rank;
+        domain.processes = processes;
+        domain.transport = &transport;
+        domain.world.reorderPeriod = 0; // rebuilt every step anyway
+        domain.ghostWidth = ghostWidth;
+        if (rank > 0)
+            domain.lo = x0 + (x1 - x0)*rank/processes;
+        if (rank < processes - 1)
+            domain.hi = x0 + (x1 - x0)*(rank + 1)/processes;
+        for (int i = 0; i < scene.size(); i++) {
+            pscalar x = scene[i].position[0];
+            if (x >= domain.lo && x < domain.hi) {
+                domain.owned.push_back(scene[i]);
+                domain.ids.push_back(i);
+            }
+        }
+        DomainStats s;
+        memset(&s, 0, sizeof(s));
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        bool ok = true;
+        for (int k = 0; k < steps && ok; k++) {
+            ok = domain.step(dt);
+            s.maxGhosts = std::max(s.maxGhosts, domain.ghosts);
+        }
+        s.ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        s.owned = domain.owned.size();
+        s.migrations = domain.migrations;
+        shared[rank] = s;
+        _exit(ok ? 0 : 1);
+    }
+    // so a rank that dies is seen by its neighbours, not kept alive here
+    transport.release();
+    bool ok = children.size() == processes;
+    for (int i = 0; i < children.size(); i++) {
+        int status;
+        waitpid(children[i], &status, 0);
+        ok = ok && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    }
+    for (int rank = 0; rank < processes; rank++)
+        stats[rank] = shared[rank];
+    munmap(shared, processes*sizeof(DomainStats));
+    return ok;
+}
+
+#endif
+
+#endif
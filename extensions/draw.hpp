@@ -27,9 +27,13 @@ void drawQuad(vec3 x0, vec3 x1, vec3 x2, vec3 x3,
 // disable the former when you need to debug collision points.
 void drawBox(vec3 xmin, vec3 xmax, bool drawSurf=true, bool drawWire=true);
 void drawSphere(vec3 center, float radius, bool drawSurf=true, bool drawWire=true);
+// along the y axis, halfLength to either side of the center
+void drawCapsule(vec3 center, float radius, float halfLength, bool drawSurf=true, bool drawWire=true);
+void drawCylinder(vec3 center, float radius, float halfLength, bool drawSurf=true, bool drawWire=true);
 
 void translate(vec3 x);
 void rotate(quat q);
+void rotate(mat3 r);
 void pushTransform();
 void popTransform();
 
@@ -236,16 +240,90 @@ void drawSphere(vec3 center, float radius, bool drawSurf, bool drawWire) {
     glPopMatrix();
 }
 
+// the tube of a capsule or cylinder, and for a capsule the caps
+void drawRound(vec3 center, float radius, float halfLength, bool capsule, bool drawSurf, bool drawWire) {
+    glPushMatrix();
+    glTranslatef(center[0],center[1],center[2]);
+    if (drawSurf) {
+        if (drawWire) {
+            glEnable(GL_POLYGON_OFFSET_FILL);
+            glPolygonOffset(1,1);
+        }
+        GLUquadric* quadric = gluNewQuadric();
+        glPushMatrix();
+        // quadrics are along z
+        glRotatef(-90, 1,0,0);
+        glTranslatef(0,0,-halfLength);
+        gluCylinder(quadric, radius,radius, 2*halfLength, 30,1);
+        if (capsule) {
+            gluSphere(quadric, radius, 30,30);
+            glTranslatef(0,0,2*halfLength);
+            gluSphere(quadric, radius, 30,30);
+        } else {
+            gluQuadricOrientation(quadric, GLU_INSIDE);
+            gluDisk(quadric, 0,radius, 30,1);
+            gluQuadricOrientation(quadric, GLU_OUTSIDE);
+            glTranslatef(0,0,2*halfLength);
+            gluDisk(quadric, 0,radius, 30,1);
+        }
+        glPopMatrix();
+        gluDeleteQuadric(quadric);
+        if (drawWire)
+            glDisable(GL_POLYGON_OFFSET_FILL);
+    }
+    if (drawWire) {
+        if (drawSurf) {
+            glPushAttrib(GL_CURRENT_BIT);
+            setColor(vec3(0,0,0));
+        }
+        glPushAttrib(GL_ENABLE_BIT);
+        glDisable(GL_LIGHTING);
+        for (int end = -1; end <= 1; end += 2) {
+            vec3 c(0, end*halfLength, 0);
+            drawCircle(c, radius*vec3(1,0,0), radius*vec3(0,0,1));
+            if (capsule) {
+                drawCircle(c, radius*vec3(1,0,0), radius*vec3(0,1,0));
+                drawCircle(c, radius*vec3(0,1,0), radius*vec3(0,0,1));
+            }
+        }
+        for (int i = 0; i < 4; i++) {
+            vec3 side = radius*vec3(cos(M_PI/2*i), 0, sin(M_PI/2*i));
+            drawLine(side - vec3(0,halfLength,0), side + vec3(0,halfLength,0));
+        }
+        glPopAttrib();
+        if (drawSurf)
+            glPopAttrib();
+    }
+    glPopMatrix();
+}
+
+void drawCapsule(vec3 center, float radius, float halfLength, bool drawSurf, bool drawWire) {
+    drawRound(center, radius, halfLength, true, drawSurf, drawWire);
+}
+
+void drawCylinder(vec3 center, float radius, float halfLength, bool drawSurf, bool drawWire) {
+    drawRound(center, radius, halfLength, false, drawSurf, drawWire);
+}
+
 void translate(vec3 x) {
     glTranslatef(x[0], x[1], x[2]);
 }
     
 void rotate(quat q) {
-    Eigen::AngleAxis<float> aa(q);
+    Eigen::AngleAxis<scalar> aa(q);
     vec3 a = aa.axis();
     glRotatef(aa.angle()*180/M_PI, a[0], a[1], a[2]);
 }
 
+void rotate(mat3 r) {
+    GLfloat m[16] = {0};
+    for (int i = 0; i < 3; i++)
+        for (int j = 0; j < 3; j++)
+            m[4*j+i] = r(i,j);
+    m[15] = 1;
+    glMultMatrixf(m);
+}
+
 void pushTransform() {
     glPushMatrix();
 }
@@ -0,0 +1,179 @@
+#ifndef HALFSPACE_HPP
+#define HALFSPACE_HPP
+
+#include "common.hpp"
+#include "shape.hpp"
+#include "simd.hpp"
+
+#include <vector>
+
+// Contacts between a box and a half space {x : normal.x <= offset}, found
+// from the box's collision samples. Only the height of each sample above the
+// plane is needed, so the plane normal is taken into the body frame once and
+// the samples are tested floatv::width at a time with a dot product each.
+// Of the samples below the plane at most `maxHalfSpaceContacts` are kept:
+// the deepest, then the ones that spread the contact patch widest, so a box
+// lying on a face gets its four corners and one resting on an edge its two.
+
+const int maxHalfSpaceContacts = 4;
+
+// Writes the arms (sample positions relative to the body center, in world
+// orientation) and depths of the kept contacts, and returns how many there
+// are. `height` is the signed distance of the body center from the plane.
+int halfSpaceContacts(const Shape &shape, const mat3 &rotation, vec3 normal, scalar height,
+                      vec3 *arms, scalar *depths);
+int halfSpaceContactsScalar(const Shape &shape, const mat3 &rotation, vec3 normal, scalar height,
+                            vec3 *arms, scalar *depths);
+
+// Picks the contacts out of the penetrating samples `hits`, deepest first.
+int reduceHalfSpaceContacts(const Shape &shape, const mat3 &rotation,
+                            const std::vector<int> &hits, const std::vector<float> &depth,
+                            vec3 *arms, scalar *depths) {
+    int n = hits.size();
+    if (n == 0)
+        return 0;
+    int chosen[maxHalfSpaceContacts];
+    // the deepest sample; ties go to the lower index, i.e. to the corners
+    int best = 0;
+    for (int i = 1; i < n; i++)
+        if (depth[i] > depth[best])
+            best = i;
+    chosen[0] = best;
+    int count = 1;
+    const std::vector<vec3> &s = shape.samples->points;
+    vec3 s0 = s[hits[chosen[0]]];
+    // the sample farthest from it
+    scalar far = 1e-12;
+    for (int i = 0; i < n; i++) {
+        scalar d = (s[hits[i]] - s0).squaredNorm();
+        if (d > far) {
+            far = d;
+            chosen[count] = i;
+        }
+    }
+    if (far > 1e-12) {
+        count++;
+        // the one farthest from the line through the two, then the one
+        // farthest on the other side of that line
+        vec3 edge = s[hits[chosen[1]]] - s0;
+        vec3 side(0,0,0);
+        far = 1e-12;
+        for (int i = 0; i < n; i++) {
+            vec3 c = edge.cross(s[hits[i]] - s0);
+            if (c.squaredNorm() > far) {
+                far = c.squaredNorm();
+                side = c;
+                chosen[count] = i;
+            }
+        }
+        if (far > 1e-12) {
+            count++;
+            far = 1e-12;
+            for (int i = 0; i < n; i++) {
+                scalar d = -edge.cross(s[hits[i]] - s0).dot(side);
+                if (d > far) {
+                    far = d;
+                    chosen[count] = i;
+                }
+            }
+            if (far > 1e-12)
+                count++;
+        }
+    }
+    for (int k = 0; k < count; k++) {
+        arms[k] = rotation * s[hits[chosen[k]]];
+        depths[k] = depth[chosen[k]];
+    }
+    return count;
+}
+
+int halfSpaceContacts(const Shape &shape, const mat3 &rotation, vec3 normal, scalar height,
+                      vec3 *arms, scalar *depths) {
+    // no sample is farther from the center than the bounding radius
+    if (height > shape.boundingRadius())
+        return 0;
+    static thread_local std::vector<int> hits;
+    static thread_local std::vector<float> depth;
+    hits.clear();
+    depth.clear();
+    const int W = floatv::width;
+    int n = shape.samples->points.size();
+    vec3 local = rotation.transpose() * normal;
+    floatv nx(local[0]), ny(local[1]), nz(local[2]), h((float)height);
+    float d[W];
+    for (int i = 0; i < n; i += W) {
+        floatv x = floatv::load(&shape.samples->x[i]);
+        floatv y = floatv::load(&shape.samples->y[i]);
+        floatv z = floatv::load(&shape.samples->z[i]);
+        floatv below = -(h + nx*x + ny*y + nz*z);
+        int bits = (below >= floatv(0.f)).bits();
+        if (n - i < W)
+            bits &= (1 << (n - i)) - 1;
+        if (!bits)
+            continue;
+        below.store(d);
+        for (; bits; bits &= bits - 1) {
+            int k = __builtin_ctz(bits);
+            hits.push_back(i+k);
+            depth.push_back(d[k]);
+        }
+    }
+    return reduceHalfSpaceContacts(shape, rotation, hits, depth, arms, depths);
+}
+
+// Capsules and cylinders meet the plane in closed form. A capsule's lowest
+// points are those of the spheres at the ends of its axis, so it has a
+// contact at each end that is below the plane. A cylinder is tested at four
+// points of each rim a quarter turn apart, starting from the one that leans
+// furthest down: a tilted cylinder touches at that one, one lying on its
+// side at one per rim, and one standing on a cap at all four of its rim.
+int roundHalfSpaceContacts(const Shape &shape, const mat3 &rotation, vec3 normal, scalar height,
+                           vec3 *arms, scalar *depths) {
+    if (height > shape.boundingRadius())
+        return 0;
+    vec3 axis = rotation.col(1);
+    scalar r = shape.radius, h = shape.halfSize[1];
+    int count = 0;
+    if (shape.type == CAPSULE) {
+        for (int end = -1; end <= 1; end += 2) {
+            vec3 c = end*h*axis;
+            scalar below = r - (height + normal.dot(c));
+            if (below >= 0) {
+                arms[count] = c - r*normal;
+                depths[count++] = below;
+            }
+        }
+        return count;
+    }
+    // down the plane's normal, across the caps
+    vec3 across = normal - normal.dot(axis)*axis;
+    vec3 u = across.squaredNorm() > 1e-12 ? across.normalized() : rotation.col(0), v = axis.cross(u);
+    for (int end = -1; end <= 1; end += 2)
+        for (int k = 0; k < 4 && count < maxHalfSpaceContacts; k++) {
+            vec3 p = end*h*axis + r*(k == 0 ? -u : k == 1 ? v : k == 2 ? -v : u);
+            scalar below = -(height + normal.dot(p));
+            if (below >= 0) {
+                arms[count] = p;
+                depths[count++] = below;
+            }
+        }
+    return count;
+}
+
+// one sample at a time, for reference and for benchmarking against
+int halfSpaceContactsScalar(const Shape &shape, const mat3 &rotation, vec3 normal, scalar height,
+                            vec3 *arms, scalar *depths) {
+    std::vector<int> hits;
+    std::vector<float> depth;
+    const std::vector<vec3> &points = shape.samples->points;
+    for (int i = 0; i < points.size(); i++) {
+        scalar below = -(height + normal.dot(rotation * points[i]));
+        if (below >= 0) {
+            hits.push_back(i);
+            depth.push_back(below);
+        }
+    }
+    return reduceHalfSpaceContacts(shape, rotation, hits, depth, arms, depths);
+}
+
+#endif
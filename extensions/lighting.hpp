@@ -33,8 +33,8 @@ void Lighting::createDefault() {
 void Lighting::apply() {
     for (int i = 0; i < lights.size(); i++) {
         Light l = lights[i];
-        GLfloat pos[4] = {l.dir[0], l.dir[1], l.dir[2], 0};
-        GLfloat color[4] = {l.color[0], l.color[1], l.color[2], 0};
+        GLfloat pos[4] = {(GLfloat)l.dir[0], (GLfloat)l.dir[1], (GLfloat)l.dir[2], 0};
+        GLfloat color[4] = {(GLfloat)l.color[0], (GLfloat)l.color[1], (GLfloat)l.color[2], 0};
         glLightfv(GL_LIGHT0+i, GL_POSITION, pos);
         glLightfv(GL_LIGHT0+i, GL_DIFFUSE, color);
         glLightfv(GL_LIGHT0+i, GL_SPECULAR, color);
@@ -0,0 +1,190 @@
+#ifndef LOG_HPP
+#define LOG_HPP
+
+#include <atomic>
+#include <chrono>
+#include <cstdarg>
+#include <cstdio>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Leveled logging for code on the simulation hot path.
+//
+//     LOG_DEBUG("contact %d-%d depth %g", i, j, d);
+//
+// Levels below RB_LOG_LEVEL are removed by the preprocessor, arguments and
+// all, so disabled logging costs nothing. Enabled messages are formatted into
+// a lock-free ring owned by the calling thread and written out by a
+// background thread, so the caller never waits on the output stream. Each
+// call site is rate limited to `LOG_RATE_LIMIT` messages per second; the
+// number of suppressed messages is reported with the next one let through.
+
+#define LOG_LEVEL_TRACE 0
+#define LOG_LEVEL_DEBUG 1
+#define LOG_LEVEL_INFO  2
+#define LOG_LEVEL_WARN  3
+#define LOG_LEVEL_ERROR 4
+#define LOG_LEVEL_OFF   5
+
+#ifndef RB_LOG_LEVEL
+#define RB_LOG_LEVEL LOG_LEVEL_INFO
+#endif
+
+#ifndef LOG_RATE_LIMIT
+#define LOG_RATE_LIMIT 10
+#endif
+
+class Logger {
+public:
+    static const int messageSize = 240, ringSize = 256;
+    FILE *out;
+    Logger();
+    ~Logger();
+    void write(int level, const char *file, int line, int suppressed, const char *fmt, ...);
+    void flush();
+protected:
+    struct Message {
+        char text[messageSize];
+    };
+    struct Ring {
+        Message messages[ringSize];
+        std::atomic<unsigned> head, tail; // written by producer, consumer
+        std::atomic<unsigned> dropped;
+    };
+    std::mutex mutex; // guards rings and serializes flushing, never the producers
+    std::vector<Ring*> rings;
+    std::thread flusher;
+    std::atomic<bool> running;
+    Ring *ring();
+    void run();
+};
+
+Logger logger;
+
+// Allows `LOG_RATE_LIMIT` messages per one-second window at one call site.
+class LogRateLimit {
+public:
+    LogRateLimit(): window(0), count(0), suppressed(0) {}
+    // returns -1 to drop the message, otherwise how many were dropped before it
+    int allow() {
+        long long now = std::chrono::duration_cast<std::chrono::seconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+        if (window.exchange(now) != now)
+            count = 0;
+        if (count++ < LOG_RATE_LIMIT)
+            return suppressed.exchange(0);
+        suppressed++;
+        return -1;
+    }
+protected:
+    std::atomic<long long> window;
+    std::atomic<int> count, suppressed;
+};
+
+#define LOG_AT(level, ...) do { \
+        static LogRateLimit logLimit; \
+        int logSuppressed = logLimit.allow(); \
+        if (logSuppressed >= 0) \
+            logger.write(level, __FILE__, __LINE__, logSuppressed, __VA_ARGS__); \
+    } while (0)
+#define LOG_DISABLED(...) do {} while (0)
+
+#if RB_LOG_LEVEL <= LOG_LEVEL_TRACE
+#define LOG_TRACE(...) LOG_AT(LOG_LEVEL_TRACE, __VA_ARGS__)
+#else
+#define LOG_TRACE(...) LOG_DISABLED(__VA_ARGS__)
+#endif
+#if RB_LOG_LEVEL <= LOG_LEVEL_DEBUG
+#define LOG_DEBUG(...) LOG_AT(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#else
+#define LOG_DEBUG(...) LOG_DISABLED(__VA_ARGS__)
+#endif
+#if RB_LOG_LEVEL <= LOG_LEVEL_INFO
+#define LOG_INFO(...) LOG_AT(LOG_LEVEL_INFO, __VA_ARGS__)
+#else
+#define LOG_INFO(...) LOG_DISABLED(__VA_ARGS__)
+#endif
+#if RB_LOG_LEVEL <= LOG_LEVEL_WARN
+#define LOG_WARN(...) LOG_AT(LOG_LEVEL_WARN, __VA_ARGS__)
+#else
+#define LOG_WARN(...) LOG_DISABLED(__VA_ARGS__)
+#endif
+#if RB_LOG_LEVEL <= LOG_LEVEL_ERROR
+#define LOG_ERROR(...) LOG_AT(LOG_LEVEL_ERROR, __VA_ARGS__)
+#else
+#define LOG_ERROR(...) LOG_DISABLED(__VA_ARGS__)
+#endif
+
+Logger::Logger():
+    out(stderr), running(false) {
+}
+
+Logger::~Logger() {
+    if (running.exchange(false))
+        flusher.join();
+    flush();
+}
+
+Logger::Ring *Logger::ring() {
+    static thread_local Ring *r = NULL;
+    if (!r) {
+        r = new Ring();
+        r->head = r->tail = 0;
+        r->dropped = 0;
+        std::lock_guard<std::mutex> lock(mutex);
+        rings.push_back(r);
+        if (!running.exchange(true))
+            flusher = std::thread(&Logger::run, this);
+    }
+    return r;
+}
+
+void Logger::write(int level, const char *file, int line, int suppressed, const char *fmt, ...) {
+    static const char *names[] = {"TRACE", "DEBUG", "INFO", "WARN", "ERROR"};
+    Ring *r = ring();
+    unsigned head = r->head.load(std::memory_order_relaxed);
+    if (head - r->tail.load(std::memory_order_acquire) >= (unsigned)ringSize) {
+        r->dropped++;
+        return;
+    }
+    char *text = r->messages[head % ringSize].text;
+    int n = snprintf(text, messageSize, "[%s] %s:%d: ", names[level], file, line);
+    if (n < 0 || n >= messageSize)
+        n = 0;
+    va_list args;
+    va_start(args, fmt);
+    int m = vsnprintf(text + n, messageSize - n, fmt, args);
+    va_end(args);
+    n = (m < 0 || n + m >= messageSize) ? messageSize - 1 : n + m;
+    if (suppressed > 0)
+        snprintf(text + n, messageSize - n, " (%d similar suppressed)", suppressed);
+    r->head.store(head+1, std::memory_order_release);
+}
+
+// Drains every thread's ring to `out`. Runs on the background thread, and
+// once more at exit.
+void Logger::flush() {
+    std::lock_guard<std::mutex> lock(mutex);
+    for (size_t i = 0; i < rings.size(); i++) {
+        Ring *r = rings[i];
+        unsigned tail = r->tail.load(std::memory_order_relaxed);
+        unsigned head = r->head.load(std::memory_order_acquire);
+        for (; tail != head; tail++)
+            fprintf(out, "%s\n", r->messages[tail % ringSize].text);
+        r->tail.store(tail, std::memory_order_release);
+        unsigned dropped = r->dropped.exchange(0);
+        if (dropped)
+            fprintf(out, "[WARN] log buffer full, dropped %u messages\n", dropped);
+    }
+    fflush(out);
+}
+
+void Logger::run() {
+    while (running) {
+        flush();
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+}
+
+#endif
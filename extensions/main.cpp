@@ -2,6 +2,7 @@
 #include "draw.hpp"
 #include "gui.hpp"
 #include "lighting.hpp"
+#include "profiler.hpp"
 #include "shape.hpp"
 #include "text.hpp"
 #include "rb.hpp"
@@ -16,12 +17,16 @@ Camera camera;
 Lighting lighting;
 Text text;
 World world;
+StatsExporter exporter;
+StateExporter stateExporter;
+StreamServer streamer;
 
 float dt = 1/60.;
 float t = 0;
 bool paused = false;
 bool surface = true;
 bool arrow = false;
+bool hud = false;
 
 void drawWorld() {
     camera.apply(window);
@@ -34,18 +39,30 @@ void drawWorld() {
     }
     world.draw(surface, arrow);
     
-    setColor(vec3(0,0,0));
+    text.begin();
     if(paused)
-        text.draw("PAUSED", 0.8, 0.80);    
-    text.draw("WASD and LShift/LCtrl to move camera", -0.9, 0.90);
-    text.draw("Mouse to rotate view", -0.9, 0.85);
-    text.draw("P to play/pause animation", -0.9, 0.80);
-    text.draw("V to toggle surface view", -0.9, 0.75);
+        text.addStatic("PAUSED", 0.8, 0.80);    
+    text.addStatic("WASD and LShift/LCtrl to move camera", -0.9, 0.90);
+    text.addStatic("Mouse to rotate view", -0.9, 0.85);
+    text.addStatic("P to play/pause animation", -0.9, 0.80);
+    text.addStatic("V to toggle surface view", -0.9, 0.75);
+    text.addStatic("H to toggle profiler, T to save trace.json", -0.9, 0.70);
+    text.addStatic(string("I to change integrator: ") + integratorNames[world.integrator], -0.9, 0.65);
     if(arrow)
     {
-        text.draw("Green arrow - angular momentum", -0.9, 0.70);
-        text.draw("Red arrow - angular velocity", -0.9, 0.65);    
+        text.addStatic("Green arrow - angular momentum", -0.9, 0.60);
+        text.addStatic("Red arrow - angular velocity", -0.9, 0.55);    
     }
+    if(hud)
+    {
+        const WorldStats &s = world.stats();
+        char line[128];
+        snprintf(line, sizeof(line), "bodies %d  awake %d  pairs %d  filtered %d  hits %d  contacts %d",
+                 s.bodies, s.awakeBodies, s.broadphasePairs, s.filteredPairs, s.narrowphaseHits, s.contacts);
+        text.add(line, 0.35, 0.95);
+        profiler.drawOverlay(text, 0.35, 0.90);
+    }
+    text.end();
 }
 
 void update(float dt) {
@@ -59,11 +76,38 @@ void keyPressed(int key) {
         paused = !paused;
     if (key == GLFW_KEY_V)
         surface = !surface;
+    if (key == GLFW_KEY_H)
+        hud = !hud;
+    if (key == GLFW_KEY_I)
+        world.integrator = (world.integrator + 1) % NUM_INTEGRATORS;
+    if (key == GLFW_KEY_T && profiler.writeChromeTrace("trace.json"))
+        cout << "wrote trace.json" << endl;
     if (key == GLFW_KEY_ESCAPE)
         exit(0);
 }
 
 int main(int argc, char **argv) {
+    // --stats-file path / --stats-socket path export world.stats() every second
+    // --state-shm name publishes body states every step, see state_reader.hpp
+    // --stream unix:/path|tcp:host:port serves poses to viewers, see viewer.cpp
+    string stateName;
+    for (int i = 1; i+1 < argc; i += 2) {
+        string opt = argv[i];
+        if (opt == "--state-shm")
+            stateName = argv[i+1];
+        if (opt == "--stream") {
+            if (streamer.listen(argv[i+1]))
+                world.streamer = &streamer;
+            else
+                cerr << "cannot stream to " << argv[i+1] << endl;
+        }
+        if (opt != "--stats-file" && opt != "--stats-socket")
+            continue;
+        if (opt == "--stats-file" ? exporter.openFile(argv[i+1]) : exporter.openSocket(argv[i+1]))
+            world.exporter = &exporter;
+        else
+            cerr << "cannot export stats to " << argv[i+1] << endl;
+    }
     window.create("Animation", 1024, 768);
     window.onKeyPress(keyPressed);
     camera.lookAt(vec3(15,3,15), vec3(0,2.5,0));
@@ -78,7 +122,7 @@ int main(int argc, char **argv) {
     // rb.color = vec3(0,1,1);
     // rb.init(0,1.0,0.2,0.3,0.25);
     // rb.applyImpulse(vec3(100,0,0),vec3(0,0.5,0));
-    // world.rbs.push_back(new RigidBody(rb));
+    // world.add(rb);
 
     // for (int i = 0; i < 4; ++i)
     // {
@@ -89,7 +133,7 @@ int main(int argc, char **argv) {
     //         rb1.color = vec3(0,1,0);
     //         rb1.init(0,1.0,0.2,0.3,0.25);
     //         // rb1.applyImpulse(vec3(-10,0,0),vec3(0,0.25,0));
-    //         world.rbs.push_back(new RigidBody(rb1));
+    //         world.add(rb1);
     //     }
     // }
 
@@ -98,17 +142,20 @@ int main(int argc, char **argv) {
     rb.color = vec3(0,1,1);
     rb.init(0,1.0,0.2,0.3,0.25);
     rb.applyImpulse(vec3(100,0,0),vec3(0,0.5,0));
-    world.rbs.push_back(new RigidBody(rb));
+    world.add(rb);
 
+    Shape box = Shape::makeBox(vec3(0.2,0.4,0.2));
+    BodyDesc boxes[2];
     for (int j = 0; j < 2; ++j)
     {
-        RigidBody rb1;
-        rb1.setTransform(vec3(0.5,0.25,-0.25+j*0.5),quat(1,0,0,0));
-        rb1.color = vec3(0,1,0);
-        rb1.init(1,1,0.02,0.3,0.25,vec3(0.2,0.4,0.2));
-        // rb1.applyImpulse(vec3(-10,0,0),vec3(0,0.25,0));
-        world.rbs.push_back(new RigidBody(rb1));
+        boxes[j].shape = box;
+        boxes[j].mass = 1;
+        boxes[j].eta = 0.02;
+        boxes[j].nu = 0.3;
+        boxes[j].color = vec3(0,1,0);
+        boxes[j].position = pvec3(0.5,0.25,-0.25+j*0.5);
     }
+    world.spawn(boxes, 2);
 
 
     // RigidBody rb1;
@@ -116,15 +163,26 @@ int main(int argc, char **argv) {
     // rb1.color = vec3(0,0,1);
     // rb1.init(1,1,0.02,0.3,0.25,vec3(0.2,0.2,0.2));
     // rb1.applyImpulse(vec3(0,1,0),vec3(2,0.25,0));
-    // world.rbs.push_back(new RigidBody(rb1));
+    // world.add(rb1);
+
+    if (!stateName.empty()) {
+        if (stateExporter.open(stateName, world.rbs.size()))
+            world.stateExporter = &stateExporter;
+        else
+            cerr << "cannot export state to " << stateName << endl;
+    }
 
     while (!window.shouldClose()) {
         camera.processInput(window);
         if (!paused)
             update(dt);
-        window.prepareDisplay();
-        drawWorld();
-        window.updateDisplay();
+        {
+            PROFILE_SCOPE("render");
+            window.prepareDisplay();
+            drawWorld();
+            window.updateDisplay();
+        }
+        profiler.frame();
         window.waitForNextFrame(dt);
     }
 }
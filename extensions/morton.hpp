@@ -0,0 +1,30 @@
+#ifndef MORTON_HPP
+#define MORTON_HPP
+
+#include "common.hpp"
+
+// Z-order (Morton) codes: the bits of three 10-bit grid coordinates
+// interleaved into one 30-bit key, so that sorting by key keeps points that
+// are close in space mostly close in the order.
+
+// spreads the low 10 bits of v out to every third bit
+inline unsigned int expandBits(unsigned int v) {
+    v &= 0x3ff;
+    v = (v | (v << 16)) & 0x030000ff;
+    v = (v | (v << 8)) & 0x0300f00f;
+    v = (v | (v << 4)) & 0x030c30c3;
+    v = (v | (v << 2)) & 0x09249249;
+    return v;
+}
+
+// key of p within the box [lo, lo + 1/invExtent]
+inline unsigned int mortonCode(const pvec3 &p, const pvec3 &lo, const pvec3 &invExtent) {
+    unsigned int c[3];
+    for (int k = 0; k < 3; ++k) {
+        pscalar t = (p[k] - lo[k]) * invExtent[k] * 1024;
+        c[k] = t <= 0 ? 0 : t >= 1023 ? 1023 : (unsigned int)t;
+    }
+    return (expandBits(c[0]) << 2) | (expandBits(c[1]) << 1) | expandBits(c[2]);
+}
+
+#endif
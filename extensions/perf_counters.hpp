@@ -0,0 +1,114 @@
+#ifndef PERF_COUNTERS_HPP
+#define PERF_COUNTERS_HPP
+
+#include <cstring>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+// Hardware performance counters for the calling thread, read through
+// perf_event_open. Counters the kernel or the CPU refuses (containers, VMs,
+// perf_event_paranoid) are simply reported as unavailable, and on other
+// platforms open() always fails, so callers can treat this as optional.
+
+class PerfCounters {
+public:
+    enum Counter {CYCLES, INSTRUCTIONS, L1D_MISSES, LLC_MISSES, BRANCH_MISSES,
+                  NUM_COUNTERS};
+    struct Sample {
+        unsigned long long value[NUM_COUNTERS];
+    };
+    int fds[NUM_COUNTERS];
+    PerfCounters();
+    ~PerfCounters();
+    bool open();
+    void close();
+    bool available(int c);
+    Sample read();
+    static const char *name(int c);
+};
+
+PerfCounters::PerfCounters() {
+    for (int c = 0; c < NUM_COUNTERS; c++)
+        fds[c] = -1;
+}
+
+PerfCounters::~PerfCounters() {
+    close();
+}
+
+const char *PerfCounters::name(int c) {
+    static const char *names[NUM_COUNTERS] = {
+        "cycles", "instructions", "l1d_misses", "llc_misses", "branch_misses"
+    };
+    return names[c];
+}
+
+bool PerfCounters::open() {
+    close();
+#ifdef __linux__
+    const unsigned int types[NUM_COUNTERS] = {
+        PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE,
+        PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE
+    };
+    const unsigned long long configs[NUM_COUNTERS] = {
+        PERF_COUNT_HW_CPU_CYCLES,
+        PERF_COUNT_HW_INSTRUCTIONS,
+        PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+            | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+        PERF_COUNT_HW_CACHE_MISSES,
+        PERF_COUNT_HW_BRANCH_MISSES
+    };
+    bool any = false;
+    for (int c = 0; c < NUM_COUNTERS; c++) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = types[c];
+        attr.config = configs[c];
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        fds[c] = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+        if (fds[c] >= 0) {
+            ioctl(fds[c], PERF_EVENT_IOC_RESET, 0);
+            ioctl(fds[c], PERF_EVENT_IOC_ENABLE, 0);
+            any = true;
+        }
+    }
+    return any;
+#else
+    return false;
+#endif
+}
+
+void PerfCounters::close() {
+#ifdef __linux__
+    for (int c = 0; c < NUM_COUNTERS; c++) {
+        if (fds[c] >= 0)
+            ::close(fds[c]);
+        fds[c] = -1;
+    }
+#endif
+}
+
+inline bool PerfCounters::available(int c) {
+    return fds[c] >= 0;
+}
+
+inline PerfCounters::Sample PerfCounters::read() {
+    Sample s;
+    for (int c = 0; c < NUM_COUNTERS; c++) {
+        s.value[c] = 0;
+#ifdef __linux__
+        if (fds[c] >= 0 && ::read(fds[c], &s.value[c], sizeof(s.value[c])) != sizeof(s.value[c]))
+            s.value[c] = 0;
+#endif
+    }
+    return s;
+}
+
+#endif
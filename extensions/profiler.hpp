@@ -0,0 +1,233 @@
+#ifndef PROFILER_HPP
+#define PROFILER_HPP
+
+#include "perf_counters.hpp"
+#include "text.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Lightweight scoped timers. Every thread records into its own ring buffer,
+// so timing a scope costs two clock reads and a store. Once per frame the
+// rings are drained into a rolling per-phase breakdown that can be drawn on
+// the HUD, and the raw events can be written as Chrome trace-event JSON
+// (load it in chrome://tracing or Perfetto).
+//
+//     void World::update(float dt) {
+//         PROFILE_SCOPE("integrate");
+//         ...
+//     }
+//
+// If hardware counters are attached with attachCounters(), scopes on the
+// attaching thread also accumulate counter deltas per phase name.
+
+class Profiler {
+public:
+    struct Event {
+        const char *name;
+        long long start, duration; // nanoseconds since the profiler started
+        int depth;
+    };
+    struct Ring {
+        int tid;
+        std::vector<Event> events;
+        std::atomic<size_t> head; // total events ever written
+        size_t drained;           // events already folded into the phases
+        int depth;
+    };
+    struct Phase {
+        std::string name;
+        int depth;
+        float lastMs, avgMs;
+    };
+    struct CounterTotals {
+        long long calls, nanoseconds;
+        unsigned long long value[PerfCounters::NUM_COUNTERS];
+    };
+    bool enabled;
+    size_t capacity;
+    float smoothing;
+    std::vector<Phase> phases;
+    PerfCounters *counters;
+    int counterTid;
+    std::map<std::string, CounterTotals> counterTotals;
+    Profiler();
+    void attachCounters(PerfCounters *counters);
+    long long now();
+    Ring *ring();
+    void record(const char *name, long long start, long long end, int depth);
+    void frame();
+    void drawOverlay(Text &text, float x, float y);
+    bool writeChromeTrace(std::string filename);
+protected:
+    std::chrono::steady_clock::time_point origin;
+    std::mutex mutex;
+    std::vector<Ring*> rings;
+    std::map<std::string, int> phaseIndex;
+};
+
+Profiler profiler;
+
+class ProfileScope {
+public:
+    ProfileScope(const char *name): name(name) {
+        if (!profiler.enabled) {
+            this->name = NULL;
+            return;
+        }
+        ring = profiler.ring();
+        depth = ring->depth++;
+        counted = profiler.counters && ring->tid == profiler.counterTid;
+        if (counted)
+            startCounters = profiler.counters->read();
+        start = profiler.now();
+    }
+    ~ProfileScope() {
+        if (!name)
+            return;
+        long long end = profiler.now();
+        profiler.record(name, start, end, depth);
+        if (counted) {
+            PerfCounters::Sample s = profiler.counters->read();
+            Profiler::CounterTotals &t = profiler.counterTotals[name];
+            t.calls++;
+            t.nanoseconds += end - start;
+            for (int c = 0; c < PerfCounters::NUM_COUNTERS; c++)
+                t.value[c] += s.value[c] - startCounters.value[c];
+        }
+        ring->depth--;
+    }
+protected:
+    const char *name;
+    Profiler::Ring *ring;
+    long long start;
+    int depth;
+    bool counted;
+    PerfCounters::Sample startCounters;
+};
+
+#define PROFILE_CONCAT2(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT2(a, b)
+#define PROFILE_SCOPE(name) ProfileScope PROFILE_CONCAT(profileScope, __LINE__)(name)
+
+Profiler::Profiler():
+    enabled(true), capacity(1<<14), smoothing(0.05),
+    counters(NULL), counterTid(-1),
+    origin(std::chrono::steady_clock::now()) {
+}
+
+// Counters are per thread, so only scopes on the calling thread use them.
+// Attaching resets counterTotals; pass NULL to detach and keep them.
+void Profiler::attachCounters(PerfCounters *counters) {
+    this->counters = counters;
+    counterTid = counters ? ring()->tid : -1;
+    if (counters)
+        counterTotals.clear();
+}
+
+inline long long Profiler::now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - origin).count();
+}
+
+inline Profiler::Ring *Profiler::ring() {
+    static thread_local Ring *r = NULL;
+    if (!r) {
+        r = new Ring();
+        r->events.resize(capacity);
+        r->head = 0;
+        r->drained = 0;
+        r->depth = 0;
+        std::lock_guard<std::mutex> lock(mutex);
+        r->tid = rings.size();
+        rings.push_back(r);
+    }
+    return r;
+}
+
+inline void Profiler::record(const char *name, long long start, long long end, int depth) {
+    Ring *r = ring();
+    size_t h = r->head.load(std::memory_order_relaxed);
+    Event &e = r->events[h % capacity];
+    e.name = name;
+    e.start = start;
+    e.duration = end - start;
+    e.depth = depth;
+    r->head.store(h+1, std::memory_order_release);
+}
+
+// Folds the events recorded since the last call into the rolling breakdown.
+// Call once per frame from the main thread.
+void Profiler::frame() {
+    std::vector<float> total(phases.size(), 0);
+    std::lock_guard<std::mutex> lock(mutex);
+    for (size_t i = 0; i < rings.size(); i++) {
+        Ring *r = rings[i];
+        size_t head = r->head.load(std::memory_order_acquire);
+        size_t first = r->drained;
+        if (head - first > capacity)
+            first = head - capacity;
+        for (size_t k = first; k < head; k++) {
+            const Event &e = r->events[k % capacity];
+            std::map<std::string, int>::iterator it = phaseIndex.find(e.name);
+            int p;
+            if (it == phaseIndex.end()) {
+                Phase phase = {e.name, e.depth, 0, 0};
+                p = phases.size();
+                phaseIndex[e.name] = p;
+                phases.push_back(phase);
+                total.push_back(0);
+            } else {
+                p = it->second;
+            }
+            total[p] += e.duration*1e-6;
+        }
+        r->drained = head;
+    }
+    for (size_t p = 0; p < phases.size(); p++) {
+        phases[p].lastMs = total[p];
+        phases[p].avgMs += smoothing*(total[p] - phases[p].avgMs);
+    }
+}
+
+void Profiler::drawOverlay(Text &text, float x, float y) {
+    char line[128];
+    for (size_t p = 0; p < phases.size(); p++, y -= 0.05) {
+        snprintf(line, sizeof(line), "%*s%-12s %7.3f ms", 2*phases[p].depth, "",
+                 phases[p].name.c_str(), phases[p].avgMs);
+        text.add(line, x, y);
+    }
+}
+
+// Writes every event still held in the ring buffers as complete ("X")
+// trace events. Call it while no other thread is recording.
+bool Profiler::writeChromeTrace(std::string filename) {
+    FILE *f = fopen(filename.c_str(), "w");
+    if (!f)
+        return false;
+    fprintf(f, "{\"traceEvents\":[\n");
+    bool first = true;
+    std::lock_guard<std::mutex> lock(mutex);
+    for (size_t i = 0; i < rings.size(); i++) {
+        Ring *r = rings[i];
+        size_t head = r->head.load(std::memory_order_acquire);
+        size_t k = (head > capacity) ? head - capacity : 0;
+        for (; k < head; k++) {
+            const Event &e = r->events[k % capacity];
+            fprintf(f, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,"
+                    "\"ts\":%.3f,\"dur\":%.3f}", first ? "" : ",\n", e.name,
+                    r->tid, e.start*1e-3, e.duration*1e-3);
+            first = false;
+        }
+    }
+    fprintf(f, "\n],\"displayTimeUnit\":\"ms\"}\n");
+    fclose(f);
+    return true;
+}
+
+#endif
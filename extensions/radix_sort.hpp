@@ -0,0 +1,62 @@
+#ifndef RADIX_SORT_HPP
+#define RADIX_SORT_HPP
+
+#include "thread_pool.hpp"
+
+#include <algorithm>
+#include <vector>
+
+// Parallel LSD radix sort of (key, value) pairs, eight bits per pass and
+// only as many passes as `bits` needs. Each pass, every thread counts the
+// digits in its range of the input, the counts are turned into one
+// output offset per (digit, thread), and the threads scatter their ranges
+// in order. Each pass is stable, so ties keep their input order and the
+// result does not depend on the number of threads.
+
+const int radixBits = 8, radixDigits = 1 << radixBits;
+
+class RadixSorter {
+public:
+    void sort(std::vector<unsigned int> &keys, std::vector<int> &values, int bits, ThreadPool &pool);
+protected:
+    std::vector<unsigned int> keyBuffer;
+    std::vector<int> valueBuffer;
+    std::vector<int> counts; // [thread][digit]
+};
+
+void RadixSorter::sort(std::vector<unsigned int> &keys, std::vector<int> &values, int bits, ThreadPool &pool) {
+    int n = keys.size(), threads = pool.size();
+    keyBuffer.resize(n);
+    valueBuffer.resize(n);
+    counts.resize(threads*radixDigits);
+    for (int shift = 0; shift < bits; shift += radixBits) {
+        // threads with nothing to do are skipped, so their counts stay zero
+        std::fill(counts.begin(), counts.end(), 0);
+        pool.parallelFor(n, [&](int begin, int end, int t) {
+            int *c = &counts[t*radixDigits];
+            for (int i = begin; i < end; i++)
+                c[(keys[i] >> shift) & (radixDigits-1)]++;
+        });
+        // digit-major, then thread, gives each thread where its share of
+        // each digit starts
+        int offset = 0;
+        for (int d = 0; d < radixDigits; d++)
+            for (int t = 0; t < threads; t++) {
+                int c = counts[t*radixDigits + d];
+                counts[t*radixDigits + d] = offset;
+                offset += c;
+            }
+        pool.parallelFor(n, [&](int begin, int end, int t) {
+            int *c = &counts[t*radixDigits];
+            for (int i = begin; i < end; i++) {
+                int k = c[(keys[i] >> shift) & (radixDigits-1)]++;
+                keyBuffer[k] = keys[i];
+                valueBuffer[k] = values[i];
+            }
+        });
+        keys.swap(keyBuffer);
+        values.swap(valueBuffer);
+    }
+}
+
+#endif
@@ -3,63 +3,201 @@
 
 #include "common.hpp"
 #include "draw.hpp"
+#include "halfspace.hpp"
 #include "shape.hpp"
 
-float GRAVITY = 0.2;
+scalar GRAVITY = 0.2;
+
+// integration schemes for RigidBody::update:
+// EULER                - the original scheme, explicit and without the gyroscopic term
+// SYMPLECTIC_EULER     - velocities first, with the explicit gyroscopic term
+// IMPLICIT_GYROSCOPIC  - implicit solve for the gyroscopic term; stable for
+//                        spinning bodies at large dt
+// RK4                  - fourth order, four times the work; for reference runs
+enum Integrator {EULER, SYMPLECTIC_EULER, IMPLICIT_GYROSCOPIC, RK4, NUM_INTEGRATORS};
+const char *integratorNames[NUM_INTEGRATORS] = {"euler", "symplectic", "implicit-gyro", "rk4"};
+
+// how a body moves:
+// DYNAMIC    - by forces and contacts (the default)
+// STATIC     - never; level geometry. Moving one takes World::staticsChanged()
+// KINEMATIC  - by the velocities the user sets, whatever it hits
+// Contacts treat static and kinematic bodies as having infinite mass.
+enum BodyType {DYNAMIC, STATIC, KINEMATIC, NUM_BODY_TYPES};
 
 class RigidBody {
 public:
     Shape shape;
-    float mass;
+    scalar mass;
     vec3 color;
-    vec3 position;
+    pvec3 position;
     quat rotation;
     mat3 inertia_matrix;    
-    mat3 inverse_inertia_matrix;
+    vec3 inverse_inertia_body; // diagonal of the body-space inverse inertia
     vec3 linear_velocity;
     vec3 angular_velocity;
 
     vec3 forces;
     vec3 torques;
 
-    float eta;
-    float nu;
+    scalar eta;
+    scalar nu;
+
+    // collision filtering, see collision_filter.hpp
+    unsigned group, mask;
+    int type; // a BodyType
+
+    // world-space quantities derived from rotation, refreshed once per step
+    // by calcIMatrix() and shared by integration, collision and drawing
+    mat3 rotation_matrix;
+    mat3 inverse_inertia_matrix;
+
+    // double quaternions need 32-byte alignment once AVX is enabled
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
 
-    void update(float dt)
+    RigidBody():
+        mass(1), color(1,1,1), position(0,0,0), rotation(1,0,0,0),
+        linear_velocity(0,0,0), angular_velocity(0,0,0),
+        forces(0,0,0), torques(0,0,0), eta(0), nu(0), group(1), mask(~0u), type(DYNAMIC)
     {
+        inertia_matrix.setIdentity();
+        inverse_inertia_body.setOnes();
         calcIMatrix();
-        linear_velocity += calcForces()/mass*dt;
-        position = position + linear_velocity*dt;
-        // std::cout<<linear_velocity<<"\nlin\n";        
-        // std::cout<<angular_velocity<<"\nang\n";        
-        angular_velocity += inverse_inertia_matrix * calcTorque() * dt;
+    }
+
+    void update(scalar dt, int integrator=EULER)
+    {
+        vec3 force = calcForces(), torque = calcTorque();
+        if (integrator == RK4)
+            integrateRK4(force, torque, dt);
+        else
+        {
+            linear_velocity += force/mass*dt;
+            position += (linear_velocity*dt).cast<pscalar>();
+            // std::cout<<linear_velocity<<"\nlin\n";        
+            // std::cout<<angular_velocity<<"\nang\n";        
+            if (integrator == SYMPLECTIC_EULER)
+                angular_velocity += inverse_inertia_matrix * (torque - angular_velocity.cross(inertia_world() * angular_velocity)) * dt;
+            else
+            {
+                if (integrator == IMPLICIT_GYROSCOPIC)
+                    solveGyroscopic(dt);
+                angular_velocity += inverse_inertia_matrix * torque * dt;
+            }
+            quat temp = quat(0,angular_velocity[0],angular_velocity[1],angular_velocity[2]);
+            temp = temp * rotation;
+            rotation.coeffs() += 1.0/2 * temp.coeffs() * dt;
+        }
+        rotation = rotation.normalized();
+        forces = vec3(0,0,0);
+        torques = vec3(0,0,0);
+        calcIMatrix();
+    }
+
+    // Kinematic motion: the velocities are kept as set, with no forces
+    void move(scalar dt)
+    {
+        position += (linear_velocity*dt).cast<pscalar>();
         quat temp = quat(0,angular_velocity[0],angular_velocity[1],angular_velocity[2]);
         temp = temp * rotation;
         rotation.coeffs() += 1.0/2 * temp.coeffs() * dt;
         rotation = rotation.normalized();
         forces = vec3(0,0,0);
         torques = vec3(0,0,0);
+        calcIMatrix();
+    }
+
+    bool isDynamic() const
+    {
+        return type == DYNAMIC;
+    }
+
+    // zero for static and kinematic bodies, which contacts cannot move
+    scalar inverseMass() const
+    {
+        return type == DYNAMIC ? 1/mass : 0;
+    }
+
+    mat3 inertia_world()
+    {
+        return rotation_matrix * inertia_matrix * rotation_matrix.transpose();
+    }
+
+    // One Newton step on the implicit gyroscopic equation in body space,
+    // I (w' - w) + dt w' x I w' = 0, which keeps fast spinning bodies from
+    // gaining energy (Catto, "Numerical Methods", GDC 2015).
+    void solveGyroscopic(scalar dt)
+    {
+        vec3 w = rotation_matrix.transpose() * angular_velocity;
+        vec3 Iw = inertia_matrix * w;
+        vec3 f = dt * w.cross(Iw);
+        mat3 J = inertia_matrix + dt * (skew(w) * inertia_matrix - skew(Iw));
+        w -= J.inverse() * f;
+        angular_velocity = rotation_matrix * w;
+    }
+
+    // Classic RK4 on position, rotation and both velocities, with this
+    // step's force and torque held constant and the gyroscopic term included.
+    // Four derivative evaluations per step, meant for reference runs.
+    void integrateRK4(vec3 force, vec3 torque, scalar dt)
+    {
+        pvec3 x0 = position;
+        vec3 v0 = linear_velocity, w0 = angular_velocity;
+        quat q0 = rotation;
+        vec3 dx[4], dv[4], dw[4];
+        quat dq[4];
+        const scalar h[4] = {0, dt/2, dt/2, dt};
+        for (int k = 0; k < 4; k++)
+        {
+            vec3 v = v0, w = w0;
+            quat q = q0;
+            if (k > 0)
+            {
+                v = v0 + h[k]*dv[k-1];
+                w = w0 + h[k]*dw[k-1];
+                q.coeffs() = q0.coeffs() + h[k]*dq[k-1].coeffs();
+                q.normalize();
+            }
+            mat3 R = q.toRotationMatrix();
+            vec3 wb = R.transpose() * w;
+            vec3 tb = R.transpose() * torque;
+            dx[k] = v;
+            dv[k] = force/mass;
+            dw[k] = R * inverse_inertia_body.cwiseProduct(tb - wb.cross(inertia_matrix * wb));
+            dq[k] = quat(0,w[0],w[1],w[2]) * q;
+            dq[k].coeffs() *= 0.5;
+        }
+        position = x0 + (dt/6*(dx[0] + 2*dx[1] + 2*dx[2] + dx[3])).cast<pscalar>();
+        linear_velocity = v0 + dt/6*(dv[0] + 2*dv[1] + 2*dv[2] + dv[3]);
+        angular_velocity = w0 + dt/6*(dw[0] + 2*dw[1] + 2*dw[2] + dw[3]);
+        rotation.coeffs() = q0.coeffs() + dt/6*(dq[0].coeffs() + 2*dq[1].coeffs() + 2*dq[2].coeffs() + dq[3].coeffs());
+    }
+
+    static mat3 skew(vec3 v)
+    {
+        mat3 m;
+        m << 0, -v[2], v[1], v[2], 0, -v[0], -v[1], v[0], 0;
+        return m;
     }
 
     void draw(bool surface,bool arrow)
     {
         pushTransform();
-        translate(position);
-        rotate(rotation);
+        translate(position.cast<scalar>());
+        rotate(rotation_matrix);
         setColor(color);
         shape.draw(surface);
         if(arrow)
         {
             setColor(vec3(1,0,0));
-            drawArrow(position,angular_velocity.normalized(),0.001);
+            drawArrow(position.cast<scalar>(),angular_velocity.normalized(),0.001);
             //TODO
             setColor(vec3(0,1,0));
-            drawArrow(position,(inertia_matrix*angular_velocity).normalized(),0.01);
+            drawArrow(position.cast<scalar>(),(inertia_matrix*angular_velocity).normalized(),0.01);
         }
         popTransform();
     }
 
-    void init(int op,float m,float e,float n,float r=0,vec3 dim=vec3(0,0,0))
+    void init(int op,scalar m,scalar e,scalar n,scalar r=0,vec3 dim=vec3(0,0,0))
     {
         mass = m;
         eta = e;
@@ -69,24 +207,34 @@ public:
             shape = Shape::makeSphere(r);
             inertia_matrix = shape.moment()*mass;
         }
+        else if(op==CAPSULE || op==CYLINDER) // radius r, axis dim[1] to either side
+        {
+            shape = op==CAPSULE ? Shape::makeCapsule(r,dim[1]) : Shape::makeCylinder(r,dim[1]);
+            inertia_matrix = shape.moment()*mass;
+        }
         else // box
         {
             shape = Shape::makeBox(dim);
             inertia_matrix = shape.moment()*mass;
         }
-        inverse_inertia_matrix = inertia_matrix.inverse();
+        inverse_inertia_body = inertia_matrix.diagonal().cwiseInverse();
+        calcIMatrix();
     }
 
-    void setTransform(vec3 pos, quat rot)
+    template <typename Derived>
+    void setTransform(const Eigen::MatrixBase<Derived> &pos, quat rot)
     {
-        position = pos;
+        position = pos.template cast<pscalar>();
         rotation = rot;
+        calcIMatrix();
     }
 
+    // I^-1 = R diag(inverse_inertia_body) R^T, always from the body-space
+    // tensor so that it does not drift as the body turns
     void calcIMatrix()
     {
-        mat3 r = rotation.normalized().toRotationMatrix();
-        inverse_inertia_matrix = r * inverse_inertia_matrix * r.transpose();
+        rotation_matrix = rotation.toRotationMatrix();
+        inverse_inertia_matrix = rotation_matrix * inverse_inertia_body.asDiagonal() * rotation_matrix.transpose();
     }
 
     vec3 calcForces()
@@ -105,182 +253,80 @@ public:
     	torques = torques + r.cross(imp);
     }
     
-    void collisionBody(RigidBody* collider,float dt)
+    // returns the number of points touching the ground
+    int collisionGround(scalar dt)
     {
-        if(shape.type == 0)
-        {
-            if (collider->shape.type == 0)
-            {
-                if((position-collider->position).norm() <= shape.radius + collider->shape.radius)
-                {
-        			// std::cout<<"collide"<<"\n";        
-
-                    vec3 normal = (collider->position - position).normalized();
-                    vec3 collide = position + shape.radius * normal;
-                    vec3 ra = collide - collider->position;
-                    vec3 rb = collide - position;
-                    float e = (eta < collider->eta) ? eta : collider->eta;
-                    float n = (nu > collider->nu) ? nu : collider->nu;
-
-                    float relative = (collider->linear_velocity + collider->angular_velocity.cross(ra) - (linear_velocity + angular_velocity.cross(rb))).dot(normal);
-                    if(relative<0)
-                    {
-        			// std::cout<<"inside\n";        
-        			// std::cout<<"relative = "<<relative<<"\n";        
-
-                        float num = -1*(1+e)*relative/dt;
-                        float denom = 1/mass + 1/collider->mass;
-                        vec3 imp_N = num/denom * normal;
-                    	vec3 imp_fr = -1*n * imp_N.norm() * (collider->angular_velocity.cross(ra) - angular_velocity.cross(rb)).normalized(); 
-                		applyImpulse(-1*imp_N,rb);
-                		collider->applyImpulse(imp_N,ra);
-                    	applyImpulse(imp_fr,rb);
-                		collider->applyImpulse(-1*imp_fr,ra);
-                    }
-                }
-            }
-            else
-            {
-            	float d;
-            	vec3 normal;
-            	collider->shape.collisionTest(position - collider->position, d,normal);
-            	if(d < shape.radius)
-            	{
-        			std::cout<<"normal = "<<normal<<"\n";        
-                    normal = -1*normal;
-                    vec3 collide = position + shape.radius * normal;
-					vec3 ra = collide - collider->position;
-                    vec3 rb = collide - position;
-                    float e = (eta < collider->eta) ? eta : collider->eta;
-                    float n = (nu > collider->nu) ? nu : collider->nu;
-                    float relative = (collider->linear_velocity + collider->angular_velocity.cross(ra) - (linear_velocity + angular_velocity.cross(rb))).dot(normal);
-                    if(relative<0)
-                    {
-                    	float num = -1*(1+e)*relative/dt;
-                        float denom = 1/mass + 1/collider->mass + normal.dot((collider->inverse_inertia_matrix * ra.cross(normal)).cross(ra));
-                        vec3 imp_N = num/denom * normal;
-                    	// vec3 imp_fr = -1*n * imp_N.norm() * (collider->angular_velocity.cross(ra) - angular_velocity.cross(rb)).normalized(); 
-                    	applyImpulse(-1*imp_N,rb);
-                		collider->applyImpulse(imp_N,ra);
-                    	// applyImpulse(imp_fr,rb);
-                		// collider->applyImpulse(-1*imp_fr,ra);
-        			}
-                    
-            	}
-            }
-        }
-       else
-       {
-       		if (collider->shape.type == 0)
-            {
-				float d;
-            	vec3 normal;
-            	shape.collisionTest(collider->position - position, d,normal);
-            	if(d < collider->shape.radius)
-            	{
-        			std::cout<<"asd = "<<normal<<"\n";        
-                    vec3 collide = collider->position - collider->shape.radius * normal;
-					vec3 ra = collide - collider->position;
-                    vec3 rb = collide - position;
-                    float e = (eta < collider->eta) ? eta : collider->eta;
-                    float n = (nu > collider->nu) ? nu : collider->nu;
-                    float relative = (collider->linear_velocity + collider->angular_velocity.cross(ra) - (linear_velocity + angular_velocity.cross(rb))).dot(normal);
-                    if(relative<0)
-                    {
-                    	float num = -1*(1+e)*relative/dt;
-                        float denom = 1/mass + 1/collider->mass + normal.dot((inverse_inertia_matrix * rb.cross(normal)).cross(rb));
-                        vec3 imp_N = num/denom * normal;
-                    	// vec3 imp_fr = -1*n * imp_N.norm() * (collider->angular_velocity.cross(ra) - angular_velocity.cross(rb)).normalized(); 
-                    	applyImpulse(-1*imp_N,rb);
-                		collider->applyImpulse(imp_N,ra);
-                    	// applyImpulse(imp_fr,rb);
-                		// collider->applyImpulse(-1*imp_fr,ra);
-        			}
-                    
-            	}
-            }
-            else
-            {
-
-            }
-       }
+        return collisionHalfSpace(vec3(0,1,0),0,dt);
     }
 
-    void collisionGround(float dt)
+    // contact with the solid half space {x : normal.x <= offset}; returns the
+    // number of points touching it
+    int collisionHalfSpace(vec3 normal,pscalar offset,scalar dt)
     {
+        int count = 0;
+        scalar height = normal.cast<pscalar>().dot(position) - offset;
         if(shape.type == 0)
         {
-            if(position[1]<=shape.radius)
+            if(height<=shape.radius)
             {
-                vec3 collide = vec3(position[0],0,position[2]);
+                count = 1;
+                vec3 collide = -height*normal; // relative to the center
                 vec3 imp_N = vec3(0,0,0);
-                if(linear_velocity.dot(vec3(0,-1,0))>0)
+                if(linear_velocity.dot(-normal)>0)
                 {
-                	imp_N = (1+eta)*(linear_velocity+angular_velocity.cross(collide - position)).dot(vec3(0,-1,0))*vec3(0,1,0)/dt;
-                    vec3 imp_fr = -1*nu * imp_N.norm() * (linear_velocity + angular_velocity.cross(collide - position)).normalized(); 
-	                applyImpulse(imp_N,vec3(0,-1*shape.radius,0));
-	                applyImpulse(imp_fr,vec3(0,-1*shape.radius,0));
+                	imp_N = (1+eta)*(linear_velocity+angular_velocity.cross(collide)).dot(-normal)*normal/dt;
+                    vec3 imp_fr = -1*nu * imp_N.norm() * (linear_velocity + angular_velocity.cross(collide)).normalized(); 
+	                applyImpulse(imp_N,-shape.radius*normal);
+	                applyImpulse(imp_fr,-shape.radius*normal);
               	}
               	else
               	{
-                    vec3 imp_fr = -1*nu * mass * GRAVITY * (linear_velocity + angular_velocity.cross(collide - position)).normalized(); 
-	                applyImpulse(imp_fr,vec3(0,-1*shape.radius,0));
+                    vec3 imp_fr = -1*nu * mass * GRAVITY * (linear_velocity + angular_velocity.cross(collide)).normalized(); 
+	                applyImpulse(imp_fr,-shape.radius*normal);
               	}
             }
         }
         else
         {
-    		std::vector<vec3> points;
-        	points.clear();
-        	points.push_back(position + vec3(shape.halfSize[0],shape.halfSize[1],shape.halfSize[2]));
-        	points.push_back(position + vec3(shape.halfSize[0],shape.halfSize[1],-1*shape.halfSize[2]));
-        	points.push_back(position + vec3(shape.halfSize[0],-1*shape.halfSize[1],shape.halfSize[2]));
-        	points.push_back(position + vec3(shape.halfSize[0],-1*shape.halfSize[1],-1*shape.halfSize[2]));
-        	points.push_back(position + vec3(-1*shape.halfSize[0],shape.halfSize[1],shape.halfSize[2]));
-        	points.push_back(position + vec3(-1*shape.halfSize[0],shape.halfSize[1],-1*shape.halfSize[2]));
-        	points.push_back(position + vec3(-1*shape.halfSize[0],-1*shape.halfSize[1],shape.halfSize[2]));
-        	points.push_back(position + vec3(-1*shape.halfSize[0],-1*shape.halfSize[1],-1*shape.halfSize[2]));
-        	
-        	int count = 0;
+            // the deepest of the box's collision samples, or the closed-form
+            // contacts of a capsule or cylinder, relative to the center
+            vec3 points[maxHalfSpaceContacts];
+            scalar depths[maxHalfSpaceContacts];
+            int n = shape.type == CAPSULE || shape.type == CYLINDER
+                ? roundHalfSpaceContacts(shape,rotation_matrix,normal,height,points,depths)
+                : halfSpaceContacts(shape,rotation_matrix,normal,height,points,depths);
+
         	vec3 avg_f = vec3(0,0,0);
         	vec3 avg_t = vec3(0,0,0);
-        	for (int i = 0; i < points.size(); ++i)
+        	for (int i = 0; i < n; ++i)
         	{
-        		vec3 p = points[i];
-        		if(p[1]<=0)
-        		{
-        			// std::cout<<"normal = "<<p<<"\n";        
-		    		vec3 r = p - position;
-		            vec3 imp_N = vec3(0,0,0);
-		    		if ((linear_velocity+angular_velocity.cross(r)).dot(vec3(0,-1,0))>0)
-		    		{
-		    			count++;
-		    			imp_N = (1+eta)*(linear_velocity+angular_velocity.cross(r)).dot(vec3(0,-1,0))*vec3(0,1,0)/dt;
-		                vec3 imp_fr = -1*nu * imp_N.norm() * (linear_velocity + angular_velocity.cross(r)).normalized(); 
-		                // applyImpulse(imp_N,p-position);
-		                // applyImpulse(imp_fr,p-position);
-		                avg_f += imp_N;
-		                avg_f += imp_fr;
-		                avg_t += r.cross(imp_N);
-		                avg_t += r.cross(imp_fr);
-		    		}
-		    		else
-		    		{
-		    			count++; 
-		    			vec3 imp_fr = -1*nu * mass * GRAVITY * (linear_velocity + angular_velocity.cross(r)).normalized(); 
-                		// applyImpulse(imp_fr,p-position);
-		                avg_f += imp_fr;
-		                avg_t += r.cross(imp_fr);
-
-		    		}
-		    	}
+        		vec3 r = points[i];
+	            vec3 imp_N = vec3(0,0,0);
+	    		if ((linear_velocity+angular_velocity.cross(r)).dot(-normal)>0)
+	    		{
+	    			count++;
+	    			imp_N = (1+eta)*(linear_velocity+angular_velocity.cross(r)).dot(-normal)*normal/dt;
+	                vec3 imp_fr = -1*nu * imp_N.norm() * (linear_velocity + angular_velocity.cross(r)).normalized(); 
+	                avg_f += imp_N;
+	                avg_f += imp_fr;
+	                avg_t += r.cross(imp_N);
+	                avg_t += r.cross(imp_fr);
+	    		}
+	    		else
+	    		{
+	    			count++; 
+	    			vec3 imp_fr = -1*nu * mass * GRAVITY * (linear_velocity + angular_velocity.cross(r)).normalized(); 
+	                avg_f += imp_fr;
+	                avg_t += r.cross(imp_fr);
+	    		}
         	}
         	if(count>0)
         	{
 				forces += avg_f/count;
 				torques += avg_t/count;	
    	 	    }
-    }
+        }
+        return count;
     }
 
 
@@ -0,0 +1,242 @@
+#ifndef SDF_HPP
+#define SDF_HPP
+
+#include "common.hpp"
+#include "shape.hpp"
+#include "simd.hpp"
+
+#include <cassert>
+#include <vector>
+
+// Batched signed distance queries, the many-at-once form of
+// Shape::collisionTest: distance d (negative inside) and outward normal n,
+// with the same conventions for points on a face, edge or at the center.
+//
+//     shapeDistances(shape, n, x, y, z, d, nx, ny, nz);  // n points, one shape
+//     shapes.distances(p, d, nx, ny, nz);               // one point, n shapes
+//
+// The per-lane kernels have no branches on the point, so a whole floatv is
+// evaluated at once. Input and output arrays must be padded to
+// simdPadded(n) floats.
+
+// distance and normal of points (x,y,z) to a sphere of radius r at the origin
+inline void sdfSphere(floatv x, floatv y, floatv z, floatv r,
+                      floatv &d, floatv &nx, floatv &ny, floatv &nz) {
+    floatv len = vsqrt(x*x + y*y + z*z);
+    floatv inv = select(len > floatv(0.f), floatv(1.f)/len, floatv(0.f));
+    d = len - r;
+    nx = x*inv;
+    ny = y*inv;
+    nz = z*inv;
+}
+
+inline floatv vsign(floatv x) {
+    return select(x > floatv(0.f), floatv(1.f), select(x < floatv(0.f), floatv(-1.f), floatv(0.f)));
+}
+
+// distance and normal of points (x,y,z) to a box of half extents h centered
+// at the origin. Inside, the normal is that of the nearest face, ties going
+// to x, then y; outside it points from the nearest surface point.
+inline void sdfBox(floatv x, floatv y, floatv z, floatv hx, floatv hy, floatv hz,
+                   floatv &d, floatv &nx, floatv &ny, floatv &nz) {
+    floatv sx = vsign(x), sy = vsign(y), sz = vsign(z);
+    floatv qx = vabs(x) - hx, qy = vabs(y) - hy, qz = vabs(z) - hz;
+    floatv m = vmax(qx, vmax(qy, qz));
+    floatv ox = vmax(qx, floatv(0.f)), oy = vmax(qy, floatv(0.f)), oz = vmax(qz, floatv(0.f));
+    floatv len = vsqrt(ox*ox + oy*oy + oz*oz);
+    floatv inv = select(len > floatv(0.f), floatv(1.f)/len, floatv(0.f));
+    maskv outside = m > floatv(0.f);
+    maskv ay = (qy > qx) & (qy >= qz), az = (qz > qx) & (qz > qy);
+    d = select(outside, len, m);
+    nx = select(outside, sx*ox*inv, select(ay | az, floatv(0.f), sx));
+    ny = select(outside, sy*oy*inv, select(ay, sy, floatv(0.f)));
+    nz = select(outside, sz*oz*inv, select(az, sz, floatv(0.f)));
+}
+
+// a capsule of radius r along y, from -h to h, is a sphere about the
+// nearest point of that segment
+inline void sdfCapsule(floatv x, floatv y, floatv z, floatv r, floatv h,
+                       floatv &d, floatv &nx, floatv &ny, floatv &nz) {
+    sdfSphere(x, y - vmin(vmax(y, floatv(0.f) - h), h), z, r, d, nx, ny, nz);
+}
+
+// a cylinder of radius r along y, from -h to h; the same cases as
+// Shape::collisionTest, picked per lane
+inline void sdfCylinder(floatv x, floatv y, floatv z, floatv r, floatv h,
+                        floatv &d, floatv &nx, floatv &ny, floatv &nz) {
+    floatv rho = vsqrt(x*x + z*z);
+    maskv off = rho > floatv(0.f);
+    floatv inv = select(off, floatv(1.f)/rho, floatv(0.f));
+    floatv rx = select(off, x*inv, floatv(1.f)), rz = z*inv;
+    floatv sy = select(y < floatv(0.f), floatv(-1.f), floatv(1.f));
+    floatv qr = rho - r, qy = vabs(y) - h;
+    maskv corner = (qr > floatv(0.f)) & (qy > floatv(0.f)), side = qr > qy;
+    floatv len = vsqrt(qr*qr + qy*qy);
+    floatv linv = select(corner, floatv(1.f)/len, floatv(0.f));
+    d = select(corner, len, select(side, qr, qy));
+    nx = select(corner, qr*rx*linv, select(side, rx, floatv(0.f)));
+    ny = select(corner, sy*qy*linv, select(side, floatv(0.f), sy));
+    nz = select(corner, qr*rz*linv, select(side, rz, floatv(0.f)));
+}
+
+// the distance and normal of one shape, for the primitive types
+inline void sdfShape(const Shape &shape, floatv x, floatv y, floatv z,
+                     floatv &d, floatv &nx, floatv &ny, floatv &nz) {
+    floatv r((float)shape.radius), h((float)shape.halfSize[1]);
+    if (shape.type == SPHERE)
+        sdfSphere(x, y, z, r, d, nx, ny, nz);
+    else if (shape.type == CAPSULE)
+        sdfCapsule(x, y, z, r, h, d, nx, ny, nz);
+    else if (shape.type == CYLINDER)
+        sdfCylinder(x, y, z, r, h, d, nx, ny, nz);
+    else
+        sdfBox(x, y, z, floatv((float)shape.halfSize[0]), h, floatv((float)shape.halfSize[2]), d, nx, ny, nz);
+}
+
+// n points in the shape's body frame against one shape
+void shapeDistances(const Shape &shape, int n, const float *x, const float *y, const float *z,
+                    float *d, float *nx, float *ny, float *nz) {
+    const int W = floatv::width;
+    floatv vd, vx, vy, vz;
+    for (int i = 0; i < n; i += W) {
+        floatv px = floatv::load(x+i), py = floatv::load(y+i), pz = floatv::load(z+i);
+        sdfShape(shape, px, py, pz, vd, vx, vy, vz);
+        vd.store(d+i);
+        vx.store(nx+i);
+        vy.store(ny+i);
+        vz.store(nz+i);
+    }
+}
+
+// Many posed primitive shapes, queried one point at a time. Centers are
+// taken relative to whatever origin the caller picks for its query points;
+// normals come back in that same frame. Compounds can't be added; add
+// their children instead.
+class ShapeSet {
+public:
+    ShapeSet(): count(0), rounded(false) {}
+    void clear();
+    void add(const Shape &shape, vec3 center, const mat3 &rotation);
+    int size() const { return count; }
+    void distances(vec3 p, float *d, float *nx, float *ny, float *nz) const;
+protected:
+    int count;
+    bool rounded; // whether any capsule or cylinder was added
+    std::vector<float> type, radius, hx, hy, hz, cx, cy, cz;
+    std::vector<float> r[9]; // rotations, row major
+    void pad();
+};
+
+void ShapeSet::clear() {
+    count = 0;
+    rounded = false;
+    pad();
+}
+
+void ShapeSet::pad() {
+    int n = simdPadded(count);
+    type.resize(n, 0); radius.resize(n, 0);
+    hx.resize(n, 0); hy.resize(n, 0); hz.resize(n, 0);
+    cx.resize(n, 0); cy.resize(n, 0); cz.resize(n, 0);
+    for (int k = 0; k < 9; k++)
+        r[k].resize(n, 0);
+}
+
+void ShapeSet::add(const Shape &shape, vec3 center, const mat3 &rotation) {
+    assert(shape.type != COMPOUND);
+    int i = count++;
+    pad();
+    type[i] = shape.type;
+    rounded = rounded || shape.type == CAPSULE || shape.type == CYLINDER;
+    radius[i] = shape.radius;
+    hx[i] = shape.halfSize[0]; hy[i] = shape.halfSize[1]; hz[i] = shape.halfSize[2];
+    cx[i] = center[0]; cy[i] = center[1]; cz[i] = center[2];
+    for (int k = 0; k < 9; k++)
+        r[k][i] = rotation(k/3, k%3);
+}
+
+// the shape types share a vector, so every type's distance is computed and
+// the shape type picks one per lane; capsules and cylinders only once the
+// set has any
+void ShapeSet::distances(vec3 p, float *d, float *nx, float *ny, float *nz) const {
+    const int W = floatv::width;
+    floatv px((float)p[0]), py((float)p[1]), pz((float)p[2]);
+    for (int i = 0; i < count; i += W) {
+        floatv r0 = floatv::load(&r[0][i]), r1 = floatv::load(&r[1][i]), r2 = floatv::load(&r[2][i]);
+        floatv r3 = floatv::load(&r[3][i]), r4 = floatv::load(&r[4][i]), r5 = floatv::load(&r[5][i]);
+        floatv r6 = floatv::load(&r[6][i]), r7 = floatv::load(&r[7][i]), r8 = floatv::load(&r[8][i]);
+        // into each body frame: R^T (p - c)
+        floatv wx = px - floatv::load(&cx[i]), wy = py - floatv::load(&cy[i]), wz = pz - floatv::load(&cz[i]);
+        floatv x = r0*wx + r3*wy + r6*wz;
+        floatv y = r1*wx + r4*wy + r7*wz;
+        floatv z = r2*wx + r5*wy + r8*wz;
+        floatv sd, sx, sy, sz, bd, bx, by, bz;
+        sdfSphere(x, y, z, floatv::load(&radius[i]), sd, sx, sy, sz);
+        sdfBox(x, y, z, floatv::load(&hx[i]), floatv::load(&hy[i]), floatv::load(&hz[i]), bd, bx, by, bz);
+        floatv t = floatv::load(&type[i]);
+        maskv isBox = t > floatv(BOX - 0.5f);
+        floatv ld = select(isBox, bd, sd);
+        floatv lx = select(isBox, bx, sx), ly = select(isBox, by, sy), lz = select(isBox, bz, sz);
+        if (rounded) {
+            floatv cd, ccx, ccy, ccz;
+            maskv isCapsule = t > floatv(CAPSULE - 0.5f), isCylinder = t > floatv(CYLINDER - 0.5f);
+            sdfCapsule(x, y, z, floatv::load(&radius[i]), floatv::load(&hy[i]), cd, ccx, ccy, ccz);
+            ld = select(isCapsule, cd, ld);
+            lx = select(isCapsule, ccx, lx), ly = select(isCapsule, ccy, ly), lz = select(isCapsule, ccz, lz);
+            sdfCylinder(x, y, z, floatv::load(&radius[i]), floatv::load(&hy[i]), cd, ccx, ccy, ccz);
+            ld = select(isCylinder, cd, ld);
+            lx = select(isCylinder, ccx, lx), ly = select(isCylinder, ccy, ly), lz = select(isCylinder, ccz, lz);
+        }
+        // and the normal back out: R n
+        ld.store(d+i);
+        (r0*lx + r1*ly + r2*lz).store(nx+i);
+        (r3*lx + r4*ly + r5*lz).store(ny+i);
+        (r6*lx + r7*ly + r8*lz).store(nz+i);
+    }
+}
+
+// Collision samples of one shape that lie inside another.
+class SampleHits {
+public:
+    std::vector<int> sample;
+    std::vector<float> depth, nx, ny, nz; // normal is b's, in b's frame
+    void clear() { sample.clear(); depth.clear(); nx.clear(); ny.clear(); nz.clear(); }
+    int size() const { return sample.size(); }
+};
+
+// Tests a's collision samples against b, where x_b = rotation x_a + offset
+// takes a's body frame into b's, and appends those inside b to `hits`.
+void samplesInside(const Shape &a, const mat3 &rotation, vec3 offset, const Shape &b, SampleHits &hits) {
+    const int W = floatv::width;
+    const ShapeSamples &samples = *a.samples;
+    int n = samples.points.size();
+    floatv r0(rotation(0,0)), r1(rotation(0,1)), r2(rotation(0,2));
+    floatv r3(rotation(1,0)), r4(rotation(1,1)), r5(rotation(1,2));
+    floatv r6(rotation(2,0)), r7(rotation(2,1)), r8(rotation(2,2));
+    floatv ox(offset[0]), oy(offset[1]), oz(offset[2]);
+    float d[W], nx[W], ny[W], nz[W];
+    for (int i = 0; i < n; i += W) {
+        floatv sx = floatv::load(&samples.x[i]), sy = floatv::load(&samples.y[i]), sz = floatv::load(&samples.z[i]);
+        floatv x = r0*sx + r1*sy + r2*sz + ox;
+        floatv y = r3*sx + r4*sy + r5*sz + oy;
+        floatv z = r6*sx + r7*sy + r8*sz + oz;
+        floatv vd, vx, vy, vz;
+        sdfShape(b, x, y, z, vd, vx, vy, vz);
+        int bits = (vd < floatv(0.f)).bits();
+        if (n - i < W)
+            bits &= (1 << (n - i)) - 1;
+        if (!bits)
+            continue;
+        vd.store(d); vx.store(nx); vy.store(ny); vz.store(nz);
+        for (; bits; bits &= bits - 1) {
+            int k = __builtin_ctz(bits);
+            hits.sample.push_back(i+k);
+            hits.depth.push_back(-d[k]);
+            hits.nx.push_back(nx[k]);
+            hits.ny.push_back(ny[k]);
+            hits.nz.push_back(nz[k]);
+        }
+    }
+}
+
+#endif
@@ -3,82 +3,449 @@
 
 #include "common.hpp"
 #include "draw.hpp"
+#include "simd.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <memory>
+#include <vector>
+
+// Capsules and cylinders lie along the body y axis. Compounds come last, so
+// the types below COMPOUND are the primitives a compound can be made of.
+enum ShapeType {SPHERE, BOX, CAPSULE, CYLINDER, COMPOUND, NUM_SHAPE_TYPES};
+
+// Surface points of a shape used for collision, built once by the factory
+// and never changed after, so every copy of the shape shares them.
+struct ShapeSamples {
+    std::vector<vec3> points;
+    // points again as float columns, zero padded for floatv loads
+    std::vector<float> x, y, z;
+    void pack();
+};
+
+struct CompoundChild;
+class CompoundTree;
 
 class Shape {
 public:
-    int type;
-    float radius;
+    int type; // a ShapeType
+    scalar radius;
+    // of a box; of a capsule or cylinder (radius, half the length of its
+    // axis, radius); of a compound, those of the box about its center that
+    // holds every child
     vec3 halfSize;
-    std::vector<vec3> collisionSamples;
+    std::shared_ptr<const ShapeSamples> samples; // empty for spheres
+    std::shared_ptr<const CompoundTree> compound; // empty but for compounds
     Shape();
-    static Shape makeSphere(float radius);
+    static Shape makeSphere(scalar radius);
     static Shape makeBox(vec3 halfSize);
-    mat3 moment();
-    void draw(bool surface);
-    bool collisionTest(vec3 p, float &d, vec3 &n);
+    // the segment of the axis is 2*halfLength long; a capsule's caps are
+    // hemispheres beyond it
+    static Shape makeCapsule(scalar radius, scalar halfLength);
+    static Shape makeCylinder(scalar radius, scalar halfLength);
+    // needs at least one child; with none it asserts, or in a release
+    // build returns the default shape
+    static Shape makeCompound(const std::vector<CompoundChild> &children);
+    mat3 moment() const;
+    scalar volume() const;
+    scalar boundingRadius() const;
+    // the axis-aligned box that holds the shape, in the body frame
+    void bounds(vec3 &lo, vec3 &hi) const;
+    void draw(bool surface) const;
+    bool collisionTest(vec3 p, scalar &d, vec3 &n) const;
 };
 
+// A primitive shape in a compound, posed in the compound's frame. Children
+// of one compound share a density unless given their own.
+struct CompoundChild {
+    Shape shape;
+    vec3 position;
+    mat3 rotation;
+    scalar density;
+    CompoundChild(): position(0,0,0), rotation(mat3::Identity()), density(1) {}
+    CompoundChild(const Shape &shape, vec3 position, mat3 rotation = mat3::Identity(), scalar density = 1):
+        shape(shape), position(position), rotation(rotation), density(density) {}
+};
+
+// The children of a compound shape and a bounding volume hierarchy over
+// them, both in the compound's body frame, built once by
+// Shape::makeCompound and shared by every copy of the shape.
+//
+// The body frame of a compound is not the frame its children were given
+// in: it is moved to their combined center of mass and turned to the
+// principal axes of their combined inertia, so that the body's inertia
+// stays diagonal like that of a sphere or box. `center` and `axes` are
+// where that frame lies in the given one; a compound meant to be at
+// position p with rotation q in the given frame goes at
+// p + q*center with rotation q*quat(axes).
+//
+// The tree is binary, over the children's boxes, split at the median
+// child along the widest axis. A query visits only the nodes whose boxes
+// it overlaps, so finding the children near a point of contact costs
+// about the log of the number of children.
+class CompoundTree {
+public:
+    std::vector<CompoundChild> children;
+    vec3 center;
+    mat3 axes;
+    mat3 moment;   // per unit mass, diagonal
+    scalar radius; // bounding radius
+    // appends the children whose boxes overlap the box lo..hi
+    void query(vec3 lo, vec3 hi, std::vector<int> &out) const;
+    // an empty tree has a point at the origin for bounds
+    void rootBounds(vec3 &lo, vec3 &hi) const {
+        if (nodes.empty())
+            lo = hi = vec3(0,0,0);
+        else
+            lo = nodes[0].lo, hi = nodes[0].hi;
+    }
+    // an empty given leaves an empty tree
+    void build(const std::vector<CompoundChild> &given);
+protected:
+    // internal nodes have both children; a leaf has right = -1 and left
+    // the index of its child shape
+    struct Node {
+        vec3 lo, hi;
+        int left, right;
+    };
+    std::vector<Node> nodes;
+    int buildNode(std::vector<int> &index, int begin, int end,
+                  const std::vector<vec3> &lo, const std::vector<vec3> &hi);
+};
+
+// bounds of a box lo..hi after x -> rotation*x + offset
+inline void moveBounds(vec3 lo, vec3 hi, const mat3 &rotation, vec3 offset, vec3 &movedLo, vec3 &movedHi) {
+    vec3 c = rotation*((lo + hi)/2) + offset, e = rotation.cwiseAbs()*((hi - lo)/2);
+    movedLo = c - e;
+    movedHi = c + e;
+}
+
 Shape::Shape():
-    radius(0), halfSize(0,0,0) {
+    type(SPHERE), radius(0), halfSize(0,0,0) {
+    static std::shared_ptr<const ShapeSamples> none = std::make_shared<ShapeSamples>();
+    samples = none;
 }
 
-Shape Shape::makeSphere(float radius) {
+Shape Shape::makeSphere(scalar radius) {
     Shape shape;
-    shape.type = 0;
+    shape.type = SPHERE;
     shape.radius = radius;
     return shape;
 }
 
 Shape Shape::makeBox(vec3 halfSize) {
     Shape shape;
-    shape.type = 1;
+    shape.type = BOX;
     shape.halfSize = halfSize;
+    std::shared_ptr<ShapeSamples> samples = std::make_shared<ShapeSamples>();
+    std::vector<vec3> &points = samples->points;
     vec3 o = -halfSize;
     vec3 x = vec3(2*halfSize[0],0,0);
     vec3 y = vec3(0,2*halfSize[1],0);
     vec3 z = vec3(0,0,2*halfSize[2]);
-    shape.collisionSamples.push_back(o);
-    shape.collisionSamples.push_back(o + x);
-    shape.collisionSamples.push_back(o + y);
-    shape.collisionSamples.push_back(o + z);
-    shape.collisionSamples.push_back(o + x + y);
-    shape.collisionSamples.push_back(o + y + z);
-    shape.collisionSamples.push_back(o + z + x);
-    shape.collisionSamples.push_back(o + x + y + z);
-    float res = 0.1;
+    points.push_back(o);
+    points.push_back(o + x);
+    points.push_back(o + y);
+    points.push_back(o + z);
+    points.push_back(o + x + y);
+    points.push_back(o + y + z);
+    points.push_back(o + z + x);
+    points.push_back(o + x + y + z);
+    scalar res = 0.1;
     int nx = ceil(2*halfSize[0]/res);
     for (int i = 1; i < nx; i++) {
-        float t = (float)i/nx;
-        shape.collisionSamples.push_back(o + t*x);
-        shape.collisionSamples.push_back(o + t*x + y);
-        shape.collisionSamples.push_back(o + t*x + z);
-        shape.collisionSamples.push_back(o + t*x + y + z);
+        scalar t = (scalar)i/nx;
+        points.push_back(o + t*x);
+        points.push_back(o + t*x + y);
+        points.push_back(o + t*x + z);
+        points.push_back(o + t*x + y + z);
     }
     int ny = ceil(2*halfSize[1]/res);
     for (int i = 1; i < ny; i++) {
-        float t = (float)i/ny;
-        shape.collisionSamples.push_back(o + t*y);
-        shape.collisionSamples.push_back(o + t*y + x);
-        shape.collisionSamples.push_back(o + t*y + z);
-        shape.collisionSamples.push_back(o + t*y + x + z);
+        scalar t = (scalar)i/ny;
+        points.push_back(o + t*y);
+        points.push_back(o + t*y + x);
+        points.push_back(o + t*y + z);
+        points.push_back(o + t*y + x + z);
     }
     int nz = ceil(2*halfSize[2]/res);
     for (int i = 1; i < nz; i++) {
-        float t = (float)i/nz;
-        shape.collisionSamples.push_back(o + t*z);
-        shape.collisionSamples.push_back(o + t*z + x);
-        shape.collisionSamples.push_back(o + t*z + y);
-        shape.collisionSamples.push_back(o + t*z + x + y);
+        scalar t = (scalar)i/nz;
+        points.push_back(o + t*z);
+        points.push_back(o + t*z + x);
+        points.push_back(o + t*z + y);
+        points.push_back(o + t*z + x + y);
+    }
+    samples->pack();
+    shape.samples = samples;
+    return shape;
+}
+
+// a circle of samples about the y axis, about `spacing` apart
+static void addRing(std::vector<vec3> &points, scalar y, scalar radius, scalar spacing) {
+    if (radius <= 0) {
+        points.push_back(vec3(0, y, 0));
+        return;
+    }
+    int n = std::max(8, (int)ceil(2*M_PI*radius/spacing));
+    for (int i = 0; i < n; i++)
+        points.push_back(vec3(radius*cos(2*M_PI*i/n), y, radius*sin(2*M_PI*i/n)));
+}
+
+Shape Shape::makeCapsule(scalar radius, scalar halfLength) {
+    Shape shape;
+    shape.type = CAPSULE;
+    shape.radius = radius;
+    shape.halfSize = vec3(radius, halfLength, radius);
+    std::shared_ptr<ShapeSamples> samples = std::make_shared<ShapeSamples>();
+    std::vector<vec3> &points = samples->points;
+    scalar res = 0.1;
+    int ny = std::max(1, (int)ceil(2*halfLength/res));
+    for (int i = 0; i <= ny; i++)
+        addRing(points, -halfLength + 2*halfLength*i/ny, radius, res);
+    // rings of latitude over each cap, ending at its pole
+    int nlat = std::max(2, (int)ceil(M_PI/2*radius/res));
+    for (int i = 1; i <= nlat; i++) {
+        scalar a = M_PI/2*i/nlat;
+        addRing(points, halfLength + radius*sin(a), i == nlat ? 0 : radius*cos(a), res);
+        addRing(points, -halfLength - radius*sin(a), i == nlat ? 0 : radius*cos(a), res);
+    }
+    samples->pack();
+    shape.samples = samples;
+    return shape;
+}
+
+Shape Shape::makeCylinder(scalar radius, scalar halfLength) {
+    Shape shape;
+    shape.type = CYLINDER;
+    shape.radius = radius;
+    shape.halfSize = vec3(radius, halfLength, radius);
+    std::shared_ptr<ShapeSamples> samples = std::make_shared<ShapeSamples>();
+    std::vector<vec3> &points = samples->points;
+    scalar res = 0.1;
+    // the rims first, then the side between them and the caps inside them
+    addRing(points, -halfLength, radius, res);
+    addRing(points, halfLength, radius, res);
+    int ny = std::max(1, (int)ceil(2*halfLength/res));
+    for (int i = 1; i < ny; i++)
+        addRing(points, -halfLength + 2*halfLength*i/ny, radius, res);
+    int nr = std::max(1, (int)ceil(radius/res));
+    for (int i = 0; i < nr; i++) {
+        addRing(points, -halfLength, radius*i/nr, res);
+        addRing(points, halfLength, radius*i/nr, res);
+    }
+    samples->pack();
+    shape.samples = samples;
+    return shape;
+}
+
+// Children that are compounds themselves are replaced by their children.
+// The compound's collision samples, used against planes, are those of its
+// children, with points spread over its spheres at about the spacing of a
+// box's.
+Shape Shape::makeCompound(const std::vector<CompoundChild> &children) {
+    assert(!children.empty());
+    std::vector<CompoundChild> flat;
+    for (int i = 0; i < children.size(); i++) {
+        const CompoundChild &c = children[i];
+        if (c.shape.type != COMPOUND) {
+            flat.push_back(c);
+            continue;
+        }
+        const CompoundTree &inner = *c.shape.compound;
+        for (int k = 0; k < inner.children.size(); k++) {
+            CompoundChild g = inner.children[k];
+            g.position = c.position + c.rotation*g.position;
+            g.rotation = c.rotation*g.rotation;
+            g.density = c.density*g.density;
+            flat.push_back(g);
+        }
+    }
+    if (flat.empty())
+        return Shape();
+    std::shared_ptr<CompoundTree> tree = std::make_shared<CompoundTree>();
+    tree->build(flat);
+
+    Shape shape;
+    shape.type = COMPOUND;
+    std::shared_ptr<ShapeSamples> samples = std::make_shared<ShapeSamples>();
+    std::vector<vec3> &points = samples->points;
+    vec3 lo, hi;
+    tree->rootBounds(lo, hi);
+    shape.halfSize = lo.cwiseAbs().cwiseMax(hi.cwiseAbs());
+    for (int i = 0; i < tree->children.size(); i++) {
+        const CompoundChild &c = tree->children[i];
+        const mat3 &R = c.rotation;
+        if (c.shape.type != SPHERE) {
+            const std::vector<vec3> &own = c.shape.samples->points;
+            for (int k = 0; k < own.size(); k++)
+                points.push_back(c.position + R*own[k]);
+        } else {
+            // a Fibonacci lattice on the sphere
+            scalar r = c.shape.radius, res = 0.1;
+            int n = std::max(6, (int)ceil(4*M_PI*r*r/(res*res)));
+            for (int k = 0; k < n; k++) {
+                scalar y = 1 - (2*k + 1)/(scalar)n, ring = sqrt(1 - y*y), phi = k*M_PI*(3 - sqrt(5.));
+                points.push_back(c.position + r*vec3(ring*cos(phi), y, ring*sin(phi)));
+            }
+        }
     }
+    samples->pack();
+    shape.samples = samples;
+    shape.compound = tree;
     return shape;
 }
 
-mat3 Shape::moment() {
+void CompoundTree::build(const std::vector<CompoundChild> &given) {
+    children.clear();
+    nodes.clear();
+    if (given.empty()) {
+        center = vec3(0,0,0);
+        axes = mat3::Identity();
+        moment = mat3::Zero();
+        radius = 0;
+        return;
+    }
+    // combined mass properties in the given frame, by the parallel axis
+    // theorem
+    int n = given.size();
+    std::vector<scalar> mass(n);
+    scalar total = 0;
+    vec3 com(0,0,0);
+    for (int i = 0; i < n; i++) {
+        mass[i] = given[i].density*given[i].shape.volume();
+        total += mass[i];
+        com += mass[i]*given[i].position;
+    }
+    com /= total;
+    mat3 inertia = mat3::Zero();
+    for (int i = 0; i < n; i++) {
+        const mat3 &R = given[i].rotation;
+        vec3 d = given[i].position - com;
+        inertia += mass[i]*(R*given[i].shape.moment()*R.transpose()
+                            + d.squaredNorm()*mat3::Identity() - d*d.transpose());
+    }
+    inertia /= total;
+    // principal axes, each matched to the given axis nearest it, so a
+    // compound whose inertia is already diagonal keeps its frame
+    Eigen::SelfAdjointEigenSolver<mat3> principal(inertia);
+    mat3 A;
+    moment = mat3::Zero();
+    bool taken[3] = {false, false, false};
+    for (int k = 0; k < 3; k++) {
+        int best = -1;
+        for (int e = 0; e < 3; e++)
+            if (!taken[e] && (best < 0 || std::abs(principal.eigenvectors()(k,e)) > std::abs(principal.eigenvectors()(k,best))))
+                best = e;
+        taken[best] = true;
+        A.col(k) = principal.eigenvectors().col(best);
+        if (A(k,k) < 0)
+            A.col(k) = -A.col(k);
+        moment(k,k) = principal.eigenvalues()[best];
+    }
+    if (A.determinant() < 0)
+        A.col(2) = -A.col(2);
+    center = com;
+    axes = A;
+
+    // the children in the principal frame, and their boxes
+    children = given;
+    std::vector<vec3> lo(n), hi(n);
+    radius = 0;
+    for (int i = 0; i < n; i++) {
+        CompoundChild &c = children[i];
+        c.position = A.transpose()*(c.position - com);
+        c.rotation = A.transpose()*c.rotation;
+        vec3 l, h;
+        c.shape.bounds(l, h);
+        moveBounds(l, h, c.rotation, c.position, lo[i], hi[i]);
+        radius = std::max(radius, c.position.norm() + c.shape.boundingRadius());
+    }
+    std::vector<int> index(n);
+    for (int i = 0; i < n; i++)
+        index[i] = i;
+    nodes.reserve(2*n - 1);
+    buildNode(index, 0, n, lo, hi);
+}
+
+int CompoundTree::buildNode(std::vector<int> &index, int begin, int end,
+                            const std::vector<vec3> &lo, const std::vector<vec3> &hi) {
+    int k = nodes.size();
+    nodes.push_back(Node());
+    vec3 l = lo[index[begin]], h = hi[index[begin]];
+    for (int i = begin + 1; i < end; i++) {
+        l = l.cwiseMin(lo[index[i]]);
+        h = h.cwiseMax(hi[index[i]]);
+    }
+    nodes[k].lo = l;
+    nodes[k].hi = h;
+    if (end - begin == 1) {
+        nodes[k].left = index[begin];
+        nodes[k].right = -1;
+        return k;
+    }
+    int axis;
+    (h - l).maxCoeff(&axis);
+    int mid = (begin + end)/2;
+    std::nth_element(index.begin() + begin, index.begin() + mid, index.begin() + end, [&](int a, int b) {
+        return lo[a][axis] + hi[a][axis] < lo[b][axis] + hi[b][axis];
+    });
+    int left = buildNode(index, begin, mid, lo, hi);
+    int right = buildNode(index, mid, end, lo, hi);
+    nodes[k].left = left;
+    nodes[k].right = right;
+    return k;
+}
+
+void CompoundTree::query(vec3 lo, vec3 hi, std::vector<int> &out) const {
+    if (nodes.empty())
+        return;
+    int stack[64], top = 0;
+    stack[top++] = 0;
+    while (top > 0) {
+        const Node &node = nodes[stack[--top]];
+        if ((node.lo.array() > hi.array()).any() || (node.hi.array() < lo.array()).any())
+            continue;
+        if (node.right < 0)
+            out.push_back(node.left);
+        else {
+            stack[top++] = node.left;
+            stack[top++] = node.right;
+        }
+    }
+}
+
+void ShapeSamples::pack() {
+    int n = points.size();
+    x.assign(simdPadded(n), 0);
+    y.assign(simdPadded(n), 0);
+    z.assign(simdPadded(n), 0);
+    for (int i = 0; i < n; i++) {
+        x[i] = points[i][0];
+        y[i] = points[i][1];
+        z[i] = points[i][2];
+    }
+}
+
+mat3 Shape::moment() const {
 
     // Implement this yourself!
     // Should return the matrix M such that mass*M = I_body
     
-     if (type == 0) {
+     if (type == COMPOUND) {
+        return compound->moment;
+    } else if (type == CAPSULE || type == CYLINDER) {
+        // the tube, plus for a capsule the two caps, which together are a
+        // sphere split in half and moved out to the ends of the axis
+        scalar r = radius, h = halfSize[1];
+        scalar tube = 2*h, caps = type == CAPSULE ? 4*r/3 : 0; // volumes over pi r^2
+        scalar mt = tube/(tube + caps), mc = caps/(tube + caps);
+        scalar axial = mt*r*r/2 + mc*r*r*2.0/5;
+        scalar side = mt*(r*r/4 + h*h/3) + mc*(r*r*2.0/5 + h*h + 3*h*r/4);
+        mat3 mom;
+        mom << side, 0, 0, 0, axial, 0, 0, 0, side;
+        return mom;
+    } else if (type == 0) {
 
         mat3 mom;
         mom << radius*radius*2.0/5, 0, 0, 0, radius*radius*2.0/5, 0, 0, 0, radius*radius*2.0/5 ;
@@ -91,18 +458,111 @@ mat3 Shape::moment() {
     }
 }
 
-void Shape::draw(bool surface) {
+scalar Shape::volume() const {
+    scalar r = radius, h = halfSize[1];
+    if (type == 0)
+        return 4*M_PI/3*r*r*r;
+    else if (type == CAPSULE)
+        return M_PI*r*r*(2*h + 4*r/3);
+    else if (type == CYLINDER)
+        return M_PI*r*r*2*h;
+    else if (type == COMPOUND) {
+        scalar v = 0;
+        for (int i = 0; i < compound->children.size(); i++)
+            v += compound->children[i].shape.volume();
+        return v;
+    } else // type == BOX
+        return 8*halfSize[0]*halfSize[1]*halfSize[2];
+}
+
+scalar Shape::boundingRadius() const {
+    if (type == 0)
+        return radius;
+    else if (type == CAPSULE)
+        return halfSize[1] + radius;
+    else if (type == CYLINDER) // to a rim
+        return sqrt(radius*radius + halfSize[1]*halfSize[1]);
+    else if (type == COMPOUND)
+        return compound->radius;
+    else // type == BOX
+        return halfSize.norm();
+}
+
+void Shape::bounds(vec3 &lo, vec3 &hi) const {
+    if (type == COMPOUND) {
+        compound->rootBounds(lo, hi);
+    } else {
+        vec3 h = type == 0 ? vec3(radius, radius, radius) : halfSize;
+        if (type == CAPSULE)
+            h[1] += radius;
+        lo = -h;
+        hi = h;
+    }
+}
+
+void Shape::draw(bool surface) const {
     if (type == 0) {
         drawSphere(vec3(0,0,0), radius, surface);
+    } else if (type == CAPSULE) {
+        drawCapsule(vec3(0,0,0), radius, halfSize[1], surface);
+    } else if (type == CYLINDER) {
+        drawCylinder(vec3(0,0,0), radius, halfSize[1], surface);
+    } else if (type == COMPOUND) {
+        for (int i = 0; i < compound->children.size(); i++) {
+            const CompoundChild &c = compound->children[i];
+            pushTransform();
+            translate(c.position);
+            rotate(c.rotation);
+            c.shape.draw(surface);
+            popTransform();
+        }
     } else { // type == BOX
         drawBox(-halfSize, halfSize, surface);
     }
 }
 
-inline int sgn(float x) {return (x<0) ? -1 : (x>0) ? 1 : 0;}
+inline int sgn(scalar x) {return (x<0) ? -1 : (x>0) ? 1 : 0;}
 
-bool Shape::collisionTest(vec3 p, float &d, vec3 &n) {
-    if (type == 0) {
+bool Shape::collisionTest(vec3 p, scalar &d, vec3 &n) const {
+    if (type == COMPOUND) {
+        // the nearest child
+        d = 1e6;
+        for (int i = 0; i < compound->children.size(); i++) {
+            const CompoundChild &c = compound->children[i];
+            const mat3 &R = c.rotation;
+            scalar cd;
+            vec3 cn;
+            c.shape.collisionTest(R.transpose()*(p - c.position), cd, cn);
+            if (cd < d) {
+                d = cd;
+                n = R*cn;
+            }
+        }
+        return (d < 0);
+    } else if (type == CAPSULE) {
+        // from the nearest point of the axis
+        vec3 q = p - vec3(0, std::min(std::max(p[1], -halfSize[1]), halfSize[1]), 0);
+        d = q.norm() - radius;
+        n = q.normalized();
+        return (d < 0);
+    } else if (type == CYLINDER) {
+        // in the plane of the axis and p: out from the side, and along the
+        // axis out of the caps
+        scalar rho = sqrt(p[0]*p[0] + p[2]*p[2]);
+        vec3 radial = rho > 0 ? vec3(p[0]/rho, 0, p[2]/rho) : vec3(1,0,0);
+        scalar qr = rho - radius, qy = std::abs(p[1]) - halfSize[1];
+        if (qr > 0 && qy > 0) {
+            d = sqrt(qr*qr + qy*qy);
+            n = (qr*radial + vec3(0, sgn(p[1])*qy, 0))/d;
+        } else if (qr > qy) {
+            d = qr;
+            n = radial;
+        } else {
+            d = qy;
+            n = vec3(0, p[1] < 0 ? -1 : 1, 0);
+        }
+        return (d < 0);
+    } else if (type == 0) {
         d = p.norm() - radius;
         n = p.normalized();
         return (d < 0);
@@ -0,0 +1,158 @@
+#ifndef SIMD_HPP
+#define SIMD_HPP
+
+#include <cmath>
+
+// A thin wrapper over the widest float vector the compiler targets, so batch
+// kernels can be written once:
+//
+//     floatv d2 = dx*dx + dy*dy + dz*dz;
+//     maskv hit = d2 <= r*r;
+//
+// AVX-512 gives 16 lanes, AVX/AVX2 8, SSE2 4, and anything else falls back to
+// plain scalar code with one lane. Build with -march=native to get the wide
+// paths. Loads and stores are unaligned; arrays fed to a kernel should be
+// padded to a multiple of floatv::width.
+
+#if defined(__AVX512F__)
+
+#include <immintrin.h>
+
+struct floatv {
+    static const int width = 16;
+    __m512 v;
+    floatv() {}
+    floatv(__m512 v): v(v) {}
+    floatv(float x): v(_mm512_set1_ps(x)) {}
+    static floatv load(const float *p) { return _mm512_loadu_ps(p); }
+    void store(float *p) const { _mm512_storeu_ps(p, v); }
+};
+struct maskv {
+    __mmask16 m;
+    int bits() const { return m; }
+};
+inline floatv operator+(floatv a, floatv b) { return _mm512_add_ps(a.v, b.v); }
+inline floatv operator-(floatv a, floatv b) { return _mm512_sub_ps(a.v, b.v); }
+inline floatv operator*(floatv a, floatv b) { return _mm512_mul_ps(a.v, b.v); }
+inline floatv operator/(floatv a, floatv b) { return _mm512_div_ps(a.v, b.v); }
+inline floatv vmin(floatv a, floatv b) { return _mm512_min_ps(a.v, b.v); }
+inline floatv vmax(floatv a, floatv b) { return _mm512_max_ps(a.v, b.v); }
+inline floatv vsqrt(floatv a) { return _mm512_sqrt_ps(a.v); }
+inline floatv vabs(floatv a) { return _mm512_abs_ps(a.v); }
+inline maskv operator<(floatv a, floatv b) { maskv r; r.m = _mm512_cmp_ps_mask(a.v, b.v, _CMP_LT_OQ); return r; }
+inline maskv operator<=(floatv a, floatv b) { maskv r; r.m = _mm512_cmp_ps_mask(a.v, b.v, _CMP_LE_OQ); return r; }
+inline maskv operator>(floatv a, floatv b) { maskv r; r.m = _mm512_cmp_ps_mask(a.v, b.v, _CMP_GT_OQ); return r; }
+inline maskv operator>=(floatv a, floatv b) { maskv r; r.m = _mm512_cmp_ps_mask(a.v, b.v, _CMP_GE_OQ); return r; }
+inline maskv operator&(maskv a, maskv b) { maskv r; r.m = a.m & b.m; return r; }
+inline maskv operator|(maskv a, maskv b) { maskv r; r.m = a.m | b.m; return r; }
+// m ? a : b, per lane
+inline floatv select(maskv m, floatv a, floatv b) { return _mm512_mask_blend_ps(m.m, b.v, a.v); }
+
+#elif defined(__AVX__)
+
+#include <immintrin.h>
+
+struct floatv {
+    static const int width = 8;
+    __m256 v;
+    floatv() {}
+    floatv(__m256 v): v(v) {}
+    floatv(float x): v(_mm256_set1_ps(x)) {}
+    static floatv load(const float *p) { return _mm256_loadu_ps(p); }
+    void store(float *p) const { _mm256_storeu_ps(p, v); }
+};
+struct maskv {
+    __m256 m;
+    int bits() const { return _mm256_movemask_ps(m); }
+};
+inline floatv operator+(floatv a, floatv b) { return _mm256_add_ps(a.v, b.v); }
+inline floatv operator-(floatv a, floatv b) { return _mm256_sub_ps(a.v, b.v); }
+inline floatv operator*(floatv a, floatv b) { return _mm256_mul_ps(a.v, b.v); }
+inline floatv operator/(floatv a, floatv b) { return _mm256_div_ps(a.v, b.v); }
+inline floatv vmin(floatv a, floatv b) { return _mm256_min_ps(a.v, b.v); }
+inline floatv vmax(floatv a, floatv b) { return _mm256_max_ps(a.v, b.v); }
+inline floatv vsqrt(floatv a) { return _mm256_sqrt_ps(a.v); }
+inline floatv vabs(floatv a) { return _mm256_andnot_ps(_mm256_set1_ps(-0.f), a.v); }
+inline maskv operator<(floatv a, floatv b) { maskv r; r.m = _mm256_cmp_ps(a.v, b.v, _CMP_LT_OQ); return r; }
+inline maskv operator<=(floatv a, floatv b) { maskv r; r.m = _mm256_cmp_ps(a.v, b.v, _CMP_LE_OQ); return r; }
+inline maskv operator>(floatv a, floatv b) { maskv r; r.m = _mm256_cmp_ps(a.v, b.v, _CMP_GT_OQ); return r; }
+inline maskv operator>=(floatv a, floatv b) { maskv r; r.m = _mm256_cmp_ps(a.v, b.v, _CMP_GE_OQ); return r; }
+inline maskv operator&(maskv a, maskv b) { maskv r; r.m = _mm256_and_ps(a.m, b.m); return r; }
+inline maskv operator|(maskv a, maskv b) { maskv r; r.m = _mm256_or_ps(a.m, b.m); return r; }
+inline floatv select(maskv m, floatv a, floatv b) { return _mm256_blendv_ps(b.v, a.v, m.m); }
+
+#elif defined(__SSE2__)
+
+#include <emmintrin.h>
+
+struct floatv {
+    static const int width = 4;
+    __m128 v;
+    floatv() {}
+    floatv(__m128 v): v(v) {}
+    floatv(float x): v(_mm_set1_ps(x)) {}
+    static floatv load(const float *p) { return _mm_loadu_ps(p); }
+    void store(float *p) const { _mm_storeu_ps(p, v); }
+};
+struct maskv {
+    __m128 m;
+    int bits() const { return _mm_movemask_ps(m); }
+};
+inline floatv operator+(floatv a, floatv b) { return _mm_add_ps(a.v, b.v); }
+inline floatv operator-(floatv a, floatv b) { return _mm_sub_ps(a.v, b.v); }
+inline floatv operator*(floatv a, floatv b) { return _mm_mul_ps(a.v, b.v); }
+inline floatv operator/(floatv a, floatv b) { return _mm_div_ps(a.v, b.v); }
+inline floatv vmin(floatv a, floatv b) { return _mm_min_ps(a.v, b.v); }
+inline floatv vmax(floatv a, floatv b) { return _mm_max_ps(a.v, b.v); }
+inline floatv vsqrt(floatv a) { return _mm_sqrt_ps(a.v); }
+inline floatv vabs(floatv a) { return _mm_andnot_ps(_mm_set1_ps(-0.f), a.v); }
+inline maskv operator<(floatv a, floatv b) { maskv r; r.m = _mm_cmplt_ps(a.v, b.v); return r; }
+inline maskv operator<=(floatv a, floatv b) { maskv r; r.m = _mm_cmple_ps(a.v, b.v); return r; }
+inline maskv operator>(floatv a, floatv b) { maskv r; r.m = _mm_cmpgt_ps(a.v, b.v); return r; }
+inline maskv operator>=(floatv a, floatv b) { maskv r; r.m = _mm_cmpge_ps(a.v, b.v); return r; }
+inline maskv operator&(maskv a, maskv b) { maskv r; r.m = _mm_and_ps(a.m, b.m); return r; }
+inline maskv operator|(maskv a, maskv b) { maskv r; r.m = _mm_or_ps(a.m, b.m); return r; }
+inline floatv select(maskv m, floatv a, floatv b) {
+    return _mm_or_ps(_mm_and_ps(m.m, a.v), _mm_andnot_ps(m.m, b.v));
+}
+
+#else
+
+struct floatv {
+    static const int width = 1;
+    float v;
+    floatv() {}
+    floatv(float x): v(x) {}
+    static floatv load(const float *p) { return *p; }
+    void store(float *p) const { *p = v; }
+};
+struct maskv {
+    bool m;
+    int bits() const { return m; }
+};
+inline floatv operator+(floatv a, floatv b) { return a.v + b.v; }
+inline floatv operator-(floatv a, floatv b) { return a.v - b.v; }
+inline floatv operator*(floatv a, floatv b) { return a.v * b.v; }
+inline floatv operator/(floatv a, floatv b) { return a.v / b.v; }
+inline floatv vmin(floatv a, floatv b) { return a.v < b.v ? a.v : b.v; }
+inline floatv vmax(floatv a, floatv b) { return a.v > b.v ? a.v : b.v; }
+inline floatv vsqrt(floatv a) { return std::sqrt(a.v); }
+inline floatv vabs(floatv a) { return std::fabs(a.v); }
+inline maskv operator<(floatv a, floatv b) { maskv r; r.m = a.v < b.v; return r; }
+inline maskv operator<=(floatv a, floatv b) { maskv r; r.m = a.v <= b.v; return r; }
+inline maskv operator>(floatv a, floatv b) { maskv r; r.m = a.v > b.v; return r; }
+inline maskv operator>=(floatv a, floatv b) { maskv r; r.m = a.v >= b.v; return r; }
+inline maskv operator&(maskv a, maskv b) { maskv r; r.m = a.m && b.m; return r; }
+inline maskv operator|(maskv a, maskv b) { maskv r; r.m = a.m || b.m; return r; }
+inline floatv select(maskv m, floatv a, floatv b) { return m.m ? a : b; }
+
+#endif
+
+inline floatv operator-(floatv a) { return floatv(0.f) - a; }
+
+// number of floats to allocate so that n elements can be read in whole vectors
+inline int simdPadded(int n) {
+    return (n + floatv::width - 1)/floatv::width*floatv::width;
+}
+
+#endif
@@ -0,0 +1,133 @@
+#ifndef SPHERE_BATCH_HPP
+#define SPHERE_BATCH_HPP
+
+#include "common.hpp"
+#include "simd.hpp"
+
+#include <vector>
+
+// Sphere-sphere narrowphase over a batch of candidate pairs. Pairs are kept
+// in SoA form (center offset b - a and the radii), tested floatv::width lanes
+// at a time, and the overlapping ones are written compactly to a
+// SphereContacts array for the solver. Offsets are relative, so float lanes
+// are accurate in every precision mode, though only to float: a double
+// build uses the kernel as a filter and tests its hits again (see
+// World::collideSpheres).
+
+class SpherePairBatch {
+public:
+    std::vector<int> a, b;
+    std::vector<float> dx, dy, dz, radiusSum;
+    void clear();
+    void add(int a, int b, vec3 delta, scalar ra, scalar rb);
+    int size() const { return a.size(); }
+    vec3 delta(int i) const { return vec3(dx[i], dy[i], dz[i]); }
+    void pad();
+};
+
+class SphereContacts {
+public:
+    std::vector<int> pair; // index into the SpherePairBatch
+    std::vector<float> nx, ny, nz, depth;
+    void clear();
+    void add(int pair, float nx, float ny, float nz, float depth);
+    void resize(int n);
+    int size() const { return pair.size(); }
+    vec3 normal(int i) const { return vec3(nx[i], ny[i], nz[i]); }
+};
+
+void sphereSphereBatch(SpherePairBatch &pairs, SphereContacts &contacts);
+void sphereSphereScalar(const SpherePairBatch &pairs, SphereContacts &contacts);
+
+void SpherePairBatch::clear() {
+    a.clear(); b.clear();
+    dx.clear(); dy.clear(); dz.clear();
+    radiusSum.clear();
+}
+
+void SpherePairBatch::add(int a, int b, vec3 delta, scalar ra, scalar rb) {
+    this->a.push_back(a);
+    this->b.push_back(b);
+    dx.push_back(delta[0]);
+    dy.push_back(delta[1]);
+    dz.push_back(delta[2]);
+    radiusSum.push_back(ra + rb);
+}
+
+// makes room for whole-vector loads past the last pair
+void SpherePairBatch::pad() {
+    int n = simdPadded(size());
+    dx.resize(n, 0); dy.resize(n, 0); dz.resize(n, 0);
+    radiusSum.resize(n, 0);
+}
+
+void SphereContacts::clear() {
+    pair.clear();
+    nx.clear(); ny.clear(); nz.clear();
+    depth.clear();
+}
+
+inline void SphereContacts::add(int pair, float nx, float ny, float nz, float depth) {
+    this->pair.push_back(pair);
+    this->nx.push_back(nx);
+    this->ny.push_back(ny);
+    this->nz.push_back(nz);
+    this->depth.push_back(depth);
+}
+
+void SphereContacts::resize(int n) {
+    pair.resize(n);
+    nx.resize(n); ny.resize(n); nz.resize(n);
+    depth.resize(n);
+}
+
+void sphereSphereBatch(SpherePairBatch &pairs, SphereContacts &contacts) {
+    const int W = floatv::width;
+    int n = pairs.size(), count = 0;
+    pairs.pad();
+    contacts.resize(n); // room for every pair to touch, trimmed at the end
+    float nx[W], ny[W], nz[W], depth[W];
+    for (int i = 0; i < n; i += W) {
+        floatv dx = floatv::load(&pairs.dx[i]);
+        floatv dy = floatv::load(&pairs.dy[i]);
+        floatv dz = floatv::load(&pairs.dz[i]);
+        floatv rs = floatv::load(&pairs.radiusSum[i]);
+        floatv d2 = dx*dx + dy*dy + dz*dz;
+        int bits = (d2 <= rs*rs).bits();
+        if (n - i < W)
+            bits &= (1 << (n - i)) - 1;
+        if (!bits)
+            continue;
+        // coincident centers get a zero normal, like vec3::normalized()
+        floatv dist = vsqrt(d2);
+        floatv inv = select(dist > floatv(0.f), floatv(1.f)/dist, floatv(0.f));
+        (dx*inv).store(nx);
+        (dy*inv).store(ny);
+        (dz*inv).store(nz);
+        (rs - dist).store(depth);
+        for (; bits; bits &= bits - 1) {
+            int k = __builtin_ctz(bits);
+            contacts.pair[count] = i+k;
+            contacts.nx[count] = nx[k];
+            contacts.ny[count] = ny[k];
+            contacts.nz[count] = nz[k];
+            contacts.depth[count] = depth[k];
+            count++;
+        }
+    }
+    contacts.resize(count);
+}
+
+// one pair at a time, for reference and for benchmarking against
+void sphereSphereScalar(const SpherePairBatch &pairs, SphereContacts &contacts) {
+    contacts.clear();
+    for (int i = 0; i < pairs.size(); i++) {
+        vec3 d = pairs.delta(i);
+        if (d.norm() <= pairs.radiusSum[i]) {
+            vec3 n = d.normalized();
+            contacts.add(i, n[0], n[1], n[2], pairs.radiusSum[i] - d.norm());
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,110 @@
+#ifndef STATE_EXPORT_HPP
+#define STATE_EXPORT_HPP
+
+#include "common.hpp"
+#include "rb.hpp"
+#include "state_reader.hpp"
+
+#include <new>
+#include <string>
+
+// Publishes body states into a POSIX shared memory segment for other
+// processes, which read them with StateReader (state_reader.hpp). Like
+// StatsExporter it is opt-in: World only calls publish() when one is
+// attached. Publishing is a copy into the segment under the sequence lock;
+// nothing waits for readers. The handle of a removed body reads as all
+// zeros, rotation included, until a new body takes it.
+
+class StateExporter {
+public:
+    int period; // steps between frames
+    StateExporter(): period(1), header(NULL), bytes(0) {}
+    ~StateExporter() { close(); }
+    // creates or replaces the segment `name` (e.g. "/rb-state") with room
+    // for `capacity` bodies; bodies past that are not published
+    bool open(std::string name, int capacity);
+    void close();
+    // bodies[index[h]] is the body with handle h
+    void publish(long long step, double time, const RigidBody *bodies, const int *index, int n);
+protected:
+    std::string name;
+    SharedStateHeader *header;
+    size_t bytes;
+    SharedBodyState *states() { return (SharedBodyState*)(header + 1); }
+};
+
+bool StateExporter::open(std::string name, int capacity) {
+    close();
+#ifdef __unix__
+    size_t size = sizeof(SharedStateHeader) + (size_t)capacity*sizeof(SharedBodyState);
+    shm_unlink(name.c_str());
+    int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (fd < 0)
+        return false;
+    void *p = MAP_FAILED;
+    if (ftruncate(fd, size) == 0)
+        p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (p == MAP_FAILED) {
+        shm_unlink(name.c_str());
+        return false;
+    }
+    header = (SharedStateHeader*)p;
+    bytes = size;
+    this->name = name;
+    new (&header->sequence) std::atomic<unsigned long long>(0);
+    header->capacity = capacity;
+    header->count = 0;
+    header->step = 0;
+    header->time = 0;
+    header->version = sharedStateVersion;
+    // last, so a reader that sees the magic sees the rest of the header
+    std::atomic_thread_fence(std::memory_order_release);
+    header->magic = sharedStateMagic;
+    return true;
+#else
+    return false;
+#endif
+}
+
+void StateExporter::close() {
+#ifdef __unix__
+    if (header) {
+        munmap(header, bytes);
+        shm_unlink(name.c_str());
+    }
+#endif
+    header = NULL;
+    bytes = 0;
+}
+
+void StateExporter::publish(long long step, double time, const RigidBody *bodies, const int *index, int n) {
+    if (!header || period <= 0 || step % period != 0)
+        return;
+    unsigned long long seq = header->sequence.load(std::memory_order_relaxed);
+    header->sequence.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    unsigned count = std::min((unsigned)n, header->capacity);
+    SharedBodyState *out = states();
+    for (unsigned h = 0; h < count; h++) {
+        SharedBodyState &s = out[h];
+        if (index[h] < 0) {
+            memset(&s, 0, sizeof(s));
+            continue;
+        }
+        const RigidBody &b = bodies[index[h]];
+        for (int k = 0; k < 3; k++) {
+            s.position[k] = b.position[k];
+            s.linear[k] = b.linear_velocity[k];
+            s.angular[k] = b.angular_velocity[k];
+        }
+        for (int k = 0; k < 4; k++)
+            s.rotation[k] = b.rotation.coeffs()[k];
+    }
+    header->count = count;
+    header->step = step;
+    header->time = time;
+    header->sequence.store(seq + 2, std::memory_order_release);
+}
+
+#endif
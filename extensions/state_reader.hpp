@@ -0,0 +1,146 @@
+#ifndef STATE_READER_HPP
+#define STATE_READER_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#ifdef __unix__
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Live body states published by a StateExporter (state_export.hpp) into a
+// POSIX shared memory segment, and a reader for them. This header only
+// needs the standard library, so other programs can include it alone.
+//
+// The segment is a SharedStateHeader followed by room for `capacity`
+// SharedBodyStates, in the order of the bodies' handles; a removed body's
+// state is all zeros, so a zero rotation marks it. The writer guards
+// each frame with a sequence lock: sequence is odd while a frame is being
+// written and is bumped to the next even number when it is done. A reader
+// copies the frame out and keeps it only if sequence was the same even
+// number before and after, so readers never block the simulation and never
+// see half of one frame and half of another.
+//
+// Fields have fixed types whatever precision the simulation was built with.
+
+const unsigned sharedStateMagic = 0x52425354; // "RBST"
+const unsigned sharedStateVersion = 1;
+
+struct SharedBodyState {
+    double position[3];
+    float rotation[4];   // x, y, z, w
+    float linear[3], angular[3];
+};
+
+struct SharedStateHeader {
+    unsigned magic, version;
+    unsigned capacity;          // bodies the segment has room for
+    unsigned count;             // bodies in the current frame
+    std::atomic<unsigned long long> sequence;
+    long long step;
+    double time;
+};
+
+struct SharedStateFrame {
+    long long step;
+    double time;
+    unsigned long long sequence;
+    std::vector<SharedBodyState> bodies;
+};
+
+class StateReader {
+public:
+    StateReader(): retries(0), header(NULL), bytes(0) {}
+    ~StateReader() { close(); }
+    // name as given to StateExporter::open, e.g. "/rb-state"
+    bool open(std::string name);
+    void close();
+    bool isOpen() const { return header != NULL; }
+    // sequence of the last complete frame; frames are new when it changes
+    unsigned long long sequence() const;
+    // copies the latest complete frame, trying again while one is being
+    // written; false if none has been published yet
+    bool read(SharedStateFrame &frame);
+    long long retries; // reads thrown away because a write overlapped
+protected:
+    SharedStateHeader *header;
+    size_t bytes;
+    const SharedBodyState *bodies() const { return (const SharedBodyState*)(header + 1); }
+};
+
+bool StateReader::open(std::string name) {
+    close();
+#ifdef __unix__
+    int fd = shm_open(name.c_str(), O_RDONLY, 0);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    void *p = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(SharedStateHeader))
+        p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (p == MAP_FAILED)
+        return false;
+    header = (SharedStateHeader*)p;
+    bytes = st.st_size;
+    if (header->magic != sharedStateMagic || header->version != sharedStateVersion
+        || sizeof(SharedStateHeader) + header->capacity*sizeof(SharedBodyState) > bytes) {
+        close();
+        return false;
+    }
+    return true;
+#else
+    return false;
+#endif
+}
+
+void StateReader::close() {
+#ifdef __unix__
+    if (header)
+        munmap(header, bytes);
+#endif
+    header = NULL;
+    bytes = 0;
+}
+
+unsigned long long StateReader::sequence() const {
+    return header ? header->sequence.load(std::memory_order_acquire) & ~1ull : 0;
+}
+
+bool StateReader::read(SharedStateFrame &frame) {
+    if (!header)
+        return false;
+    for (;;) {
+        unsigned long long before = header->sequence.load(std::memory_order_acquire);
+        if (before == 0)
+            return false;
+        if (before & 1) {
+            retries++;
+#ifdef __unix__
+            sched_yield();
+#endif
+            continue;
+        }
+        unsigned count = std::min(header->count, header->capacity);
+        frame.step = header->step;
+        frame.time = header->time;
+        frame.bodies.resize(count);
+        if (count)
+            memcpy(&frame.bodies[0], bodies(), count*sizeof(SharedBodyState));
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (header->sequence.load(std::memory_order_relaxed) == before) {
+            frame.sequence = before;
+            return true;
+        }
+        retries++;
+    }
+}
+
+#endif
@@ -0,0 +1,119 @@
+#ifndef STATS_HPP
+#define STATS_HPP
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+#ifdef __unix__
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+// Counters and timings for one simulation step, filled in by World::update
+// and returned by World::stats().
+struct WorldStats {
+    long long step;
+    int bodies, awakeBodies;
+    int broadphasePairs, narrowphaseHits, contacts;
+    int filteredPairs; // overlapping pairs the collision filter rejected
+    int solverIterations, solverColors;
+    float broadphaseMs, narrowphaseMs, solverMs, groundMs, integrateMs, stepMs;
+};
+
+// Periodically writes WorldStats as one JSON object per line, either appended
+// to a file or sent as datagrams to a Unix socket. It is opt-in: World only
+// touches it when one is attached, so a disabled exporter costs one branch.
+class StatsExporter {
+public:
+    int period;
+    StatsExporter();
+    ~StatsExporter();
+    bool openFile(std::string path);
+    bool openSocket(std::string path);
+    void close();
+    void record(const WorldStats &s);
+protected:
+    FILE *file;
+    int sock;
+};
+
+StatsExporter::StatsExporter():
+    period(60), file(NULL), sock(-1) {
+}
+
+StatsExporter::~StatsExporter() {
+    close();
+}
+
+bool StatsExporter::openFile(std::string path) {
+    close();
+    file = fopen(path.c_str(), "a");
+    return file != NULL;
+}
+
+// path must name a bound SOCK_DGRAM socket, e.g. one created with
+// `socat UNIX-RECVFROM:/tmp/rb.sock,fork -`
+bool StatsExporter::openSocket(std::string path) {
+    close();
+#ifdef __unix__
+    struct sockaddr_un addr;
+    if (path.size() >= sizeof(addr.sun_path))
+        return false;
+    sock = socket(AF_UNIX, SOCK_DGRAM, 0);
+    if (sock < 0)
+        return false;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path.c_str());
+    if (connect(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        ::close(sock);
+        sock = -1;
+        return false;
+    }
+    return true;
+#else
+    return false;
+#endif
+}
+
+void StatsExporter::close() {
+    if (file)
+        fclose(file);
+    file = NULL;
+#ifdef __unix__
+    if (sock >= 0)
+        ::close(sock);
+#endif
+    sock = -1;
+}
+
+void StatsExporter::record(const WorldStats &s) {
+    if (period <= 0 || s.step % period != 0)
+        return;
+    char line[512];
+    int overlapping = s.broadphasePairs + s.filteredPairs;
+    int n = snprintf(line, sizeof(line),
+        "{\"step\":%lld,\"bodies\":%d,\"awake\":%d,\"pairs\":%d,\"filtered\":%d,"
+        "\"filter_rate\":%.4f,\"hits\":%d,"
+        "\"contacts\":%d,\"iterations\":%d,\"colors\":%d,\"broadphase_ms\":%.4f,"
+        "\"narrowphase_ms\":%.4f,\"solver_ms\":%.4f,\"ground_ms\":%.4f,"
+        "\"integrate_ms\":%.4f,\"step_ms\":%.4f}\n",
+        s.step, s.bodies, s.awakeBodies, s.broadphasePairs, s.filteredPairs,
+        overlapping ? (float)s.filteredPairs/overlapping : 0.f, s.narrowphaseHits,
+        s.contacts, s.solverIterations, s.solverColors, s.broadphaseMs, s.narrowphaseMs,
+        s.solverMs, s.groundMs, s.integrateMs, s.stepMs);
+    if (n >= (int)sizeof(line))
+        n = sizeof(line) - 1;
+    if (file) {
+        fwrite(line, 1, n, file);
+        fflush(file);
+    }
+#ifdef __unix__
+    if (sock >= 0)
+        send(sock, line, n, MSG_DONTWAIT); // drop rather than stall the step
+#endif
+}
+
+#endif
@@ -0,0 +1,583 @@
+#ifndef STREAM_HPP
+#define STREAM_HPP
+
+#include "common.hpp"
+#include "rb.hpp"
+#include "shape.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#ifdef __unix__
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+// Streams body poses from a simulation to remote viewers (viewer.cpp), so a
+// headless node can be watched without GL. StreamServer is attached to a
+// World like the exporters and sends each frame to every connected client;
+// StreamClient receives them and StreamDecoder rebuilds the poses.
+//
+// Poses are quantized: positions to multiples of positionStep along each
+// axis, rotations to the smallest three components of the unit quaternion
+// at 10 bits each, packed with the index of the dropped one in 32 bits.
+// Each message is a keyframe or a delta:
+//
+//   keyframe  'K', frame, body count, then per body its shape and color
+//             and its quantized pose
+//   delta     'D', frame, changed count, then per changed body the number
+//             of unchanged bodies skipped since the last one, which parts
+//             changed, the change in quantized position and the new
+//             rotation
+//
+// Integers are LEB128 varints, signed ones zigzag encoded, and the whole
+// message is prefixed with its length as 4 bytes. Deltas are between
+// quantized poses, so a client's copy never drifts from the server's, and
+// resting bodies cost nothing. A client gets a keyframe when it connects,
+// every keyframePeriod frames, and when the bodies change; one too slow to
+// keep up is skipped until it drains, then sent a keyframe. The handle of
+// a removed body is sent as a sphere of radius 0 at the origin until a new
+// body takes it.
+
+// what a viewer needs to draw a body; a compound is drawn as the box
+// about its center that holds it
+struct StreamShape {
+    unsigned char type;
+    float radius, halfSize[3];
+    unsigned char color[3];
+    bool operator!=(const StreamShape &s) const { return memcmp(this, &s, sizeof(s)) != 0; }
+};
+
+struct StreamPose {
+    int position[3];   // in units of positionStep
+    unsigned rotation; // smallest three
+};
+
+unsigned packRotation(const quat &q) {
+    float c[4] = {(float)q.x(), (float)q.y(), (float)q.z(), (float)q.w()};
+    int largest = 0;
+    for (int k = 1; k < 4; k++)
+        if (fabs(c[k]) > fabs(c[largest]))
+            largest = k;
+    float sign = c[largest] < 0 ? -1 : 1; // q and -q are the same rotation
+    unsigned bits = largest;
+    for (int k = 0; k < 4; k++) {
+        if (k == largest)
+            continue;
+        // the others are within +-1/sqrt(2)
+        float v = std::min(std::max(c[k]*sign*(float)M_SQRT2, -1.f), 1.f);
+        bits = bits << 10 | (unsigned)lround((v*0.5f + 0.5f)*1023);
+    }
+    return bits;
+}
+
+quat unpackRotation(unsigned bits) {
+    int largest = bits >> 30;
+    float c[4], sum = 0;
+    for (int k = 3, shift = 0; k >= 0; k--) {
+        if (k == largest)
+            continue;
+        c[k] = (((bits >> shift) & 1023)/1023.f*2 - 1)*(float)M_SQRT1_2;
+        sum += c[k]*c[k];
+        shift += 10;
+    }
+    c[largest] = sqrt(std::max(0.f, 1 - sum));
+    return quat(c[3], c[0], c[1], c[2]).normalized();
+}
+
+void putVarint(std::vector<char> &out, unsigned long long v) {
+    while (v >= 0x80) {
+        out.push_back((char)(v | 0x80));
+        v >>= 7;
+    }
+    out.push_back((char)v);
+}
+
+void putSigned(std::vector<char> &out, long long v) {
+    putVarint(out, ((unsigned long long)v << 1) ^ (unsigned long long)(v >> 63));
+}
+
+void putBytes(std::vector<char> &out, const void *data, size_t size) {
+    out.insert(out.end(), (const char*)data, (const char*)data + size);
+}
+
+// Reads what the put functions wrote, failing once past the end.
+struct StreamCursor {
+    const unsigned char *p, *end;
+    bool ok;
+    StreamCursor(const char *data, size_t size):
+        p((const unsigned char*)data), end((const unsigned char*)data + size), ok(true) {}
+    unsigned long long varint() {
+        unsigned long long v = 0;
+        for (int shift = 0; shift < 64; shift += 7) {
+            if (p == end)
+                break;
+            unsigned char b = *p++;
+            v |= (unsigned long long)(b & 0x7f) << shift;
+            if (!(b & 0x80))
+                return v;
+        }
+        ok = false;
+        return 0;
+    }
+    long long signedVarint() {
+        unsigned long long v = varint();
+        return (long long)(v >> 1) ^ -(long long)(v & 1);
+    }
+    void bytes(void *data, size_t size) {
+        if (end - p < (long)size) {
+            ok = false;
+            memset(data, 0, size);
+            return;
+        }
+        memcpy(data, p, size);
+        p += size;
+    }
+};
+
+class StreamEncoder {
+public:
+    double positionStep;
+    int keyframePeriod;
+    long long frame;
+    long long keyframes, keyframeBytes, deltas, deltaBytes; // messages built
+    StreamEncoder(): positionStep(1/1024.), keyframePeriod(60), frame(-1), keyframes(0), keyframeBytes(0),
+                     deltas(0), deltaBytes(0), shapesChanged(true) {}
+    // quantizes bodies[index[h]] for every handle h as the next frame
+    void begin(const RigidBody *bodies, const int *index, int n);
+    // true if clients that have the last frame can't be sent a delta
+    bool needsKeyframe() const { return shapesChanged || (keyframePeriod > 0 && frame % keyframePeriod == 0); }
+    // the current frame, built on first use
+    const std::vector<char> &keyframe();
+    const std::vector<char> &delta();
+    void end();
+protected:
+    std::vector<StreamShape> shapes;
+    std::vector<StreamPose> poses, last;
+    std::vector<char> key, diff;
+    bool shapesChanged, keyBuilt, diffBuilt;
+    void message(std::vector<char> &out, char type);
+};
+
+void StreamEncoder::begin(const RigidBody *bodies, const int *index, int n) {
+    frame++;
+    shapesChanged = shapesChanged || n != (int)shapes.size();
+    shapes.resize(n);
+    poses.resize(n);
+    for (int h = 0; h < n; h++) {
+        StreamShape s;
+        memset(&s, 0, sizeof(s));
+        if (index[h] < 0) {
+            memset(&poses[h], 0, sizeof(StreamPose));
+            poses[h].rotation = packRotation(quat(1, 0, 0, 0));
+            if (shapes[h] != s) {
+                shapes[h] = s;
+                shapesChanged = true;
+            }
+            continue;
+        }
+        const RigidBody &b = bodies[index[h]];
+        s.type = b.shape.type;
+        s.radius = b.shape.radius;
+        for (int k = 0; k < 3; k++) {
+            s.halfSize[k] = b.shape.halfSize[k];
+            s.color[k] = (unsigned char)lround(std::min(std::max((float)b.color[k], 0.f), 1.f)*255);
+            poses[h].position[k] = (int)llround(b.position[k]/positionStep);
+        }
+        poses[h].rotation = packRotation(b.rotation);
+        if (shapes[h] != s) {
+            shapes[h] = s;
+            shapesChanged = true;
+        }
+    }
+    keyBuilt = diffBuilt = false;
+}
+
+// room for the length, filled in when the message is complete
+void StreamEncoder::message(std::vector<char> &out, char type) {
+    out.assign(4, 0);
+    out.push_back(type);
+    putVarint(out, frame);
+}
+
+const std::vector<char> &StreamEncoder::keyframe() {
+    if (keyBuilt)
+        return key;
+    message(key, 'K');
+    putVarint(key, poses.size());
+    for (int h = 0; h < poses.size(); h++) {
+        const StreamShape &s = shapes[h];
+        key.push_back(s.type);
+        putBytes(key, &s.radius, sizeof(float));
+        putBytes(key, s.halfSize, 3*sizeof(float));
+        putBytes(key, s.color, 3);
+        for (int k = 0; k < 3; k++)
+            putSigned(key, poses[h].position[k]);
+        putBytes(key, &poses[h].rotation, 4);
+    }
+    unsigned size = key.size() - 4;
+    memcpy(&key[0], &size, 4);
+    keyBuilt = true;
+    keyframes++;
+    keyframeBytes += key.size();
+    return key;
+}
+
+const std::vector<char> &StreamEncoder::delta() {
+    if (diffBuilt)
+        return diff;
+    std::vector<char> body;
+    int changed = 0, skipped = 0;
+    for (int h = 0; h < poses.size(); h++) {
+        const StreamPose &p = poses[h], &q = last[h];
+        bool moved = p.position[0] != q.position[0] || p.position[1] != q.position[1]
+            || p.position[2] != q.position[2];
+        bool turned = p.rotation != q.rotation;
+        if (!moved && !turned) {
+            skipped++;
+            continue;
+        }
+        putVarint(body, skipped);
+        body.push_back(moved | turned << 1);
+        if (moved)
+            for (int k = 0; k < 3; k++)
+                putSigned(body, (long long)p.position[k] - q.position[k]);
+        if (turned)
+            putBytes(body, &p.rotation, 4);
+        changed++;
+        skipped = 0;
+    }
+    message(diff, 'D');
+    putVarint(diff, changed);
+    diff.insert(diff.end(), body.begin(), body.end());
+    unsigned size = diff.size() - 4;
+    memcpy(&diff[0], &size, 4);
+    diffBuilt = true;
+    deltas++;
+    deltaBytes += diff.size();
+    return diff;
+}
+
+void StreamEncoder::end() {
+    last = poses;
+    shapesChanged = false;
+}
+
+class StreamDecoder {
+public:
+    double positionStep; // must match the encoder's
+    long long frame;     // -1 until the first keyframe
+    std::vector<StreamShape> shapes;
+    std::vector<StreamPose> poses;
+    bool shapesChanged;  // by the last keyframe decoded
+    long long bytes, frames, bodyFrames; // received, for bandwidth
+    StreamDecoder(): positionStep(1/1024.), frame(-1), shapesChanged(false), bytes(0), frames(0), bodyFrames(0) {}
+    // one message without its length; false if it is malformed or a delta
+    // that does not follow the frame we have
+    bool decode(const char *data, size_t size);
+    pvec3 position(int i) const;
+    quat rotation(int i) const { return unpackRotation(poses[i].rotation); }
+};
+
+bool StreamDecoder::decode(const char *data, size_t size) {
+    StreamCursor in(data, size);
+    char type;
+    in.bytes(&type, 1);
+    long long f = in.varint();
+    if (!in.ok)
+        return false;
+    if (type == 'K') {
+        int n = in.varint();
+        if (!in.ok || n < 0 || (size_t)n > size)
+            return false;
+        std::vector<StreamShape> newShapes(n);
+        std::vector<StreamPose> newPoses(n);
+        for (int h = 0; h < n && in.ok; h++) {
+            StreamShape &s = newShapes[h];
+            memset(&s, 0, sizeof(s));
+            in.bytes(&s.type, 1);
+            in.bytes(&s.radius, sizeof(float));
+            in.bytes(s.halfSize, 3*sizeof(float));
+            in.bytes(s.color, 3);
+            for (int k = 0; k < 3; k++)
+                newPoses[h].position[k] = in.signedVarint();
+            in.bytes(&newPoses[h].rotation, 4);
+        }
+        if (!in.ok)
+            return false;
+        shapesChanged = newShapes.size() != shapes.size()
+            || (n && memcmp(&newShapes[0], &shapes[0], n*sizeof(StreamShape)) != 0);
+        shapes.swap(newShapes);
+        poses.swap(newPoses);
+    } else if (type == 'D') {
+        if (frame < 0 || f != frame + 1)
+            return false;
+        shapesChanged = false;
+        int changed = in.varint();
+        for (int c = 0, h = -1; c < changed && in.ok; c++) {
+            h += in.varint() + 1;
+            unsigned char parts;
+            in.bytes(&parts, 1);
+            if (h >= poses.size())
+                return false;
+            if (parts & 1)
+                for (int k = 0; k < 3; k++)
+                    poses[h].position[k] += in.signedVarint();
+            if (parts & 2)
+                in.bytes(&poses[h].rotation, 4);
+        }
+        if (!in.ok)
+            return false;
+    } else
+        return false;
+    frame = f;
+    bytes += size + 4;
+    frames++;
+    bodyFrames += poses.size();
+    return true;
+}
+
+pvec3 StreamDecoder::position(int i) const {
+    const StreamPose &p = poses[i];
+    return pvec3(p.position[0]*positionStep, p.position[1]*positionStep, p.position[2]*positionStep);
+}
+
+#ifdef __unix__
+
+// "unix:/path" or "tcp:host:port"; a server listens on the address, a
+// client connects to it. Returns a non-blocking socket, or -1.
+int openStreamSocket(std::string address, bool server) {
+    int fd = -1;
+    if (address.compare(0, 5, "unix:") == 0) {
+        std::string path = address.substr(5);
+        struct sockaddr_un addr;
+        if (path.size() >= sizeof(addr.sun_path))
+            return -1;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strcpy(addr.sun_path, path.c_str());
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0)
+            return -1;
+        if (server)
+            unlink(path.c_str());
+        if (server ? bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd, 8) < 0
+                   : connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+            ::close(fd);
+            return -1;
+        }
+    } else if (address.compare(0, 4, "tcp:") == 0) {
+        size_t colon = address.rfind(':');
+        std::string host = address.substr(4, colon - 4), port = address.substr(colon + 1);
+        struct addrinfo hints, *found;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = server ? AI_PASSIVE : 0;
+        if (getaddrinfo(host.empty() ? NULL : host.c_str(), port.c_str(), &hints, &found) != 0)
+            return -1;
+        for (struct addrinfo *a = found; a && fd < 0; a = a->ai_next) {
+            fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+            if (fd < 0)
+                continue;
+            int one = 1;
+            if (server)
+                setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+            else
+                setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            if (server ? bind(fd, a->ai_addr, a->ai_addrlen) < 0 || listen(fd, 8) < 0
+                       : connect(fd, a->ai_addr, a->ai_addrlen) < 0) {
+                ::close(fd);
+                fd = -1;
+            }
+        }
+        freeaddrinfo(found);
+    }
+    if (fd >= 0)
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    return fd;
+}
+
+class StreamServer {
+public:
+    StreamEncoder encoder;
+    int period;              // steps between frames
+    size_t maxPending;       // bytes queued for a client before it is skipped
+    long long bytesSent, bodyFrames, keyframesSent, framesSkipped;
+    StreamServer(): period(1), maxPending(1 << 22), bytesSent(0), bodyFrames(0), keyframesSent(0),
+                    framesSkipped(0), listener(-1) {}
+    ~StreamServer() { close(); }
+    bool listen(std::string address);
+    void close();
+    int clientCount() const { return clients.size(); }
+    // bodies[index[h]] is the body with handle h
+    void publish(long long step, const RigidBody *bodies, const int *index, int n);
+    // sends what is still queued without waiting for the next frame
+    void flush();
+    // the bandwidth so far
+    double bytesPerBodyFrame() const { return bodyFrames ? (double)bytesSent/bodyFrames : 0; }
+protected:
+    struct Client {
+        int fd;
+        std::vector<char> pending;
+        size_t sent;
+        bool needsKeyframe;
+    };
+    int listener;
+    std::string path; // of a Unix socket, removed on close
+    std::vector<Client> clients;
+    bool flush(Client &c);
+};
+
+bool StreamServer::listen(std::string address) {
+    close();
+    listener = openStreamSocket(address, true);
+    if (address.compare(0, 5, "unix:") == 0)
+        path = address.substr(5);
+    return listener >= 0;
+}
+
+void StreamServer::close() {
+    for (int i = 0; i < clients.size(); i++)
+        ::close(clients[i].fd);
+    clients.clear();
+    if (listener >= 0)
+        ::close(listener);
+    listener = -1;
+    if (!path.empty())
+        unlink(path.c_str());
+    path.clear();
+}
+
+// false if the client has gone
+bool StreamServer::flush(Client &c) {
+    while (c.sent < c.pending.size()) {
+        long k = send(c.fd, &c.pending[c.sent], c.pending.size() - c.sent, MSG_NOSIGNAL);
+        if (k < 0)
+            return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+        c.sent += k;
+        bytesSent += k;
+    }
+    c.pending.clear();
+    c.sent = 0;
+    return true;
+}
+
+void StreamServer::flush() {
+    for (int i = 0; i < clients.size(); )
+        if (flush(clients[i]))
+            i++;
+        else {
+            ::close(clients[i].fd);
+            clients.erase(clients.begin() + i);
+        }
+}
+
+void StreamServer::publish(long long step, const RigidBody *bodies, const int *index, int n) {
+    if (listener < 0 || period <= 0 || step % period != 0)
+        return;
+    for (int fd; (fd = accept(listener, NULL, NULL)) >= 0; ) {
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        Client c;
+        c.fd = fd;
+        c.sent = 0;
+        c.needsKeyframe = true;
+        clients.push_back(c);
+    }
+    encoder.begin(bodies, index, n);
+    bool key = encoder.needsKeyframe();
+    for (int i = 0; i < clients.size(); ) {
+        Client &c = clients[i];
+        bool alive = flush(c);
+        if (alive && c.pending.size() - c.sent > maxPending) {
+            framesSkipped++;
+            c.needsKeyframe = true; // missed a delta
+        } else if (alive) {
+            const std::vector<char> &m = key || c.needsKeyframe ? encoder.keyframe() : encoder.delta();
+            keyframesSent += key || c.needsKeyframe;
+            c.needsKeyframe = false;
+            c.pending.insert(c.pending.end(), m.begin(), m.end());
+            bodyFrames += n;
+            alive = flush(c);
+        }
+        if (alive)
+            i++;
+        else {
+            ::close(c.fd);
+            clients.erase(clients.begin() + i);
+        }
+    }
+    encoder.end();
+}
+
+class StreamClient {
+public:
+    StreamClient(): fd(-1) {}
+    ~StreamClient() { close(); }
+    bool connect(std::string address) {
+        close();
+        fd = openStreamSocket(address, false);
+        return fd >= 0;
+    }
+    void close() {
+        if (fd >= 0)
+            ::close(fd);
+        fd = -1;
+        buffer.clear();
+    }
+    bool isConnected() const { return fd >= 0; }
+    // decodes every complete message received so far; returns how many, or
+    // -1 once the server has gone or sent something it can't decode
+    int poll(StreamDecoder &decoder);
+protected:
+    int fd;
+    std::vector<char> buffer;
+};
+
+int StreamClient::poll(StreamDecoder &decoder) {
+    if (fd < 0)
+        return -1;
+    char chunk[1 << 16];
+    for (;;) {
+        long k = recv(fd, chunk, sizeof(chunk), 0);
+        if (k > 0) {
+            buffer.insert(buffer.end(), chunk, chunk + k);
+            continue;
+        }
+        if (k == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+            close();
+            return -1;
+        }
+        break;
+    }
+    int decoded = 0;
+    size_t at = 0;
+    while (buffer.size() - at >= 4) {
+        unsigned size;
+        memcpy(&size, &buffer[at], 4);
+        if (buffer.size() - at - 4 < size)
+            break;
+        if (!decoder.decode(&buffer[at + 4], size)) {
+            close();
+            return -1;
+        }
+        at += 4 + size;
+        decoded++;
+    }
+    buffer.erase(buffer.begin(), buffer.begin() + at);
+    return decoded;
+}
+
+#endif
+
+#endif
@@ -9,13 +9,39 @@
 #include <GL/glu.h>
 #endif
 
+#include "common.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <map>
 #include <string>
+#include <vector>
 
 class Text {
 public:
     GLuint fontOffset;
+    GLuint atlas;
     void initialize();
     void draw(std::string, float x, float y);
+    // batched drawing: queue strings between begin() and end(), which
+    // renders all of them from one vertex array in a single draw call.
+    // strings added with addStatic() are laid out once and cached.
+    void begin();
+    void add(std::string s, float x, float y, vec3 color=vec3(0,0,0));
+    void addStatic(std::string s, float x, float y, vec3 color=vec3(0,0,0));
+    void end();
+protected:
+    struct Vertex {
+        GLfloat x, y, u, v;
+        GLubyte color[4];
+    };
+    std::vector<Vertex> vertices;
+    std::map<std::string, std::vector<Vertex> > staticCache;
+    std::vector<std::string> staticKeys, lastStaticKeys;
+    size_t staticCount;
+    GLint viewport[4];
+    void layout(const std::string &s, float x, float y, vec3 color,
+                std::vector<Vertex> &out);
 };
 
 static const GLubyte rasters[127-32][13] = {
@@ -116,6 +142,10 @@ static const GLubyte rasters[127-32][13] = {
     {0x00,0x00,0x00,0x00,0x00,0x00,0x06,0x8f,0xf1,0x60,0x00,0x00,0x00} 
 };
 
+// glyphs are packed into a 128x128 alpha texture, 16 cells of 8x16 texels
+// per row, with the bitmap rows stored bottom-up like glBitmap expects
+static const int atlasSize = 128, cellWidth = 8, cellHeight = 16;
+
 inline void Text::initialize() {
     GLuint i;
     glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
@@ -125,6 +155,23 @@ inline void Text::initialize() {
 	glBitmap(8, 13, 0.0, 2.0, 10.0, 0.0, rasters[i-32]);
 	glEndList();
     }
+    std::vector<GLubyte> texels(atlasSize*atlasSize, 0);
+    for (i = 32; i < 127; i++) {
+        int cx = (i-32)%16*cellWidth, cy = (i-32)/16*cellHeight;
+        for (int r = 0; r < 13; r++)
+            for (int c = 0; c < 8; c++)
+                if (rasters[i-32][r] & (0x80 >> c))
+                    texels[(cy+r)*atlasSize + cx+c] = 255;
+    }
+    glGenTextures(1, &atlas);
+    glBindTexture(GL_TEXTURE_2D, atlas);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_ALPHA, atlasSize, atlasSize, 0,
+                 GL_ALPHA, GL_UNSIGNED_BYTE, &texels[0]);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    staticCount = 0;
+    viewport[2] = viewport[3] = 0;
 }
 
 inline void Text::draw(std::string s, float x, float y) {
@@ -145,4 +192,99 @@ inline void Text::draw(std::string s, float x, float y) {
     glPopMatrix();
 }
 
+inline void Text::begin() {
+    GLint vp[4];
+    glGetIntegerv(GL_VIEWPORT, vp);
+    if (vp[2] != viewport[2] || vp[3] != viewport[3]) {
+        // cached layouts are in pixels, so they go stale on resize
+        staticCache.clear();
+        lastStaticKeys.clear();
+    }
+    for (int k = 0; k < 4; k++)
+        viewport[k] = vp[k];
+    staticKeys.clear();
+    vertices.resize(staticCount);
+}
+
+inline void Text::add(std::string s, float x, float y, vec3 color) {
+    layout(s, x, y, color, vertices);
+}
+
+inline void Text::addStatic(std::string s, float x, float y, vec3 color) {
+    char pos[64];
+    snprintf(pos, sizeof(pos), "%g,%g,%g,%g,%g:", x, y, color[0], color[1], color[2]);
+    std::string key = pos + s;
+    if (!staticCache.count(key))
+        layout(s, x, y, color, staticCache[key]);
+    staticKeys.push_back(key);
+}
+
+inline void Text::end() {
+    if (staticKeys != lastStaticKeys) {
+        // the set of static strings changed, so rebuild the cached prefix
+        // of the vertex array and move this frame's dynamic text after it
+        std::vector<Vertex> dynamic(vertices.begin() + staticCount, vertices.end());
+        vertices.clear();
+        for (size_t k = 0; k < staticKeys.size(); k++) {
+            std::vector<Vertex> &v = staticCache[staticKeys[k]];
+            vertices.insert(vertices.end(), v.begin(), v.end());
+        }
+        staticCount = vertices.size();
+        vertices.insert(vertices.end(), dynamic.begin(), dynamic.end());
+        lastStaticKeys.swap(staticKeys);
+    }
+    if (vertices.empty())
+        return;
+    glMatrixMode(GL_PROJECTION);
+    glPushMatrix();
+    glLoadIdentity();
+    glOrtho(0, viewport[2], 0, viewport[3], -1, 1);
+    glMatrixMode(GL_MODELVIEW);
+    glPushMatrix();
+    glLoadIdentity();
+    glPushAttrib(GL_ENABLE_BIT | GL_TEXTURE_BIT | GL_CURRENT_BIT);
+    glDisable(GL_LIGHTING);
+    glDisable(GL_DEPTH_TEST);
+    glEnable(GL_TEXTURE_2D);
+    glBindTexture(GL_TEXTURE_2D, atlas);
+    glTexEnvi(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_MODULATE);
+    glPushClientAttrib(GL_CLIENT_VERTEX_ARRAY_BIT);
+    glEnableClientState(GL_VERTEX_ARRAY);
+    glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+    glEnableClientState(GL_COLOR_ARRAY);
+    glVertexPointer(2, GL_FLOAT, sizeof(Vertex), &vertices[0].x);
+    glTexCoordPointer(2, GL_FLOAT, sizeof(Vertex), &vertices[0].u);
+    glColorPointer(4, GL_UNSIGNED_BYTE, sizeof(Vertex), vertices[0].color);
+    glDrawArrays(GL_QUADS, 0, vertices.size());
+    glPopClientAttrib();
+    glPopAttrib();
+    glMatrixMode(GL_PROJECTION);
+    glPopMatrix();
+    glMatrixMode(GL_MODELVIEW);
+    glPopMatrix();
+}
+
+inline void Text::layout(const std::string &s, float x, float y, vec3 color,
+                         std::vector<Vertex> &out) {
+    // same metrics as the glBitmap glyphs: 8x13 pixels, origin 2 pixels
+    // above the bottom row, and a 10 pixel advance
+    float px = (x+1)/2*viewport[2], py = (y+1)/2*viewport[3] - 2;
+    Vertex v;
+    for (int k = 0; k < 3; k++)
+        v.color[k] = (GLubyte)(std::min(std::max((float)color[k], 0.f), 1.f)*255);
+    v.color[3] = 255;
+    for (size_t i = 0; i < s.length(); i++, px += 10) {
+        int c = (unsigned char)s[i];
+        if (c <= 32 || c >= 127)
+            continue;
+        float u0 = (float)((c-32)%16*cellWidth)/atlasSize;
+        float v0 = (float)((c-32)/16*cellHeight)/atlasSize;
+        float u1 = u0 + 8.f/atlasSize, v1 = v0 + 13.f/atlasSize;
+        v.x = px;     v.y = py;      v.u = u0; v.v = v0; out.push_back(v);
+        v.x = px + 8; v.y = py;      v.u = u1; v.v = v0; out.push_back(v);
+        v.x = px + 8; v.y = py + 13; v.u = u1; v.v = v1; out.push_back(v);
+        v.x = px;     v.y = py + 13; v.u = u0; v.v = v1; out.push_back(v);
+    }
+}
+
 #endif
@@ -0,0 +1,121 @@
+#ifndef THREAD_POOL_HPP
+#define THREAD_POOL_HPP
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A fixed set of worker threads for the data-parallel phases of a step. The
+// calling thread takes part as thread 0, so a pool of size 1 has no workers
+// and runs everything inline.
+//
+//     pool.parallelFor(n, [&](int begin, int end, int thread) { ... });
+//
+// Work is split into size() contiguous ranges in index order, the same way
+// every time, so anything written per thread and then concatenated in
+// thread order comes out the same for any number of threads.
+
+class ThreadPool {
+public:
+    explicit ThreadPool(int threads = 1);
+    ~ThreadPool();
+    int size() const { return workers.size() + 1; }
+    void resize(int threads);
+    // runs task(thread) once on each thread and waits for all of them
+    void run(const std::function<void(int)> &task);
+    // fn(begin, end, thread) over size() contiguous ranges of [0, n)
+    void parallelFor(int n, const std::function<void(int,int,int)> &fn);
+    static int hardwareThreads();
+protected:
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable wake, done;
+    const std::function<void(int)> *task;
+    long long generation;
+    int pending;
+    bool stopping;
+    void stop();
+    void work(int thread, long long seen);
+};
+
+ThreadPool::ThreadPool(int threads): task(NULL), generation(0), pending(0), stopping(false) {
+    resize(threads);
+}
+
+ThreadPool::~ThreadPool() {
+    stop();
+}
+
+int ThreadPool::hardwareThreads() {
+    int n = std::thread::hardware_concurrency();
+    return n > 0 ? n : 1;
+}
+
+void ThreadPool::stop() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (int i = 0; i < workers.size(); i++)
+        workers[i].join();
+    workers.clear();
+    stopping = false;
+}
+
+void ThreadPool::resize(int threads) {
+    if (threads < 1)
+        threads = 1;
+    if (threads == size())
+        return;
+    stop();
+    for (int t = 1; t < threads; t++)
+        workers.push_back(std::thread(&ThreadPool::work, this, t, generation));
+}
+
+// `seen` is the generation at start-up, so a task posted before this thread
+// first gets the lock is not missed
+void ThreadPool::work(int thread, long long seen) {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+        wake.wait(lock, [&] { return stopping || generation != seen; });
+        if (stopping)
+            return;
+        seen = generation;
+        lock.unlock();
+        (*task)(thread);
+        lock.lock();
+        if (--pending == 0)
+            done.notify_one();
+    }
+}
+
+void ThreadPool::run(const std::function<void(int)> &task) {
+    if (workers.empty()) {
+        task(0);
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        this->task = &task;
+        pending = workers.size();
+        generation++;
+    }
+    wake.notify_all();
+    task(0);
+    std::unique_lock<std::mutex> lock(mutex);
+    done.wait(lock, [&] { return pending == 0; });
+}
+
+void ThreadPool::parallelFor(int n, const std::function<void(int,int,int)> &fn) {
+    int threads = size();
+    run([&](int t) {
+        int begin = (long long)n*t/threads, end = (long long)n*(t+1)/threads;
+        if (begin < end)
+            fn(begin, end, t);
+    });
+}
+
+#endif
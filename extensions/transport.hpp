@@ -0,0 +1,278 @@
+#ifndef TRANSPORT_HPP
+#define TRANSPORT_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <new>
+#include <vector>
+
+#ifdef __unix__
+#include <fcntl.h>
+#include <poll.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+// Message passing between the processes of a domain-decomposed run (see
+// domain.hpp). Processes are ranks 0..n-1 in a line, and each only talks to
+// its neighbours. A transport is created once before forking, with the
+// links for every neighbouring pair, and each child then calls attach()
+// with its rank to keep only its own ends. The process that forked them
+// then calls release(), so each link is held only by its two ranks.
+//
+// The one operation is exchange(): send a message to a neighbour and
+// receive the one it sends back in the same call. Both directions are
+// pumped together, so neither side can block the other on a full buffer.
+// Implementations only provide non-blocking readSome/writeSome and a way to
+// wait for progress; framing is shared.
+//
+//     SocketTransport  a Unix stream socketpair per link
+//     ShmTransport     a pair of single-producer rings per link in shared
+//                      memory, polled with sched_yield
+//
+// Both notice a peer that has exited or crashed by its end of a socketpair
+// closing, so exchange() fails instead of waiting forever.
+
+class Transport {
+public:
+    virtual ~Transport() {}
+    virtual void attach(int rank) = 0;
+    virtual void release() = 0;
+    // false if the links could not be set up
+    virtual bool valid() const = 0;
+    // false if the link failed or the peer went away
+    bool exchange(int peer, const std::vector<char> &out, std::vector<char> &in);
+protected:
+    // bytes moved, 0 if none can be right now, -1 on error
+    virtual long writeSome(int peer, const char *data, size_t size) = 0;
+    virtual long readSome(int peer, char *data, size_t size) = 0;
+    virtual void wait(int peer, bool writing) = 0;
+};
+
+// each message is its length as 8 bytes, then the bytes
+bool Transport::exchange(int peer, const std::vector<char> &out, std::vector<char> &in) {
+    unsigned long long outSize = out.size(), inSize = 0;
+    char outHeader[8], inHeader[8];
+    memcpy(outHeader, &outSize, 8);
+    size_t sent = 0, got = 0;
+    bool sized = false;
+    while (sent < 8 + outSize || !sized || got < 8 + inSize) {
+        bool progress = false;
+        if (sent < 8 + outSize) {
+            const char *p = sent < 8 ? outHeader + sent : &out[sent - 8];
+            size_t size = sent < 8 ? 8 - sent : outSize - (sent - 8);
+            long k = writeSome(peer, p, size);
+            if (k < 0)
+                return false;
+            sent += k;
+            progress = progress || k > 0;
+        }
+        if (!sized || got < 8 + inSize) {
+            char *p = got < 8 ? inHeader + got : &in[got - 8];
+            size_t size = got < 8 ? 8 - got : inSize - (got - 8);
+            long k = readSome(peer, p, size);
+            if (k < 0)
+                return false;
+            got += k;
+            progress = progress || k > 0;
+            if (!sized && got == 8) {
+                memcpy(&inSize, inHeader, 8);
+                in.resize(inSize);
+                sized = true;
+            }
+        }
+        if (!progress)
+            wait(peer, sent < 8 + outSize);
+    }
+    return true;
+}
+
+#ifdef __unix__
+
+// A socketpair per link, for ranks 0..processes-1 in a line: link i joins
+// ranks i and i+1, and fds[2i] is i's end.
+class SocketLinks {
+public:
+    std::vector<int> fds;
+    bool ok;
+    explicit SocketLinks(int processes);
+    ~SocketLinks();
+    // closes every end but rank's own, which are made non-blocking
+    void attach(int rank);
+    void release();
+    int fd(int rank, int peer) const { return peer < rank ? fds[2*peer + 1] : fds[2*rank]; }
+};
+
+SocketLinks::SocketLinks(int processes): fds(2*(processes > 1 ? processes - 1 : 0), -1), ok(true) {
+    for (int i = 0; i + 1 < processes && ok; i++)
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, &fds[2*i]) < 0) {
+            fds[2*i] = fds[2*i + 1] = -1;
+            ok = false;
+        }
+}
+
+SocketLinks::~SocketLinks() {
+    release();
+}
+
+void SocketLinks::release() {
+    for (int i = 0; i < fds.size(); i++)
+        if (fds[i] >= 0) {
+            ::close(fds[i]);
+            fds[i] = -1;
+        }
+}
+
+void SocketLinks::attach(int rank) {
+    for (int i = 0; i < fds.size(); i++) {
+        bool mine = (i == 2*rank) || (i == 2*(rank - 1) + 1);
+        if (!mine && fds[i] >= 0) {
+            ::close(fds[i]);
+            fds[i] = -1;
+        } else if (mine)
+            fcntl(fds[i], F_SETFL, fcntl(fds[i], F_GETFL) | O_NONBLOCK);
+    }
+}
+
+class SocketTransport : public Transport {
+public:
+    explicit SocketTransport(int processes): rank(-1), links(processes) {}
+    void attach(int rank) { this->rank = rank; links.attach(rank); }
+    void release() { links.release(); }
+    bool valid() const { return links.ok; }
+protected:
+    int rank;
+    SocketLinks links;
+    int fd(int peer) const { return links.fd(rank, peer); }
+    long writeSome(int peer, const char *data, size_t size);
+    long readSome(int peer, char *data, size_t size);
+    void wait(int peer, bool writing);
+};
+
+long SocketTransport::writeSome(int peer, const char *data, size_t size) {
+    long k = send(fd(peer), data, size, MSG_NOSIGNAL);
+    if (k < 0)
+        return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 0 : -1;
+    return k;
+}
+
+long SocketTransport::readSome(int peer, char *data, size_t size) {
+    long k = recv(fd(peer), data, size, 0);
+    if (k < 0)
+        return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 0 : -1;
+    return k == 0 ? -1 : k; // 0 is end of stream
+}
+
+void SocketTransport::wait(int peer, bool writing) {
+    struct pollfd p;
+    p.fd = fd(peer);
+    p.events = POLLIN | (writing ? POLLOUT : 0);
+    poll(&p, 1, 100);
+}
+
+class ShmTransport : public Transport {
+public:
+    explicit ShmTransport(int processes, size_t capacity = 1 << 20);
+    ~ShmTransport();
+    void attach(int rank) { this->rank = rank; hangups.attach(rank); }
+    void release() { hangups.release(); }
+    bool valid() const { return (memory || links == 0) && hangups.ok; }
+protected:
+    // written by one process and read by the other; capacity is a power of two
+    struct Ring {
+        std::atomic<unsigned long long> head, tail;
+        char data[1];
+    };
+    int rank, links;
+    size_t capacity, ringBytes;
+    char *memory;
+    // carry no data; a peer's end closes when it exits, however it exits
+    SocketLinks hangups;
+    int idle; // polls that moved nothing, counted to space out the checks
+    // link i has one ring from rank i to i+1 and one back
+    Ring *ring(int from, int to) const {
+        int link = from < to ? from : to;
+        return (Ring*)(memory + (2*link + (from > to))*ringBytes);
+    }
+    long writeSome(int peer, const char *data, size_t size);
+    long readSome(int peer, char *data, size_t size);
+    void wait(int, bool) { sched_yield(); }
+    bool peerGone(int peer);
+};
+
+ShmTransport::ShmTransport(int processes, size_t capacity):
+    rank(-1), links(processes > 1 ? processes - 1 : 0), capacity(1), memory(NULL), hangups(processes), idle(0) {
+    while (this->capacity < capacity)
+        this->capacity *= 2;
+    ringBytes = (sizeof(Ring) + this->capacity + 63)/64*64;
+    if (links == 0)
+        return;
+    void *p = mmap(NULL, 2*links*ringBytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+        return;
+    memory = (char*)p;
+    for (int i = 0; i < 2*links; i++) {
+        Ring *r = (Ring*)(memory + i*ringBytes);
+        new (&r->head) std::atomic<unsigned long long>(0);
+        new (&r->tail) std::atomic<unsigned long long>(0);
+    }
+}
+
+ShmTransport::~ShmTransport() {
+    if (memory)
+        munmap(memory, 2*links*ringBytes);
+}
+
+long ShmTransport::writeSome(int peer, const char *data, size_t size) {
+    if (!memory)
+        return -1;
+    Ring *r = ring(rank, peer);
+    unsigned long long head = r->head.load(std::memory_order_relaxed);
+    unsigned long long tail = r->tail.load(std::memory_order_acquire);
+    size_t n = std::min(size, (size_t)(capacity - (head - tail)));
+    for (size_t done = 0; done < n; ) {
+        size_t at = (head + done) & (capacity - 1);
+        size_t k = std::min(n - done, capacity - at);
+        memcpy(r->data + at, data + done, k);
+        done += k;
+    }
+    r->head.store(head + n, std::memory_order_release);
+    return n == 0 && peerGone(peer) ? -1 : n;
+}
+
+long ShmTransport::readSome(int peer, char *data, size_t size) {
+    if (!memory)
+        return -1;
+    Ring *r = ring(peer, rank);
+    unsigned long long tail = r->tail.load(std::memory_order_relaxed);
+    unsigned long long head = r->head.load(std::memory_order_acquire);
+    size_t n = std::min(size, (size_t)(head - tail));
+    for (size_t done = 0; done < n; ) {
+        size_t at = (tail + done) & (capacity - 1);
+        size_t k = std::min(n - done, capacity - at);
+        memcpy(data + done, r->data + at, k);
+        done += k;
+    }
+    r->tail.store(tail + n, std::memory_order_release);
+    return n == 0 && peerGone(peer) ? -1 : n;
+}
+
+// Looks at the peer's hangup socket every 1024 idle polls, so the fast path
+// stays a load and a yield. Nothing is ever sent on it, so it is readable
+// only once the other end has closed.
+bool ShmTransport::peerGone(int peer) {
+    if (++idle % 1024)
+        return false;
+    struct pollfd p;
+    p.fd = hangups.fd(rank, peer);
+    p.events = POLLIN;
+    return poll(&p, 1, 0) > 0;
+}
+
+#endif
+
+#endif
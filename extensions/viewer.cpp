@@ -0,0 +1,111 @@
+// Remote viewer: draws the bodies a simulation streams with --stream (see
+// stream.hpp) without simulating anything itself.
+//
+//     make viewer
+//     ./viewer unix:/tmp/rb.sock
+//     ./viewer tcp:simnode:7000
+
+#include "camera.hpp"
+#include "draw.hpp"
+#include "gui.hpp"
+#include "lighting.hpp"
+#include "stream.hpp"
+#include "text.hpp"
+#include "world.hpp"
+
+#include <cmath>
+
+using namespace std;
+
+Window window;
+Camera camera;
+Lighting lighting;
+Text text;
+World world; // only drawn, never stepped
+StreamClient client;
+StreamDecoder decoder;
+
+float dt = 1/60.;
+bool surface = true;
+bool hud = true;
+
+// bodies are rebuilt only when the shapes change, and moved every frame
+void syncWorld() {
+    if (decoder.shapesChanged) {
+        world.clear();
+        for (int i = 0; i < decoder.shapes.size(); i++) {
+            const StreamShape &s = decoder.shapes[i];
+            RigidBody rb;
+            rb.init(s.type, 1, 0, 0, s.radius, vec3(s.halfSize[0], s.halfSize[1], s.halfSize[2]));
+            rb.color = vec3(s.color[0], s.color[1], s.color[2])/255;
+            world.add(rb);
+        }
+        decoder.shapesChanged = false;
+    }
+    for (int i = 0; i < decoder.poses.size(); i++)
+        world.body(i).setTransform(decoder.position(i), decoder.rotation(i));
+}
+
+void drawWorld() {
+    camera.apply(window);
+    lighting.apply();
+    clear(vec3(0.9,0.9,0.9));
+    setColor(vec3(0.7,0.7,0.7));
+    for (int i = -3; i <= 3; i++) {
+        drawLine(vec3(-3,0,i), vec3(3,0,i));
+        drawLine(vec3(i,0,-3), vec3(i,0,3));
+    }
+    world.draw(surface, false);
+
+    text.begin();
+    text.addStatic("WASD and LShift/LCtrl to move camera", -0.9, 0.90);
+    text.addStatic("Mouse to rotate view", -0.9, 0.85);
+    text.addStatic("V to toggle surface view", -0.9, 0.80);
+    text.addStatic("H to toggle bandwidth", -0.9, 0.75);
+    if (!client.isConnected())
+        text.addStatic("DISCONNECTED", 0.8, 0.80);
+    if (hud) {
+        char line[128];
+        snprintf(line, sizeof(line), "frame %lld  bodies %d  %.2f bytes/body/frame  %.1f KB/frame",
+                 decoder.frame, (int)decoder.poses.size(),
+                 decoder.bodyFrames ? (double)decoder.bytes/decoder.bodyFrames : 0.,
+                 decoder.frames ? decoder.bytes/1024./decoder.frames : 0.);
+        text.add(line, 0.2, 0.95);
+    }
+    text.end();
+}
+
+void keyPressed(int key) {
+    if (key == GLFW_KEY_V)
+        surface = !surface;
+    if (key == GLFW_KEY_H)
+        hud = !hud;
+    if (key == GLFW_KEY_ESCAPE)
+        exit(0);
+}
+
+int main(int argc, char **argv) {
+    if (argc != 2) {
+        cerr << "usage: " << argv[0] << " unix:/path|tcp:host:port" << endl;
+        return 1;
+    }
+    if (!client.connect(argv[1])) {
+        cerr << "cannot connect to " << argv[1] << endl;
+        return 1;
+    }
+    window.create("Viewer", 1024, 768);
+    window.onKeyPress(keyPressed);
+    camera.lookAt(vec3(15,3,15), vec3(0,2.5,0));
+    lighting.createDefault();
+    text.initialize();
+
+    while (!window.shouldClose()) {
+        camera.processInput(window);
+        if (client.poll(decoder) > 0)
+            syncWorld();
+        window.prepareDisplay();
+        drawWorld();
+        window.updateDisplay();
+        window.waitForNextFrame(dt);
+    }
+}
@@ -1,35 +1,538 @@
 #ifndef WORLD_HPP
 #define WORLD_HPP
 
+#include "broadphase.hpp"
+#include "collide.hpp"
 #include "common.hpp"
+#include "contact_solver.hpp"
 #include "draw.hpp"
+#include "morton.hpp"
+#include "profiler.hpp"
+#include "radix_sort.hpp"
 #include "rb.hpp"
+#include "sphere_batch.hpp"
+#include "state_export.hpp"
+#include "stats.hpp"
+#include "stream.hpp"
+#include "thread_pool.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstring>
 #include <math.h>
 
 using namespace std;
 
+// Everything World::spawn needs to create a body. Bodies spawned from
+// descriptions sharing a Shape share its collision samples, so make each
+// kind of shape once and reuse it.
+struct BodyDesc {
+    Shape shape;
+    scalar mass, eta, nu;
+    vec3 color;
+    pvec3 position;
+    quat rotation;
+    vec3 linear_velocity, angular_velocity;
+    int type; // a BodyType
+    unsigned group, mask;
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+    BodyDesc(): mass(1), eta(0), nu(0), color(1,1,1), position(0,0,0), rotation(1,0,0,0),
+                linear_velocity(0,0,0), angular_velocity(0,0,0), type(DYNAMIC), group(1), mask(~0u) {}
+};
+
 class World {
 public:
-    vector<RigidBody*> rbs;
+    // Bodies are stored contiguously and periodically reordered along a
+    // Z-order curve of their positions, so neighbours in space are
+    // neighbours in memory. Indices into rbs therefore change; code that
+    // keeps hold of a body uses the handle add() or spawn() returned.
+    // remove() fills the hole with the last body, and the removed body's
+    // handle is reused by a later add.
+    vector<RigidBody, Eigen::aligned_allocator<RigidBody> > rbs;
+    // candidate pairs from the broadphase, bucketed by shape types with the
+    // lower type first
+    vector< pair<int,int> > pairs[NUM_SHAPE_TYPES][NUM_SHAPE_TYPES];
+    StatsExporter *exporter;
+    StateExporter *stateExporter; // body states for other processes, if set
+    StreamServer *streamer;       // poses for remote viewers, if set
+    scalar sleepSpeed;
+    int integrator;
+    int reorderPeriod; // steps between reorders, 0 to keep insertion order
+    ThreadPool pool;   // one thread by default; resize() for more
+    Broadphase broadphase;
+    CollisionFilter filter; // pairs of handles that never collide
+    ContactSolver solver;
+
+    World(): exporter(NULL), stateExporter(NULL), streamer(NULL), sleepSpeed(1e-3), integrator(EULER), reorderPeriod(60),
+             stepCount(0), elapsed(0), staticsDirty(true)
+    {
+        memset(&lastStats, 0, sizeof(lastStats));
+    }
+
+    // adds a copy of rb and returns its handle
+    int add(const RigidBody &rb)
+    {
+        rbs.push_back(rb);
+        return added(rbs.size() - 1);
+    }
+
+    // makes room for n bodies in all, so adding up to that many reallocates
+    // nothing
+    void reserve(int n)
+    {
+        rbs.reserve(n);
+        handleIndex.reserve(n);
+        indexHandle.reserve(n);
+        moving.reserve(n);
+        movingSlot.reserve(n);
+    }
+
+    // Creates n bodies from descs in one pass over new storage at the end,
+    // and writes their handles to `handles` if it is not NULL
+    void spawn(const BodyDesc *descs, int n, int *handles = NULL)
+    {
+        int first = rbs.size();
+        // grown geometrically, as push_back would, so many small spawns
+        // into a world without spare room don't each move every body
+        if (first + n > rbs.capacity())
+            reserve(std::max(first + n, 2*(int)rbs.capacity()));
+        rbs.resize(first + n);
+        for (int k = 0; k < n; ++k)
+        {
+            const BodyDesc &d = descs[k];
+            RigidBody &rb = rbs[first + k];
+            rb.shape = d.shape;
+            rb.mass = d.mass;
+            rb.eta = d.eta;
+            rb.nu = d.nu;
+            rb.color = d.color;
+            rb.type = d.type;
+            rb.group = d.group;
+            rb.mask = d.mask;
+            rb.inertia_matrix = rb.shape.moment()*rb.mass;
+            rb.inverse_inertia_body = rb.inertia_matrix.diagonal().cwiseInverse();
+            rb.setTransform(d.position, d.rotation);
+            rb.linear_velocity = d.linear_velocity;
+            rb.angular_velocity = d.angular_velocity;
+            int h = added(first + k);
+            if (handles)
+                handles[k] = h;
+        }
+    }
+
+    // Removes a body in constant time by moving the last body into its
+    // place. Other handles stay valid. Removing a static body rebuilds the
+    // static tree on the next step.
+    void remove(int handle)
+    {
+        int i = handleIndex[handle], last = rbs.size() - 1;
+        if (rbs[i].type == STATIC)
+            staticsDirty = true;
+        else if (!staticsDirty)
+        {
+            int slot = movingSlot[i];
+            moving[slot] = moving.back();
+            movingSlot[moving[slot]] = slot;
+            moving.pop_back();
+        }
+        if (i != last)
+        {
+            rbs[i] = std::move(rbs[last]);
+            indexHandle[i] = indexHandle[last];
+            handleIndex[indexHandle[i]] = i;
+            if (!staticsDirty)
+            {
+                if (rbs[i].type == STATIC)
+                    staticTree.relabel(last, i);
+                else
+                {
+                    moving[movingSlot[last]] = i;
+                    movingSlot[i] = movingSlot[last];
+                }
+            }
+        }
+        rbs.pop_back();
+        indexHandle.pop_back();
+        movingSlot.pop_back();
+        handleIndex[handle] = -1;
+        freeHandles.push_back(handle);
+        if (!filter.empty())
+            filter.forget(handle);
+    }
+
+    // whether a handle names a body, rather than one removed
+    bool contains(int handle) const
+    {
+        return handle >= 0 && handle < handleIndex.size() && handleIndex[handle] >= 0;
+    }
+
+    // Static bodies are found once and kept in a tree of their own, and the
+    // others in a list; after moving a static body or changing any body's
+    // type, call this to have them found again
+    void staticsChanged()
+    {
+        staticsDirty = true;
+    }
+
+    // removes every body, for reuse with a new scene
+    void clear()
+    {
+        rbs.clear();
+        handleIndex.clear();
+        indexHandle.clear();
+        freeHandles.clear();
+        filter.clear();
+        moving.clear();
+        movingSlot.clear();
+        staticsDirty = true;
+        stepCount = 0;
+        elapsed = 0;
+        memset(&lastStats, 0, sizeof(lastStats));
+    }
+
+    RigidBody &body(int handle)
+    {
+        return rbs[handleIndex[handle]];
+    }
+
+    // sorts the bodies that are not static by the Morton code of each
+    // position within their bounding box, into the slots they already take,
+    // and remaps the handles. Static bodies stay where they are, so their
+    // tree stays valid.
+    void reorder()
+    {
+        if (staticsDirty)
+            findStatics();
+        int n = moving.size();
+        if (n < 2)
+            return;
+        // remove() leaves the slots out of order
+        std::sort(moving.begin(), moving.end());
+        for (int i = 0; i < n; ++i)
+            movingSlot[moving[i]] = i;
+        pvec3 lo = rbs[moving[0]].position, hi = lo;
+        for (int i = 1; i < n; ++i)
+        {
+            lo = lo.cwiseMin(rbs[moving[i]].position);
+            hi = hi.cwiseMax(rbs[moving[i]].position);
+        }
+        pvec3 inv;
+        for (int k = 0; k < 3; ++k)
+            inv[k] = hi[k] > lo[k] ? 1/(hi[k] - lo[k]) : 0;
+        keys.resize(n);
+        order.resize(n);
+        for (int i = 0; i < n; ++i)
+        {
+            keys[i] = mortonCode(rbs[moving[i]].position, lo, inv);
+            order[i] = i;
+        }
+        // stable, so bodies sharing a cell keep their relative order
+        sorter.sort(keys, order, 30, pool);
+        vector<RigidBody, Eigen::aligned_allocator<RigidBody> > sorted;
+        sorted.reserve(n);
+        vector<int> handles(n);
+        for (int i = 0; i < n; ++i)
+        {
+            sorted.push_back(std::move(rbs[moving[order[i]]]));
+            handles[i] = indexHandle[moving[order[i]]];
+        }
+        for (int i = 0; i < n; ++i)
+        {
+            rbs[moving[i]] = std::move(sorted[i]);
+            indexHandle[moving[i]] = handles[i];
+            handleIndex[handles[i]] = moving[i];
+        }
+    }
+
+    void update(scalar dt)
+    {
+        PROFILE_SCOPE("step");
+        chrono::steady_clock::time_point start = chrono::steady_clock::now(), t = start;
+        WorldStats s;
+        memset(&s, 0, sizeof(s));
+        {
+            PROFILE_SCOPE("broadphase");
+            if (reorderPeriod > 0 && stepCount % reorderPeriod == 0)
+                reorder();
+            findPairs();
+            for (int i = 0; i < NUM_SHAPE_TYPES; ++i)
+                for (int j = 0; j < NUM_SHAPE_TYPES; ++j)
+                    s.broadphasePairs += pairs[i][j].size();
+            s.filteredPairs = broadphase.rejectedCount();
+            s.broadphaseMs = lap(t);
+        }
+        {
+            PROFILE_SCOPE("narrowphase");
+            narrowphase();
+            for (int k = 0; k < threadHits.size(); ++k)
+                s.narrowphaseHits += threadHits[k];
+            s.narrowphaseMs = lap(t);
+        }
+        {
+            PROFILE_SCOPE("solve");
+            s.contacts += solver.solve(rbs.data(), rbs.size(), dt, pool);
+            s.solverColors = solver.colorCount();
+            s.solverMs = lap(t);
+        }
+        {
+            PROFILE_SCOPE("ground");
+            for (int k = 0; k < moving.size(); ++k)
+                if (rbs[moving[k]].isDynamic())
+                    s.contacts += rbs[moving[k]].collisionGround(dt);
+            s.groundMs = lap(t);
+        }
+        {
+            PROFILE_SCOPE("integrate");
+            for (int k = 0; k < moving.size(); ++k)
+            {
+                RigidBody &rb = rbs[moving[k]];
+                if (rb.type == KINEMATIC)
+                    rb.move(dt);
+                else
+                    rb.update(dt,integrator);
+                s.awakeBodies += (rb.linear_velocity.squaredNorm() + rb.angular_velocity.squaredNorm() > sleepSpeed*sleepSpeed);
+            }
+            s.integrateMs = lap(t);
+        }
+        // impulses are applied in a single pass over the contacts
+        s.solverIterations = 1;
+        s.bodies = rbs.size();
+        s.step = stepCount++;
+        s.stepMs = lap(start);
+        lastStats = s;
+        elapsed += dt;
+        if (exporter)
+            exporter->record(s);
+        if (stateExporter)
+            stateExporter->publish(s.step, elapsed, rbs.data(), handleIndex.data(), handleIndex.size());
+        if (streamer)
+            streamer->publish(s.step, rbs.data(), handleIndex.data(), handleIndex.size());
+    }
 
-    void update(float dt)
+    // counters and timings of the most recent update()
+    const WorldStats &stats() const
     {
+        return lastStats;
+    }
+
+    // All pairs whose bounding spheres overlap and that the collision filter
+    // lets through, from the parallel broadphase, bucketed by shape type.
+    // Each pair is stored with the body of the lower shape type first, as
+    // the bucket pairs[ti][tj] has ti <= tj; only where both types are the
+    // same is it the lower index first. Only dynamic and kinematic bodies are
+    // in the tree rebuilt each step; static bodies are met through their own
+    // tree, rebuilt only when they change, so static-static pairs are never
+    // looked at.
+    void findPairs()
+    {
+        for (int i = 0; i < NUM_SHAPE_TYPES; ++i)
+            for (int j = 0; j < NUM_SHAPE_TYPES; ++j)
+                pairs[i][j].clear();
+        if (staticsDirty)
+            findStatics();
+        broadphase.build(rbs.data(), moving.data(), moving.size(), pool);
+        broadphase.findPairs(pool, indexHandle.data(), &filter, &staticTree);
+        for (int t = 0; t < broadphase.threadPairs.size(); ++t)
+        {
+            const vector< pair<int,int> > &found = broadphase.threadPairs[t];
+            for (int k = 0; k < found.size(); ++k)
+            {
+                int i = min(found[k].first, found[k].second), j = max(found[k].first, found[k].second);
+                int ti = rbs[i].shape.type, tj = rbs[j].shape.type;
+                if (ti <= tj)
+                    pairs[ti][tj].push_back(make_pair(i,j));
+                else
+                    pairs[tj][ti].push_back(make_pair(j,i));
+            }
+        }
+    }
+
+    // sorts the bodies into the static tree and the list of the others
+    void findStatics()
+    {
+        vector<int> statics;
+        moving.clear();
+        movingSlot.assign(rbs.size(), -1);
         for (int i = 0; i < rbs.size(); ++i)
+            if (rbs[i].type == STATIC)
+                statics.push_back(i);
+            else
+            {
+                movingSlot[i] = moving.size();
+                moving.push_back(i);
+            }
+        staticTree.build(rbs.data(), statics.data(), statics.size(), pool);
+        staticsDirty = false;
+    }
+
+    // Contact generation, in parallel: each thread takes a contiguous share
+    // of every bucket and writes what it finds to its own buffer. Nothing is
+    // applied to the bodies until the solver has merged the buffers.
+    void narrowphase()
+    {
+        int threads = pool.size();
+        threadContacts.resize(threads);
+        for (int k = 0; k < threads; ++k)
+            threadContacts[k].clear();
+        threadHits.assign(threads, 0);
+        threadSphereBatch.resize(threads);
+        threadSphereContacts.resize(threads);
+        // one loop per bucket with the shape types fixed at compile time;
+        // sphere pairs go through the batched kernel instead
+        pool.parallelFor(pairs[SPHERE][SPHERE].size(), [&](int begin, int end, int t) {
+            collideSpheres(begin, end, t);
+        });
+        collidePairs<SphereShape,BoxShape>();
+        collidePairs<SphereShape,CapsuleShape>();
+        collidePairs<SphereShape,CylinderShape>();
+        collidePairs<SphereShape,CompoundShape>();
+        collidePairs<BoxShape,BoxShape>();
+        collidePairs<BoxShape,CapsuleShape>();
+        collidePairs<BoxShape,CylinderShape>();
+        collidePairs<BoxShape,CompoundShape>();
+        collidePairs<CapsuleShape,CapsuleShape>();
+        collidePairs<CapsuleShape,CylinderShape>();
+        collidePairs<CapsuleShape,CompoundShape>();
+        collidePairs<CylinderShape,CylinderShape>();
+        collidePairs<CylinderShape,CompoundShape>();
+        collidePairs<CompoundShape,CompoundShape>();
+        solver.merge(threadContacts);
+    }
+
+    template <class A, class B>
+    void collidePairs()
+    {
+        const vector< pair<int,int> > &bucket = pairs[A::type][B::type];
+        pool.parallelFor(bucket.size(), [&](int begin, int end, int t) {
+            collideBucket<A,B>(bucket, begin, end, t);
+        });
+    }
+
+    template <class A, class B>
+    void collideBucket(const vector< pair<int,int> > &bucket, int begin, int end, int t)
+    {
+        vector<ContactConstraint> &out = threadContacts[t];
+        int hits = 0;
+        for (int k = begin; k < end; ++k)
         {
-            for (int j = i+1; j < rbs.size(); ++j)
+            int i = bucket[k].first, j = bucket[k].second;
+            Contact c;
+            if (!Narrowphase<A,B>::test(&rbs[i], &rbs[j], (rbs[j].position - rbs[i].position).template cast<scalar>(), c))
+                continue;
+            hits++;
+            // touching, but with nothing to push along
+            if (c.normal.squaredNorm() == 0)
+                continue;
+            out.push_back(ContactConstraint(i, j, c, Narrowphase<A,B>::friction, Narrowphase<A,B>::pushOut));
+        }
+        threadHits[t] += hits;
+    }
+
+    void collideSpheres(int begin, int end, int t)
+    {
+        const vector< pair<int,int> > &bucket = pairs[SPHERE][SPHERE];
+        SpherePairBatch &batch = threadSphereBatch[t];
+        SphereContacts &contacts = threadSphereContacts[t];
+        // The kernel works in float. Where scalar is wider it only filters,
+        // with radii a little larger than float's rounding, and each pair it
+        // keeps is tested again at full precision, so a double build finds
+        // the same contacts with the same normals as Narrowphase::test.
+        const bool recheck = sizeof(scalar) > sizeof(float);
+        const scalar slack = recheck ? 1 + 1e-5 : 1;
+        batch.clear();
+        for (int k = begin; k < end; ++k)
+        {
+            RigidBody *a = &rbs[bucket[k].first], *b = &rbs[bucket[k].second];
+            batch.add(bucket[k].first, bucket[k].second, (b->position - a->position).cast<scalar>(),
+                      a->shape.radius*slack, b->shape.radius*slack);
+        }
+        sphereSphereBatch(batch, contacts);
+        int hits = 0;
+        for (int c = 0; c < contacts.size(); ++c)
+        {
+            // the offset is taken again at full precision for the response
+            int k = contacts.pair[c];
+            RigidBody *a = &rbs[batch.a[k]], *b = &rbs[batch.b[k]];
+            vec3 delta = (b->position - a->position).cast<scalar>();
+            Contact contact;
+            if (recheck)
             {
-                rbs[i]->collisionBody(rbs[j],dt);
+                if (!Narrowphase<SphereShape,SphereShape>::test(a, b, delta, contact))
+                    continue;
             }
-            rbs[i]->collisionGround(dt);
+            else
+                Narrowphase<SphereShape,SphereShape>::fill(a, b, delta, contacts.normal(c), contact);
+            hits++;
+            // concentric, with nothing to push along, as in collideBucket
+            if (contact.normal.squaredNorm() == 0)
+                continue;
+            threadContacts[t].push_back(ContactConstraint(batch.a[k], batch.b[k], contact,
+                                                          Narrowphase<SphereShape,SphereShape>::friction,
+                                                          Narrowphase<SphereShape,SphereShape>::pushOut));
         }
-        for(RigidBody* rb : rbs)
-            rb->update(dt);
+        threadHits[t] += hits;
     }
 
     void draw(bool surface, bool arrow)
     {
-        for(RigidBody* rb : rbs)
-            rb->draw(surface,arrow);
+        for(RigidBody &rb : rbs)
+            rb.draw(surface,arrow);
+    }
+
+protected:
+    // per narrowphase thread: contacts found, hits, and kernel scratch space
+    vector< vector<ContactConstraint> > threadContacts;
+    vector<int> threadHits;
+    vector<SpherePairBatch> threadSphereBatch;
+    vector<SphereContacts> threadSphereContacts;
+    long long stepCount;
+    double elapsed; // simulated time
+    Broadphase staticTree;
+    bool staticsDirty;
+    vector<int> moving;     // indices of the bodies that are not static
+    vector<int> movingSlot; // per body, its place in moving or -1
+    vector<int> freeHandles;
+
+    // gives the body just stored at index i a handle, reusing a free one
+    int added(int i)
+    {
+        int h;
+        if (freeHandles.empty())
+        {
+            h = handleIndex.size();
+            handleIndex.push_back(i);
+        }
+        else
+        {
+            h = freeHandles.back();
+            freeHandles.pop_back();
+            handleIndex[h] = i;
+        }
+        indexHandle.push_back(h);
+        if (rbs[i].type == STATIC)
+        {
+            staticsDirty = true;
+            movingSlot.push_back(-1);
+        }
+        else
+        {
+            movingSlot.push_back(moving.size());
+            moving.push_back(i);
+        }
+        return h;
+    }
+    WorldStats lastStats;
+    vector<int> handleIndex, indexHandle;
+    RadixSorter sorter;
+    vector<unsigned int> keys;
+    vector<int> order;
+
+    // milliseconds since t, and resets t to now
+    static float lap(chrono::steady_clock::time_point &t)
+    {
+        chrono::steady_clock::time_point now = chrono::steady_clock::now();
+        float ms = chrono::duration<float, milli>(now - t).count();
+        t = now;
+        return ms;
     }
 };
 #endif